@@ -1,16 +1,27 @@
+#define _GNU_SOURCE
 #include "archive.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dirent.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <errno.h>
 #include "../rle/rle.h"
 #include "../huffman/huffman.h"
+#include "../hybrid/hybrid.h"
+#include "../codec/codec.h"
 #include "../reports/compression_report.h"
 #include "../utils/bit_manipulation.h"
+#include "../utils/thread_pool.h"
+#include "../utils/varint.h"
+#include "../utils/crc32.h"
+#include "../utils/output_sink.h"
+#include "../frame/frame.h"
+#include "directory_scan.h"
 #include <limits.h>
 
 // Fallback definition if not provided by system headers
@@ -18,19 +29,43 @@
 #define PATH_MAX 4096
 #endif
 
-// External report variable
-extern CompressionReport report;
 
-// Compresses input to output with the given compression level. Returns 0 on success, < 0 on error.
-int hybrid_compress(FILE *input, FILE *output, int level);
+// Entry header, written in front of every payload:
+//   uint16 little-endian size of the rest of the header | codec id | flags |
+//   uint64 little-endian compressed size | varint original size |
+//   varint mode | varint mtime (zigzag) | varint path length | path
+// Paths are relative to the archive root. The compressed size has a fixed
+// width so it can be patched once the payload is written; with
+// ARCHIVE_FLAG_DESCRIPTOR it is 0 and the size follows the payload in a
+// descriptor: "CMPD" and the size as a 64-bit little-endian number.
+// A solid block (ARCHIVE_FLAG_SOLID) holds several small files compressed
+// as one payload; its header has an empty path, mode and mtime 0 and the
+// total size of the files, which only the central directory lists.
+#define ARCHIVE_HEADER_FIXED_SIZE 12
+#define ARCHIVE_HEADER_MAX_SIZE (ARCHIVE_HEADER_FIXED_SIZE + 4 * VARINT_MAX_BYTES + PATH_MAX)
+#define ARCHIVE_COMPRESSED_SIZE_OFFSET 4
+#define ARCHIVE_FLAG_DESCRIPTOR 0x01
+#define ARCHIVE_FLAG_SOLID 0x02
+#define ARCHIVE_DESCRIPTOR_MAGIC "CMPD"
+#define ARCHIVE_DESCRIPTOR_SIZE 12
 
-// Define a structure for file metadata
-typedef struct {
-    char filepath[PATH_MAX];
-    off_t size;
-    mode_t mode;
-    time_t mtime;
-} FileMetadata;
+// Central directory, written after the last entry:
+//   version | varint entry count | entries |
+//   uint64 little-endian directory size | "CMPC"
+// Entry: varint path length | path | codec id | flags | varint size |
+//   varint compressed size | varint offset of the entry header |
+//   [varint offset in the block, solid entries only] |
+//   varint mode | varint mtime (zigzag) | varint inode |
+//   uint32 little-endian CRC-32 of the data
+// Files in a solid block have the offset and compressed size of the block.
+// The inode is only used to tell unchanged files when updating an archive.
+// The directory size covers everything from the version to the last entry.
+#define ARCHIVE_DIRECTORY_MAGIC "CMPC"
+#define ARCHIVE_DIRECTORY_VERSION 4
+#define ARCHIVE_FOOTER_SIZE 12
+#define ARCHIVE_ENTRY_MAX_SIZE (VARINT_MAX_BYTES + 2 + 7 * VARINT_MAX_BYTES + 4)
+#define ARCHIVE_ENTRY_MIN_SIZE (1 + 1 + 2 + 6 + 4)
+#define ARCHIVE_ENTRY_SOLID 0x01
 
 // Function to compress a single file
 int compress_single_file(const char *input_file, FILE *output_file, CompressionAlgorithm algorithm, CompressionLevel level) {
@@ -66,219 +101,1885 @@ int compress_single_file(const char *input_file, FILE *output_file, CompressionA
     return 0;
 }
 
-// Function to write file metadata to archive
-int write_file_metadata(FILE *archive, const FileMetadata *metadata) {
-    if (fwrite(metadata, sizeof(FileMetadata), 1, archive) != 1) {
-        perror("Error writing file metadata");
-        return -1;
+static void store_le64(uint8_t *dst, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        dst[i] = (uint8_t)(value >> (8 * i));
     }
-    return 0;
 }
 
-// Function to read file metadata from archive
-int read_file_metadata(FILE *archive, FileMetadata *metadata) {
-    if (fread(metadata, sizeof(FileMetadata), 1, archive) != 1) {
-        if (feof(archive)) {
-            return 0; // End of archive
+static uint64_t load_le64(const uint8_t *src) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= (uint64_t)src[i] << (8 * i);
+    }
+    return value;
+}
+
+// Encodes the header of an entry into dst, which must have room for
+// ARCHIVE_HEADER_MAX_SIZE. Returns the number of bytes written.
+static size_t encode_entry_header(const ArchiveEntry *entry, int flags, uint8_t *dst) {
+    size_t path_length = strlen(entry->path);
+    dst[2] = (uint8_t)entry->codec;
+    dst[3] = (uint8_t)flags;
+    store_le64(dst + ARCHIVE_COMPRESSED_SIZE_OFFSET, entry->compressed_size);
+
+    size_t size = ARCHIVE_HEADER_FIXED_SIZE;
+    size += encode_varint(entry->size, dst + size);
+    size += encode_varint(entry->mode, dst + size);
+    size += encode_varint(zigzag_encode(entry->mtime), dst + size);
+    size += encode_varint(path_length, dst + size);
+    memcpy(dst + size, entry->path, path_length);
+    size += path_length;
+
+    dst[0] = (uint8_t)(size - 2);
+    dst[1] = (uint8_t)((size - 2) >> 8);
+    return size;
+}
+
+// Reads an entry header, copying its path, NUL-terminated, to name, which
+// holds PATH_MAX bytes. The header is read with two calls, its size and
+// then the rest, and parsed in one pass. Returns the header size, 0 if it cannot be read or is invalid.
+static size_t read_entry_header(FILE *archive, ArchiveEntry *entry, char *name, int *flags) {
+    uint8_t header[ARCHIVE_HEADER_MAX_SIZE];
+    if (fread(header, 1, 2, archive) != 2) {
+        return 0;
+    }
+    size_t size = 2 + ((size_t)header[0] | (size_t)header[1] << 8);
+    if (size <= ARCHIVE_HEADER_FIXED_SIZE || size > sizeof(header) ||
+        fread(header + 2, 1, size - 2, archive) != size - 2) {
+        return 0;
+    }
+
+    entry->codec = header[2];
+    *flags = header[3];
+    entry->compressed_size = load_le64(header + ARCHIVE_COMPRESSED_SIZE_OFFSET);
+
+    uint64_t mode, mtime, path_length;
+    uint64_t *fields[] = { &entry->size, &mode, &mtime, &path_length };
+    size_t pos = ARCHIVE_HEADER_FIXED_SIZE;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        size_t used = decode_varint(header + pos, size - pos, fields[i]);
+        if (used == 0) {
+            return 0;
         }
-        perror("Error reading file metadata");
-        return -1;
+        pos += used;
+    }
+
+    // The path ends the header; only solid blocks have none
+    if ((path_length == 0 && !(*flags & ARCHIVE_FLAG_SOLID)) || path_length >= PATH_MAX || path_length != size - pos ||
+        memchr(header + pos, '\0', path_length) != NULL) {
+        return 0;
     }
-    return 1;
+    memcpy(name, header + pos, path_length);
+    name[path_length] = '\0';
+    entry->path = name;
+    entry->mode = (uint32_t)mode;
+    entry->mtime = zigzag_decode(mtime);
+    return size;
 }
 
-int compress_directory(const char *input_dir, const char *output_archive, CompressionAlgorithm algorithm, CompressionLevel level) {
-    // Open the output archive file
-    FILE *archive_file = fopen(output_archive, "wb");
-    if (!archive_file) {
-        perror("Error opening output archive file");
+
+// Compresses the rest of the input with the chosen algorithm. Huffman
+// input is coded with the caller's builder if one is given, otherwise on
+// thread_count threads. Returns 0 on success, -1 on error.
+static int compress_stream(FILE *input_file, FILE *output_file, CompressionAlgorithm algorithm,
+                           CompressionLevel level, HuffmanBuilder *builder, int thread_count) {
+    switch (algorithm) {
+        case ALG_RLE:
+            return rle_compress_advanced(input_file, output_file, level);
+        case ALG_HUFFMAN:
+            if (builder) {
+                return huffman_compress_with_builder(input_file, output_file, builder, huffman_block_size(level),
+                                                     NULL, NULL);
+            }
+            return huffman_compress_blocks(input_file, output_file, huffman_block_size(level), thread_count,
+                                           NULL, NULL, NULL);
+        case ALG_HYBRID:
+            return hybrid_compress(input_file, output_file, hybrid_block_size(level), thread_count,
+                                   NULL, NULL, NULL, NULL);
+        default:
+            fprintf(stderr, "Unsupported compression algorithm.\n");
+            return -1;
+    }
+}
+
+// Decompresses an entry payload with the decoder of a codec id.
+// Returns 0 on success, -1 on error.
+static int decompress_stream(FILE *input_file, FILE *output_file, int codec) {
+    switch (codec) {
+        case FRAME_CODEC_RLE:
+            return rle_decompress(input_file, output_file);
+        case FRAME_CODEC_HUFFMAN:
+            return huffman_decompress(input_file, output_file);
+        case FRAME_CODEC_HYBRID:
+            return hybrid_decompress(input_file, output_file);
+        default:
+            fprintf(stderr, "Unknown codec %d in archive\n", codec);
+            return -1;
+    }
+}
+
+// Algorithm of a codec id. Returns -1 for an unknown codec.
+static int codec_algorithm(int codec) {
+    switch (codec) {
+        case FRAME_CODEC_RLE:
+            return ALG_RLE;
+        case FRAME_CODEC_HUFFMAN:
+            return ALG_HUFFMAN;
+        case FRAME_CODEC_HYBRID:
+            return ALG_HYBRID;
+        default:
+            return -1;
+    }
+}
+
+// Input stream that checksums a file while a compressor reads it. Bytes
+// are summed for as long as they are read in order; checksum_source_finish
+// sums whatever the compressor skipped or left unread.
+typedef struct {
+    FILE *file;
+    off_t position;     // Offset of the next read
+    off_t checked;      // Bytes summed so far
+    uint32_t crc;
+} ChecksumSource;
+
+static ssize_t checksum_source_read(void *cookie, char *buffer, size_t size) {
+    ChecksumSource *source = cookie;
+    size_t bytes = fread(buffer, 1, size, source->file);
+    if (bytes == 0 && ferror(source->file)) {
         return -1;
     }
+    if (source->position == source->checked) {
+        source->crc = crc32_update(source->crc, buffer, bytes);
+        source->checked += (off_t)bytes;
+    }
+    source->position += (off_t)bytes;
+    return (ssize_t)bytes;
+}
 
-    // Open the input directory
-    DIR *dir = opendir(input_dir);
-    if (!dir) {
-        perror("Error opening input directory");
-        fclose(archive_file);
+static int checksum_source_seek(void *cookie, off64_t *offset, int whence) {
+    ChecksumSource *source = cookie;
+    off_t position;
+    if (fseeko(source->file, (off_t)*offset, whence) != 0 || (position = ftello(source->file)) < 0) {
         return -1;
     }
+    source->position = position;
+    *offset = position;
+    return 0;
+}
 
-    struct dirent *entry;
-    char filepath[PATH_MAX];
-    struct stat file_stat;
+// Opens a file to be read through a checksumming stream.
+// Returns NULL on error.
+static FILE* open_checksum_source(const char *path, ChecksumSource *source) {
+    memset(source, 0, sizeof(ChecksumSource));
+    source->file = fopen(path, "rb");
+    if (!source->file) {
+        perror("Error opening input file");
+        return NULL;
+    }
+
+    cookie_io_functions_t functions = { checksum_source_read, NULL, checksum_source_seek, NULL };
+    FILE *stream = fopencookie(source, "rb", functions);
+    if (!stream) {
+        perror("Error opening input stream");
+        fclose(source->file);
+    }
+    return stream;
+}
+
+// Sums the rest of the file from the first byte not yet summed and closes
+// it. Returns 0 on success, -1 on error.
+static int checksum_source_finish(ChecksumSource *source) {
+    int result = fseeko(source->file, source->checked, SEEK_SET);
+    char buffer[65536];
+    size_t bytes;
+    while (result == 0 && (bytes = fread(buffer, 1, sizeof(buffer), source->file)) > 0) {
+        source->crc = crc32_update(source->crc, buffer, bytes);
+        source->checked += (off_t)bytes;
+    }
+    if (result != 0 || ferror(source->file)) {
+        perror("Error reading input file");
+        result = -1;
+    }
+    fclose(source->file);
+    return result;
+}
 
-    // Traverse the directory
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip '.' and '..'
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+// Encodes a central directory entry into dst, which must have room for
+// ARCHIVE_ENTRY_MAX_SIZE plus the path. Returns the number of bytes written.
+static size_t encode_directory_entry(const ArchiveEntry *entry, uint8_t *dst) {
+    size_t path_length = strlen(entry->path);
+    size_t size = encode_varint(path_length, dst);
+    memcpy(dst + size, entry->path, path_length);
+    size += path_length;
+    dst[size++] = (uint8_t)entry->codec;
+    dst[size++] = entry->solid ? ARCHIVE_ENTRY_SOLID : 0;
+    size += encode_varint(entry->size, dst + size);
+    size += encode_varint(entry->compressed_size, dst + size);
+    size += encode_varint(entry->offset, dst + size);
+    if (entry->solid) {
+        size += encode_varint(entry->solid_offset, dst + size);
+    }
+    size += encode_varint(entry->mode, dst + size);
+    size += encode_varint(zigzag_encode(entry->mtime), dst + size);
+    size += encode_varint(entry->inode, dst + size);
+    for (int i = 0; i < 4; i++) {
+        dst[size++] = (uint8_t)(entry->crc >> (8 * i));
+    }
+    return size;
+}
+
+// Decodes a central directory entry from at most size bytes of src, copying
+// its path, NUL-terminated, to name. Returns the number of bytes consumed,
+// 0 if the entry is truncated or invalid.
+static size_t decode_directory_entry(const uint8_t *src, size_t size, ArchiveEntry *entry, char *name) {
+    uint64_t path_length, mode, mtime;
+    size_t pos = decode_varint(src, size, &path_length);
+    if (pos == 0 || path_length == 0 || path_length >= PATH_MAX || path_length + 1 >= size - pos) {
+        return 0;
+    }
+    memcpy(name, src + pos, path_length);
+    name[path_length] = '\0';
+    if (memchr(name, '\0', path_length) != NULL) {
+        return 0;
+    }
+    entry->path = name;
+    pos += path_length;
+
+    entry->codec = src[pos++];
+    entry->solid = (src[pos++] & ARCHIVE_ENTRY_SOLID) != 0;
+    entry->solid_offset = 0;
+    uint64_t *fields[] = { &entry->size, &entry->compressed_size, &entry->offset, &entry->solid_offset,
+                           &mode, &mtime, &entry->inode };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (fields[i] == &entry->solid_offset && !entry->solid) {
             continue;
         }
+        size_t used = decode_varint(src + pos, size - pos, fields[i]);
+        if (used == 0) {
+            return 0;
+        }
+        pos += used;
+    }
+    if (size - pos < 4) {
+        return 0;
+    }
+    entry->mode = (uint32_t)mode;
+    entry->mtime = zigzag_decode(mtime);
+    entry->crc = (uint32_t)src[pos] | (uint32_t)src[pos + 1] << 8 |
+                 (uint32_t)src[pos + 2] << 16 | (uint32_t)src[pos + 3] << 24;
+    return pos + 4;
+}
+
+// Small file held back to be packed into a solid block
+typedef struct {
+    char *source;           // File the data is read from, followed by the stored name
+    ArchiveEntry entry;
+    const ArchiveEntry *previous;  // Unchanged entry in a solid block of the previous archive
+    int reused;             // Copied with its block from the previous archive
+    int missing;            // Could not be read and is left out
+} SolidFile;
 
-        // Construct the full file path
-        snprintf(filepath, sizeof(filepath), "%s/%s", input_dir, entry->d_name);
+// One entry in flight: its header fields and, unless it is too large for
+// the memory budget and gets compressed straight into the archive, its
+// compressed payload. A solid block carries its files as members.
+typedef struct {
+    ThreadPoolTask task;
+    int busy;
+    char source[PATH_MAX];  // File the entry is read from
+    char name[PATH_MAX];    // Path stored in the archive
+    ArchiveEntry entry;
+    SolidFile *members;     // Files of a solid block, NULL for other entries
+    size_t member_count;
+    int split;              // The members are written as entries of their own
+    const ArchiveEntry *previous;  // Unchanged entry of the previous archive to copy
+    int verify;             // The content must match previous before it is copied
+    int queued;             // Has a task on the pool
+    CompressionAlgorithm algorithm;
+    CompressionLevel level;
+    HuffmanBuilder *builder;
+    int direct;         // Compressed into the archive when its turn comes
+    char *data;
+    size_t data_size;
+    size_t reserved;    // Share of the memory budget held until written
+    int result;
+} ArchiveJob;
 
-        // Get file information
-        if (stat(filepath, &file_stat) < 0) {
-            perror("Error getting file information");
+// Archive being written. Entries are compressed on the pool and written by
+// the calling thread in the order they were added.
+typedef struct {
+    FILE *archive;
+    int seekable;       // Sizes of direct entries are patched into their headers
+    uint64_t offset;    // Bytes written to the archive
+    CompressionAlgorithm algorithm;
+    CompressionLevel level;
+    int thread_count;
+    ThreadPool *pool;
+    ArchiveJob *jobs;
+    int job_count;
+    int next;           // Slot for the next entry
+    int busy;           // Entries added but not yet written
+    size_t budget;
+    size_t direct_size; // Entries bounded above this are compressed directly
+    size_t in_flight;   // Budget reserved by busy entries
+    uint8_t *directory; // Encoded central directory entries
+    size_t directory_size;
+    size_t directory_capacity;
+    uint64_t entry_count;
+    int solid;          // Small files are held back for solid blocks
+    SolidFile *small;
+    size_t small_count;
+    size_t small_capacity;
+    FILE *previous;     // Archive being updated, if any
+    ArchiveDirectory previous_directory;
+    const ArchiveEntry **previous_index;  // Previous entries sorted by path
+    int compare_content;
+    int result;
+} ArchiveWriter;
+
+// Tells whether a file's content has the given CRC-32, reading all of it
+static int content_unchanged(const char *path, uint32_t crc) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return 0;
+    }
+
+    char buffer[65536];
+    size_t bytes;
+    uint32_t current = 0;
+    while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        current = crc32_update(current, buffer, bytes);
+    }
+    int unchanged = !ferror(file) && current == crc;
+    fclose(file);
+    return unchanged;
+}
+
+// Compresses one entry into memory (pool task). An entry that may be
+// copied from the previous archive once its content is confirmed is only
+// compressed if the content differs.
+static void compress_entry(void *arg) {
+    ArchiveJob *job = arg;
+    if (job->verify) {
+        job->verify = 0;
+        if (content_unchanged(job->source, job->previous->crc)) {
+            job->result = 0;
+            return;
+        }
+        job->previous = NULL;
+    }
+    job->result = -1;
+
+    ChecksumSource source;
+    FILE *in_file = open_checksum_source(job->source, &source);
+    if (!in_file) {
+        return;
+    }
+
+    FILE *out_file = open_memstream(&job->data, &job->data_size);
+    if (!out_file) {
+        perror("Error creating buffer for compressed data");
+        fclose(in_file);
+        fclose(source.file);
+        return;
+    }
+
+    int result = compress_stream(in_file, out_file, job->algorithm, job->level, job->builder, 1);
+    fclose(in_file);
+    if (checksum_source_finish(&source) != 0) {
+        result = -1;
+    }
+    job->entry.crc = source.crc;
+
+    if (fclose(out_file) != 0) {
+        perror("Error writing compressed data to memory");
+        result = -1;
+    }
+    job->result = result;
+}
+
+// Compresses size bytes of src with the settings of a job, appending the
+// result to out_file. Returns 0 on success, -1 on error.
+static int compress_memory(ArchiveJob *job, uint8_t *src, size_t size, FILE *out_file) {
+    FILE *in_file = fmemopen(src, size, "rb");
+    if (!in_file) {
+        perror("Error creating buffer for solid block");
+        return -1;
+    }
+    int result = compress_stream(in_file, out_file, job->algorithm, job->level, job->builder, 1);
+    fclose(in_file);
+    return result;
+}
+
+// Size of the header encode_entry_header writes for an entry
+static size_t entry_header_size(const ArchiveEntry *entry, int flags) {
+    uint8_t header[ARCHIVE_HEADER_MAX_SIZE];
+    return encode_entry_header(entry, flags, header);
+}
+
+// Compresses the files of a solid block one by one as well and keeps them
+// apart when that is no larger than the block: a code table shared by
+// unrelated files can cost more than the per-file tables and headers it
+// saves. Returns 0 on success, -1 on error.
+static int split_solid_block(ArchiveJob *job, uint8_t *raw) {
+    char *data = NULL;
+    size_t data_size = 0;
+    FILE *out_file = open_memstream(&data, &data_size);
+    if (!out_file) {
+        perror("Error creating buffer for solid block");
+        return -1;
+    }
+
+    // Directory entries of solid files also carry their offset in the block
+    uint8_t varint[VARINT_MAX_BYTES];
+    uint64_t solid_cost = entry_header_size(&job->entry, ARCHIVE_FLAG_SOLID) + job->data_size;
+    uint64_t split_cost = 0;
+    off_t start = 0;
+    int result = 0;
+    for (size_t i = 0; result == 0 && i < job->member_count; i++) {
+        ArchiveEntry *member = &job->members[i].entry;
+        off_t end;
+        if (job->members[i].missing) {
             continue;
         }
+        if (compress_memory(job, raw + member->solid_offset, member->size, out_file) != 0 ||
+            fflush(out_file) != 0 || (end = ftello(out_file)) < 0) {
+            result = -1;
+            break;
+        }
+        member->compressed_size = (uint64_t)(end - start);
+        solid_cost += encode_varint(member->solid_offset, varint);
+        split_cost += entry_header_size(member, 0) + member->compressed_size;
+        start = end;
+    }
+    if (fclose(out_file) != 0 && result == 0) {
+        perror("Error writing compressed data to memory");
+        result = -1;
+    }
 
-        // If it's a directory, call recursively
-        if (S_ISDIR(file_stat.st_mode)) {
-            compress_directory(filepath, output_archive, algorithm, level);
-        } else if (S_ISREG(file_stat.st_mode)) {
-            // Compress and add the file to the archive
-            FileMetadata metadata;
-            strncpy(metadata.filepath, filepath, sizeof(metadata.filepath));
-            metadata.size = file_stat.st_size;
-            metadata.mode = file_stat.st_mode;
-            metadata.mtime = file_stat.st_mtime;
-
-            // Write metadata
-            if (write_file_metadata(archive_file, &metadata) != 0) {
-                fprintf(stderr, "Failed to write metadata for %s\n", filepath);
-                continue;
-            }
+    if (result == 0 && split_cost <= solid_cost) {
+        free(job->data);
+        job->data = data;
+        job->data_size = data_size;
+        job->split = 1;
+    } else {
+        free(data);
+    }
+    return result;
+}
 
-            // Compress the file and write its content to the archive
-            FILE *temp_file = tmpfile();
-            if (!temp_file) {
-                perror("Error creating temporary file for compression");
-                continue;
-            }
+// Reads the files of a solid block into one buffer and compresses that
+// into memory (pool task), unless the files come out smaller compressed
+// on their own. Files that cannot be read are left out; a file that grew
+// since it was found is cut at the size it was found with.
+static void compress_solid_block(void *arg) {
+    ArchiveJob *job = arg;
+    job->result = -1;
 
-            // Use the chosen compression algorithm
-            if (algorithm == ALG_RLE) {
-                if (rle_compress_advanced(fopen(filepath, "rb"), temp_file, level) != 0) {
-                    fprintf(stderr, "Error during RLE compression of %s\n", filepath);
-                    fclose(temp_file);
-                    continue;
-                }
-            } else if (algorithm == ALG_HUFFMAN) {
-                if (huffman_compress(fopen(filepath, "rb"), temp_file) != 0) {
-                    fprintf(stderr, "Error during Huffman compression of %s\n", filepath);
-                    fclose(temp_file);
-                    continue;
-                }
-            }
+    uint8_t *raw = malloc(job->entry.size > 0 ? job->entry.size : 1);
+    if (!raw) {
+        fprintf(stderr, "Memory allocation failed for solid block\n");
+        return;
+    }
 
-            // Write the compressed data to the archive
-            rewind(temp_file);
-            char buffer[4096];
-            size_t bytes_read;
-            while ((bytes_read = fread(buffer, 1, sizeof(buffer), temp_file)) > 0) {
-                if (fwrite(buffer, 1, bytes_read, archive_file) != bytes_read) {
-                    perror("Error writing compressed data to archive");
-                    break;
-                }
-            }
+    size_t raw_size = 0;
+    for (size_t i = 0; i < job->member_count; i++) {
+        SolidFile *member = &job->members[i];
+        FILE *file = fopen(member->source, "rb");
+        if (!file) {
+            perror("Error opening input file");
+            member->missing = 1;
+            continue;
+        }
+        size_t bytes = fread(raw + raw_size, 1, member->entry.size, file);
+        if (ferror(file)) {
+            perror("Error reading input file");
+            member->missing = 1;
+            fclose(file);
+            continue;
+        }
+        fclose(file);
+
+        member->entry.size = bytes;
+        member->entry.solid_offset = raw_size;
+        member->entry.crc = crc32_update(0, raw + raw_size, bytes);
+        raw_size += bytes;
+    }
+    job->entry.size = raw_size;
+
+    FILE *out_file = open_memstream(&job->data, &job->data_size);
+    if (!out_file) {
+        perror("Error creating buffer for solid block");
+        free(raw);
+        return;
+    }
+    int result = compress_memory(job, raw, raw_size, out_file);
+    if (fclose(out_file) != 0) {
+        perror("Error writing compressed data to memory");
+        result = -1;
+    }
+    if (result == 0) {
+        result = split_solid_block(job, raw);
+    }
+    free(raw);
+    job->result = result;
+}
 
-            fclose(temp_file);
+// Adds a written entry to the central directory.
+// Returns 0 on success, -1 on allocation failure.
+static int record_entry(ArchiveWriter *writer, const ArchiveEntry *entry) {
+    size_t needed = writer->directory_size + strlen(entry->path) + ARCHIVE_ENTRY_MAX_SIZE;
+    if (needed > writer->directory_capacity) {
+        size_t capacity = writer->directory_capacity ? writer->directory_capacity : 4096;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        uint8_t *directory = realloc(writer->directory, capacity);
+        if (!directory) {
+            fprintf(stderr, "Memory allocation failed for archive directory\n");
+            return -1;
         }
+        writer->directory = directory;
+        writer->directory_capacity = capacity;
     }
 
-    closedir(dir);
-    fclose(archive_file);
+    writer->directory_size += encode_directory_entry(entry, writer->directory + writer->directory_size);
+    writer->entry_count++;
     return 0;
 }
 
-int compress_multiple_files(char **input_files, int file_count, const char *output_archive, CompressionAlgorithm algorithm, CompressionLevel level) {
-    // Open the output archive file
-    FILE *archive_file = fopen(output_archive, "wb");
-    if (!archive_file) {
-        perror("Error opening output archive file");
+// Writes an entry header. Returns 0 on success, -1 on error.
+static int write_entry_header(FILE *archive, const ArchiveEntry *entry, int flags, size_t *header_size) {
+    uint8_t header[ARCHIVE_HEADER_MAX_SIZE];
+    *header_size = encode_entry_header(entry, flags, header);
+    if (fwrite(header, 1, *header_size, archive) != *header_size) {
+        perror("Error writing entry header");
         return -1;
     }
+    return 0;
+}
 
-    struct stat file_stat;
-    for (int i = 0; i < file_count; i++) {
-        // Get file information
-        if (stat(input_files[i], &file_stat) < 0) {
-            perror("Error getting file information");
+// Writes the files of a split solid block as entries of their own, each
+// with its part of the job's data. Returns 0 on success, -1 on error.
+static int write_split_members(ArchiveWriter *writer, ArchiveJob *job) {
+    const char *data = job->data;
+    for (size_t i = 0; i < job->member_count; i++) {
+        ArchiveEntry *member = &job->members[i].entry;
+        size_t header_size;
+        if (job->members[i].missing) {
             continue;
         }
+        member->offset = writer->offset;
+        if (write_entry_header(writer->archive, member, 0, &header_size) != 0) {
+            return -1;
+        }
+        if (fwrite(data, 1, member->compressed_size, writer->archive) != member->compressed_size) {
+            perror("Error writing compressed data to archive");
+            return -1;
+        }
+        data += member->compressed_size;
+        writer->offset += header_size + member->compressed_size;
+        if (record_entry(writer, member) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-        // Add the file to the archive
-        FileMetadata metadata;
-        strncpy(metadata.filepath, input_files[i], sizeof(metadata.filepath));
-        metadata.size = file_stat.st_size;
-        metadata.mode = file_stat.st_mode;
-        metadata.mtime = file_stat.st_mtime;
+// Writes an entry compressed in memory with its header to the archive.
+// The files of a solid block go into the directory one by one.
+// Returns 0 on success, -1 on error.
+static int write_entry(ArchiveWriter *writer, ArchiveJob *job) {
+    if (job->split) {
+        return write_split_members(writer, job);
+    }
+
+    size_t header_size;
+    job->entry.offset = writer->offset;
+    job->entry.compressed_size = job->data_size;
+    int flags = job->members ? ARCHIVE_FLAG_SOLID : 0;
+    if (write_entry_header(writer->archive, &job->entry, flags, &header_size) != 0) {
+        return -1;
+    }
+    if (fwrite(job->data, 1, job->data_size, writer->archive) != job->data_size) {
+        perror("Error writing compressed data to archive");
+        return -1;
+    }
+    writer->offset += header_size + job->data_size;
 
-        // Write metadata
-        if (write_file_metadata(archive_file, &metadata) != 0) {
-            fprintf(stderr, "Failed to write metadata for %s\n", input_files[i]);
+    if (!job->members) {
+        return record_entry(writer, &job->entry);
+    }
+    for (size_t i = 0; i < job->member_count; i++) {
+        ArchiveEntry *member = &job->members[i].entry;
+        if (job->members[i].missing) {
             continue;
         }
+        member->solid = 1;
+        member->offset = job->entry.offset;
+        member->compressed_size = job->data_size;
+        if (record_entry(writer, member) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-        // Compress the file and write its content to the archive
-        FILE *temp_file = tmpfile();
-        if (!temp_file) {
-            perror("Error creating temporary file for compression");
-            continue;
+// Writes the trailing descriptor that carries the payload size of a direct
+// entry written to an unseekable archive. Returns 0 on success, -1 on error.
+static int write_descriptor(FILE *archive, uint64_t compressed_size) {
+    uint8_t descriptor[ARCHIVE_DESCRIPTOR_SIZE];
+    memcpy(descriptor, ARCHIVE_DESCRIPTOR_MAGIC, 4);
+    store_le64(descriptor + 4, compressed_size);
+    if (fwrite(descriptor, 1, sizeof(descriptor), archive) != sizeof(descriptor)) {
+        perror("Error writing entry descriptor");
+        return -1;
+    }
+    return 0;
+}
+
+// Compresses an entry straight into the archive behind its header, using
+// every thread for Huffman and hybrid blocks. The payload size is patched
+// into the header afterwards, or written after the payload when the
+// archive cannot seek. A failed entry is cut off again on a seekable
+// archive. Returns 0 on success, 1 if the entry was left out, -1 if the
+// archive is unusable.
+static int write_direct_entry(ArchiveWriter *writer, ArchiveJob *job) {
+    ChecksumSource source;
+    FILE *in_file = open_checksum_source(job->source, &source);
+    if (!in_file) {
+        return 1;
+    }
+
+    off_t header_offset = writer->seekable ? ftello(writer->archive) : -1;
+    int flags = header_offset >= 0 ? 0 : ARCHIVE_FLAG_DESCRIPTOR;
+    size_t header_size;
+    job->entry.offset = writer->offset;
+    job->entry.compressed_size = 0;
+    OutputSink sink;
+    FILE *out_file = NULL;
+    if (write_entry_header(writer->archive, &job->entry, flags, &header_size) != 0 ||
+        !(out_file = output_sink_open(writer->archive, UINT64_MAX, 1, &sink))) {
+        fclose(in_file);
+        fclose(source.file);
+        return -1;
+    }
+
+    int result = compress_stream(in_file, out_file, job->algorithm, job->level, NULL, writer->thread_count);
+    fclose(in_file);
+    if (checksum_source_finish(&source) != 0) {
+        result = -1;
+    }
+    job->entry.crc = source.crc;
+    if (fclose(out_file) != 0 && result == 0) {
+        perror("Error writing compressed data to archive");
+        result = -1;
+    }
+    job->entry.compressed_size = sink.written;
+
+    if (header_offset < 0) {
+        // Without seeking a partial payload cannot be taken back
+        if (result != 0 || write_descriptor(writer->archive, sink.written) != 0) {
+            return -1;
         }
+        writer->offset += header_size + sink.written + ARCHIVE_DESCRIPTOR_SIZE;
+        return record_entry(writer, &job->entry);
+    }
 
-        // Compress the file using the appropriate algorithm
-        if (algorithm == ALG_RLE) {
-            if (rle_compress_advanced(fopen(input_files[i], "rb"), temp_file, level) != 0) {
-                fprintf(stderr, "Error during RLE compression of %s\n", input_files[i]);
-                fclose(temp_file);
-                continue;
-            }
-        } else if (algorithm == ALG_HUFFMAN) {
-            if (huffman_compress(fopen(input_files[i], "rb"), temp_file) != 0) {
-                fprintf(stderr, "Error during Huffman compression of %s\n", input_files[i]);
-                fclose(temp_file);
-                continue;
-            }
-        } else if (algorithm == ALG_HYBRID) {
-            // For hybrid, compress to a temporary file first to decide which algorithm to use
-            FILE *temp_hybrid = tmpfile();
-            if (!temp_hybrid) {
-                perror("Error creating temporary file for hybrid compression");
-                fclose(temp_file);
-                continue;
-            }
-            if (hybrid_compress(fopen(input_files[i], "rb"), temp_hybrid, level) < 0) {
-                fprintf(stderr, "Error during Hybrid compression decision for %s\n", input_files[i]);
-                fclose(temp_hybrid);
-                fclose(temp_file);
-                continue;
-            }
-            
-            // Use the algorithm chosen by hybrid_compress
-            if (report.algorithm == ALG_RLE) {
-                if (rle_compress_advanced(fopen(input_files[i], "rb"), temp_file, level) != 0) {
-                    fprintf(stderr, "Error during RLE compression of %s\n", input_files[i]);
-                    fclose(temp_hybrid);
-                    fclose(temp_file);
-                    continue;
-                }
-            } else if (report.algorithm == ALG_HUFFMAN) {
-                if (huffman_compress(fopen(input_files[i], "rb"), temp_file) != 0) {
-                    fprintf(stderr, "Error during Huffman compression of %s\n", input_files[i]);
-                    fclose(temp_hybrid);
-                    fclose(temp_file);
-                    continue;
-                }
-            }
+    if (result != 0) {
+        if (fflush(writer->archive) != 0 || ftruncate(fileno(writer->archive), header_offset) != 0 ||
+            fseeko(writer->archive, header_offset, SEEK_SET) != 0) {
+            perror("Error removing failed entry from archive");
+            return -1;
         }
-            
+        return 1;
+    }
 
-        // Write the compressed data to the archive
-        rewind(temp_file);
-        char buffer[4096];
-        size_t bytes_read;
-        while ((bytes_read = fread(buffer, 1, sizeof(buffer), temp_file)) > 0) {
-            if (fwrite(buffer, 1, bytes_read, archive_file) != bytes_read) {
-                perror("Error writing compressed data to archive");
-                break;
-            }
+    // Only the fixed-width size field changes
+    uint8_t size_field[8];
+    store_le64(size_field, sink.written);
+    if (fseeko(writer->archive, header_offset + ARCHIVE_COMPRESSED_SIZE_OFFSET, SEEK_SET) != 0 ||
+        fwrite(size_field, 1, sizeof(size_field), writer->archive) != sizeof(size_field) ||
+        fseeko(writer->archive, 0, SEEK_END) != 0) {
+        perror("Error updating entry size");
+        return -1;
+    }
+    writer->offset += header_size + sink.written;
+    return record_entry(writer, &job->entry);
+}
+
+// Reads the header of an entry of the previous archive and checks it
+// against the directory. Stores where the payload starts in payload.
+// Returns 0 on success, -1 if the header does not match.
+static int find_previous_payload(ArchiveWriter *writer, const ArchiveEntry *previous, ArchiveEntry *header,
+                                 uint64_t *payload) {
+    char name[PATH_MAX];
+    int flags;
+    size_t header_size;
+    if (fseeko(writer->previous, (off_t)previous->offset, SEEK_SET) != 0 ||
+        (header_size = read_entry_header(writer->previous, header, name, &flags)) == 0 ||
+        header->codec != previous->codec ||
+        (previous->solid ? !(flags & ARCHIVE_FLAG_SOLID) : strcmp(name, previous->path) != 0) ||
+        (!(flags & ARCHIVE_FLAG_DESCRIPTOR) && header->compressed_size != previous->compressed_size)) {
+        fprintf(stderr, "Entry %s of the previous archive does not match its directory\n", previous->path);
+        return -1;
+    }
+    *payload = previous->offset + header_size;
+    return 0;
+}
+
+// Appends length bytes from offset of the previous archive to the archive,
+// in the kernel with copy_file_range where the files allow it.
+// Returns 0 on success, -1 on error.
+static int copy_previous_bytes(ArchiveWriter *writer, uint64_t offset, uint64_t length) {
+    if (fflush(writer->archive) != 0) {
+        perror("Error writing archive");
+        return -1;
+    }
+
+    int input_fd = fileno(writer->previous);
+    off_t position = (off_t)offset;
+    while (writer->seekable && length > 0) {
+        ssize_t copied = copy_file_range(input_fd, &position, fileno(writer->archive), NULL, length, 0);
+        if (copied <= 0) {
+            break; // Not supported between these files, or a short source: copy by hand
+        }
+        length -= (uint64_t)copied;
+    }
+    if (writer->seekable && fseeko(writer->archive, 0, SEEK_END) != 0) {
+        perror("Error seeking in archive");
+        return -1;
+    }
+
+    char buffer[65536];
+    while (length > 0) {
+        size_t chunk = length < sizeof(buffer) ? (size_t)length : sizeof(buffer);
+        ssize_t bytes = pread(input_fd, buffer, chunk, position);
+        if (bytes <= 0) {
+            fprintf(stderr, "Error reading previous archive\n");
+            return -1;
+        }
+        if (fwrite(buffer, 1, (size_t)bytes, writer->archive) != (size_t)bytes) {
+            perror("Error writing archive");
+            return -1;
+        }
+        position += bytes;
+        length -= (uint64_t)bytes;
+    }
+    return 0;
+}
+
+// Writes an unchanged entry with a fresh header, taking its payload from
+// the previous archive as it is. Falls back to compressing the file if its
+// content has to be compared and differs, or the old entry is unusable.
+// Returns 0 on success, 1 if the entry was left out, -1 if the archive is
+// unusable.
+static int copy_entry(ArchiveWriter *writer, ArchiveJob *job) {
+    const ArchiveEntry *previous = job->previous;
+    ArchiveEntry header;
+    uint64_t payload;
+    if ((job->verify && !content_unchanged(job->source, previous->crc)) ||
+        find_previous_payload(writer, previous, &header, &payload) != 0) {
+        job->previous = NULL;
+        job->verify = 0;
+        return write_direct_entry(writer, job);
+    }
+
+    size_t header_size;
+    job->entry.offset = writer->offset;
+    job->entry.compressed_size = previous->compressed_size;
+    job->entry.crc = previous->crc;
+    if (write_entry_header(writer->archive, &job->entry, 0, &header_size) != 0 ||
+        copy_previous_bytes(writer, payload, previous->compressed_size) != 0) {
+        return -1;
+    }
+    writer->offset += header_size + previous->compressed_size;
+    return record_entry(writer, &job->entry);
+}
+
+// Waits for the oldest entry in flight, writes it out and frees its slot
+static void finish_oldest(ArchiveWriter *writer) {
+    ArchiveJob *job = &writer->jobs[(writer->next + writer->job_count - writer->busy) % writer->job_count];
+
+    // A file that cannot be compressed is left out of the archive
+    int result = 0;
+    if (job->queued) {
+        thread_pool_wait_task(writer->pool, &job->task);
+        job->queued = 0;
+        result = job->result != 0;
+    }
+    if (result == 0 && writer->result == 0) {
+        if (job->previous) {
+            result = copy_entry(writer, job);
+        } else if (job->direct) {
+            result = write_direct_entry(writer, job);
+        } else {
+            result = write_entry(writer, job);
         }
+    }
+    if (result > 0) {
+        fprintf(stderr, "Error during compression of %s\n", job->members ? "a solid block" : job->source);
+    } else if (result < 0) {
+        writer->result = -1;
+    }
+
+    free(job->data);
+    job->data = NULL;
+    job->data_size = 0;
+    writer->in_flight -= job->reserved;
+    job->busy = 0;
+    writer->busy--;
+}
+
+// Orders directory entries by path
+static int compare_entry_paths(const void *a, const void *b) {
+    return strcmp((*(const ArchiveEntry * const *)a)->path, (*(const ArchiveEntry * const *)b)->path);
+}
+
+// Releases the archive being updated
+static void close_previous_archive(ArchiveWriter *writer) {
+    if (writer->previous) {
+        fclose(writer->previous);
+        writer->previous = NULL;
+    }
+    archive_directory_free(&writer->previous_directory);
+    free(writer->previous_index);
+    writer->previous_index = NULL;
+}
+
+// Opens the archive being updated and indexes its directory by path. The
+// new archive has to be a different file, as opening it truncates it.
+// Returns 0 on success, -1 on error.
+static int open_previous_archive(ArchiveWriter *writer, const char *previous_archive, const char *output_archive) {
+    writer->previous = fopen(previous_archive, "rb");
+    if (!writer->previous) {
+        perror("Error opening previous archive");
+        return -1;
+    }
 
-        fclose(temp_file);
+    struct stat previous_stat, output_stat;
+    if (fstat(fileno(writer->previous), &previous_stat) == 0 && stat(output_archive, &output_stat) == 0 &&
+        previous_stat.st_dev == output_stat.st_dev && previous_stat.st_ino == output_stat.st_ino) {
+        fprintf(stderr, "The updated archive must be written to a new file, not over %s\n", previous_archive);
+        fclose(writer->previous);
+        writer->previous = NULL;
+        return -1;
+    }
+    if (archive_read_directory(writer->previous, &writer->previous_directory) != 0) {
+        fclose(writer->previous);
+        writer->previous = NULL;
+        return -1;
     }
 
-    fclose(archive_file);
+    size_t count = writer->previous_directory.count;
+    writer->previous_index = malloc((count > 0 ? count : 1) * sizeof(ArchiveEntry *));
+    if (!writer->previous_index) {
+        fprintf(stderr, "Memory allocation failed for previous archive\n");
+        close_previous_archive(writer);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        writer->previous_index[i] = &writer->previous_directory.entries[i];
+    }
+    qsort(writer->previous_index, count, sizeof(ArchiveEntry *), compare_entry_paths);
     return 0;
-}
\ No newline at end of file
+}
+
+// Looks up the entry a file had in the previous archive. The file counts
+// as unchanged if its size, modification time and inode are the same and
+// the entry is in the codec being written. Returns NULL otherwise.
+static const ArchiveEntry* unchanged_entry(const ArchiveWriter *writer, const char *name,
+                                           const struct stat *file_stat) {
+    if (!writer->previous_index) {
+        return NULL;
+    }
+
+    ArchiveEntry key;
+    key.path = name;
+    const ArchiveEntry *key_pointer = &key;
+    const ArchiveEntry **found = bsearch(&key_pointer, writer->previous_index, writer->previous_directory.count,
+                                         sizeof(ArchiveEntry *), compare_entry_paths);
+    if (!found) {
+        return NULL;
+    }
+
+    const ArchiveEntry *entry = *found;
+    if (entry->size != (uint64_t)file_stat->st_size || entry->mtime != (int64_t)file_stat->st_mtime ||
+        entry->inode != (uint64_t)file_stat->st_ino || entry->codec != frame_codec_id(writer->algorithm)) {
+        return NULL;
+    }
+    return entry;
+}
+
+// Opens the archive and starts the compression pool.
+// Returns 0 on success, -1 on error.
+static int archive_writer_open(ArchiveWriter *writer, const char *output_archive, CompressionAlgorithm algorithm,
+                               CompressionLevel level, const ArchiveOptions *options) {
+    memset(writer, 0, sizeof(ArchiveWriter));
+    writer->algorithm = algorithm;
+    writer->level = level;
+
+    int thread_count = options && options->thread_count > 0 ? options->thread_count : thread_pool_default_threads();
+    writer->thread_count = thread_count;
+    writer->budget = options && options->memory_budget > 0 ? options->memory_budget : ARCHIVE_DEFAULT_MEMORY_BUDGET;
+    writer->solid = options && options->solid;
+    writer->compare_content = options && options->compare_content;
+
+    if (options && options->previous_archive &&
+        open_previous_archive(writer, options->previous_archive, output_archive) != 0) {
+        return -1;
+    }
+
+    writer->archive = fopen(output_archive, "wb");
+    if (!writer->archive) {
+        perror("Error opening output archive file");
+        close_previous_archive(writer);
+        return -1;
+    }
+    writer->seekable = ftello(writer->archive) >= 0;
+
+    // Twice as many slots as threads keeps the workers busy while the
+    // oldest entries are written
+    writer->pool = thread_count > 1 ? thread_pool_create(thread_count) : NULL;
+    writer->job_count = writer->pool ? 2 * thread_count : 1;
+    writer->direct_size = writer->budget / writer->job_count;
+
+    writer->jobs = calloc(writer->job_count, sizeof(ArchiveJob));
+    if (!writer->jobs) {
+        fprintf(stderr, "Memory allocation failed for archive entries\n");
+        thread_pool_destroy(writer->pool);
+        fclose(writer->archive);
+        close_previous_archive(writer);
+        return -1;
+    }
+    for (int i = 0; i < writer->job_count; i++) {
+        writer->jobs[i].algorithm = algorithm;
+        writer->jobs[i].level = level;
+        if (algorithm == ALG_HUFFMAN) {
+            // One tree builder per slot, as builders are not shared between threads
+            writer->jobs[i].builder = huffman_builder_create();
+            if (!writer->jobs[i].builder) {
+                fprintf(stderr, "Memory allocation failed for Huffman builder\n");
+                for (int j = 0; j < i; j++) {
+                    huffman_builder_free(writer->jobs[j].builder);
+                }
+                free(writer->jobs);
+                thread_pool_destroy(writer->pool);
+                fclose(writer->archive);
+                close_previous_archive(writer);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Compressed size an entry of size bytes reserves from the memory budget
+static size_t entry_bound(const ArchiveWriter *writer, size_t size) {
+    return codec_bound(writer->algorithm, writer->level, size);
+}
+
+// Takes the next slot of the job ring for an entry reserving reserve bytes
+// of the budget. Blocks, writing out finished entries in order, until the
+// slot and enough of the budget are free. Returns NULL once the archive
+// has failed.
+static ArchiveJob* claim_slot(ArchiveWriter *writer, size_t reserve) {
+    while (writer->busy > 0 &&
+           (writer->jobs[writer->next].busy || writer->in_flight + reserve > writer->budget)) {
+        finish_oldest(writer);
+    }
+    if (writer->result != 0) {
+        return NULL;
+    }
+
+    ArchiveJob *job = &writer->jobs[writer->next];
+    memset(&job->entry, 0, sizeof(ArchiveEntry));
+    job->entry.codec = frame_codec_id(writer->algorithm);
+    job->members = NULL;
+    job->member_count = 0;
+    job->split = 0;
+    job->previous = NULL;
+    job->verify = 0;
+    job->direct = 0;
+    job->reserved = reserve;
+    writer->in_flight += reserve;
+    job->busy = 1;
+    writer->busy++;
+    writer->next = (writer->next + 1) % writer->job_count;
+    return job;
+}
+
+// Holds a small file back for a solid block. The file is not read until
+// its block is compressed. Returns 0 on success, -1 on allocation failure.
+static int hold_small_file(ArchiveWriter *writer, const char *source, const char *name,
+                           const struct stat *file_stat) {
+    if (writer->small_count == writer->small_capacity) {
+        size_t capacity = writer->small_capacity ? 2 * writer->small_capacity : 256;
+        SolidFile *small = realloc(writer->small, capacity * sizeof(SolidFile));
+        if (!small) {
+            fprintf(stderr, "Memory allocation failed for solid block files\n");
+            return -1;
+        }
+        writer->small = small;
+        writer->small_capacity = capacity;
+    }
+
+    size_t source_length = strlen(source);
+    SolidFile *file = &writer->small[writer->small_count];
+    memset(file, 0, sizeof(SolidFile));
+    file->source = malloc(source_length + strlen(name) + 2);
+    if (!file->source) {
+        fprintf(stderr, "Memory allocation failed for solid block files\n");
+        return -1;
+    }
+    memcpy(file->source, source, source_length + 1);
+    strcpy(file->source + source_length + 1, name);
+    file->entry.path = file->source + source_length + 1;
+    file->entry.codec = frame_codec_id(writer->algorithm);
+    file->entry.size = (uint64_t)file_stat->st_size;
+    file->entry.mode = (uint32_t)file_stat->st_mode;
+    file->entry.mtime = (int64_t)file_stat->st_mtime;
+    file->entry.inode = (uint64_t)file_stat->st_ino;
+    writer->small_count++;
+    return 0;
+}
+
+// Queues a regular file for compression. Blocks, writing out finished
+// entries in order, until a slot and enough of the memory budget are free.
+// Entries too large for their share of the budget are not queued but
+// compressed into the archive once the entries before them are written.
+// In solid mode small files are held back and packed into solid blocks
+// when the archive is closed.
+static void archive_writer_add(ArchiveWriter *writer, const char *source, const char *name,
+                               const struct stat *file_stat) {
+    // Files unchanged since the previous archive are copied from it; those
+    // in its solid blocks can only be copied with their whole block
+    const ArchiveEntry *previous = unchanged_entry(writer, name, file_stat);
+    if (previous && previous->solid && !writer->solid) {
+        previous = NULL;
+    }
+
+    if (writer->solid && file_stat->st_size <= ARCHIVE_SOLID_FILE_MAX && (!previous || previous->solid)) {
+        if (hold_small_file(writer, source, name, file_stat) != 0) {
+            fprintf(stderr, "Error during compression of %s\n", source);
+        } else {
+            writer->small[writer->small_count - 1].previous = previous;
+        }
+        return;
+    }
+
+    // Copies need no budget unless their content is compared in a task
+    // that may end up compressing after all
+    size_t reserve = entry_bound(writer, (size_t)file_stat->st_size);
+    int direct = reserve > writer->direct_size;
+    int copy = previous && (!writer->compare_content || direct);
+    ArchiveJob *job = claim_slot(writer, direct || copy ? 0 : reserve);
+    if (!job) {
+        return;
+    }
+
+    snprintf(job->source, sizeof(job->source), "%s", source);
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    job->entry.path = job->name;
+    job->entry.size = (uint64_t)file_stat->st_size;
+    job->entry.mode = (uint32_t)file_stat->st_mode;
+    job->entry.mtime = (int64_t)file_stat->st_mtime;
+    job->entry.inode = (uint64_t)file_stat->st_ino;
+    job->direct = direct;
+    job->previous = previous;
+    job->verify = previous && writer->compare_content;
+
+    if (!direct && !copy) {
+        job->queued = 1;
+        thread_pool_submit(writer->pool, &job->task, compress_entry, job);
+    }
+}
+
+// Raw size of a solid block. Codecs with code tables share one table per
+// block, which only fits a few dozen similar files well, so their blocks
+// are kept small; RLE carries no table and packs up to a full frame block.
+static size_t solid_block_size(CompressionAlgorithm algorithm) {
+    return algorithm == ALG_RLE ? FRAME_RLE_BLOCK_SIZE : ARCHIVE_SOLID_TABLE_BLOCK_SIZE;
+}
+
+// Extension of a stored name: what follows the last dot of its last
+// component, or "" if there is none
+static const char* name_extension(const char *name) {
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    const char *dot = strrchr(base, '.');
+    return dot && dot != base ? dot + 1 : "";
+}
+
+// Orders small files by extension, then size, then name, so that similar
+// files end up in the same block. Files already copied come last.
+static int compare_solid_files(const void *a, const void *b) {
+    const ArchiveEntry *first = &((const SolidFile *)a)->entry;
+    const ArchiveEntry *second = &((const SolidFile *)b)->entry;
+    int reused = ((const SolidFile *)a)->reused - ((const SolidFile *)b)->reused;
+    if (reused != 0) {
+        return reused;
+    }
+    int order = strcmp(name_extension(first->path), name_extension(second->path));
+    if (order == 0) {
+        order = (first->size > second->size) - (first->size < second->size);
+    }
+    return order != 0 ? order : strcmp(first->path, second->path);
+}
+
+// Copies a solid block of the previous archive, whose files run from first
+// to end in its directory, with the held files that match them.
+// Returns 0 on success, 1 if the block cannot be reused, -1 on error.
+static int copy_solid_block(ArchiveWriter *writer, size_t first, size_t end, const size_t *holders) {
+    const ArchiveEntry *entries = writer->previous_directory.entries;
+    ArchiveEntry block;
+    uint64_t payload;
+    if (find_previous_payload(writer, &entries[first], &block, &payload) != 0) {
+        return 1;
+    }
+
+    size_t header_size;
+    block.path = "";
+    block.mode = 0;
+    block.mtime = 0;
+    block.offset = writer->offset;
+    block.compressed_size = entries[first].compressed_size;
+    if (write_entry_header(writer->archive, &block, ARCHIVE_FLAG_SOLID, &header_size) != 0 ||
+        copy_previous_bytes(writer, payload, block.compressed_size) != 0) {
+        return -1;
+    }
+    writer->offset += header_size + block.compressed_size;
+
+    for (size_t i = first; i < end; i++) {
+        SolidFile *file = &writer->small[holders[i] - 1];
+        file->entry.solid = 1;
+        file->entry.offset = block.offset;
+        file->entry.compressed_size = block.compressed_size;
+        file->entry.solid_offset = entries[i].solid_offset;
+        file->entry.crc = entries[i].crc;
+        file->reused = 1;
+        if (record_entry(writer, &file->entry) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Copies the solid blocks of the previous archive whose files are all
+// still there and unchanged. Their files are then left out of packing.
+static void reuse_solid_blocks(ArchiveWriter *writer) {
+    size_t count = writer->previous_directory.count;
+    size_t *holders = calloc(count > 0 ? count : 1, sizeof(size_t)); // Held file + 1 per previous entry
+    if (!holders) {
+        fprintf(stderr, "Memory allocation failed for previous archive\n");
+        return;
+    }
+    for (size_t i = 0; i < writer->small_count; i++) {
+        if (writer->small[i].previous) {
+            holders[writer->small[i].previous - writer->previous_directory.entries] = i + 1;
+        }
+    }
+
+    // The copies are written straight away, behind everything in flight
+    while (writer->busy > 0) {
+        finish_oldest(writer);
+    }
+
+    const ArchiveEntry *entries = writer->previous_directory.entries;
+    for (size_t first = 0; first < count && writer->result == 0; ) {
+        size_t end = first + 1;
+        if (!entries[first].solid) {
+            first = end;
+            continue;
+        }
+        while (end < count && entries[end].solid && entries[end].offset == entries[first].offset) {
+            end++;
+        }
+
+        int reusable = 1;
+        for (size_t i = first; reusable && i < end; i++) {
+            reusable = holders[i] != 0 &&
+                       (!writer->compare_content ||
+                        content_unchanged(writer->small[holders[i] - 1].source, entries[i].crc));
+        }
+        if (reusable && copy_solid_block(writer, first, end, holders) < 0) {
+            writer->result = -1;
+        }
+        first = end;
+    }
+    free(holders);
+}
+
+// Packs the small files held back into solid blocks and queues the blocks
+// behind the other entries
+static void add_solid_blocks(ArchiveWriter *writer) {
+    qsort(writer->small, writer->small_count, sizeof(SolidFile), compare_solid_files);
+    size_t count = writer->small_count;
+    while (count > 0 && writer->small[count - 1].reused) {
+        count--;
+    }
+
+    size_t block_size = solid_block_size(writer->algorithm);
+    size_t first = 0;
+    while (first < count) {
+        size_t raw_size = writer->small[first].entry.size;
+        size_t end = first + 1;
+        while (end < count && raw_size + writer->small[end].entry.size <= block_size) {
+            raw_size += writer->small[end].entry.size;
+            end++;
+        }
+
+        ArchiveJob *job = claim_slot(writer, entry_bound(writer, raw_size));
+        if (!job) {
+            return;
+        }
+        job->entry.path = "";
+        job->entry.size = raw_size;
+        job->members = &writer->small[first];
+        job->member_count = end - first;
+        job->queued = 1;
+        thread_pool_submit(writer->pool, &job->task, compress_solid_block, job);
+        first = end;
+    }
+}
+
+// Writes the central directory and its footer after the last entry.
+// Returns 0 on success, -1 on error.
+static int write_directory(ArchiveWriter *writer) {
+    uint8_t header[1 + VARINT_MAX_BYTES];
+    header[0] = ARCHIVE_DIRECTORY_VERSION;
+    size_t header_size = 1 + encode_varint(writer->entry_count, header + 1);
+
+    uint8_t footer[ARCHIVE_FOOTER_SIZE];
+    store_le64(footer, header_size + writer->directory_size);
+    memcpy(footer + 8, ARCHIVE_DIRECTORY_MAGIC, 4);
+
+    if (fwrite(header, 1, header_size, writer->archive) != header_size ||
+        fwrite(writer->directory, 1, writer->directory_size, writer->archive) != writer->directory_size ||
+        fwrite(footer, 1, sizeof(footer), writer->archive) != sizeof(footer)) {
+        perror("Error writing archive directory");
+        return -1;
+    }
+    return 0;
+}
+
+// Copies the reusable solid blocks of the previous archive, queues the new
+// ones, writes out the entries still in flight and the central directory,
+// stops the pool and closes both archives. Returns 0 if every write succeeded, -1
+// otherwise.
+static int archive_writer_close(ArchiveWriter *writer) {
+    if (writer->result == 0 && writer->previous) {
+        reuse_solid_blocks(writer);
+    }
+    if (writer->result == 0 && writer->small_count > 0) {
+        add_solid_blocks(writer);
+    }
+    while (writer->busy > 0) {
+        finish_oldest(writer);
+    }
+    thread_pool_destroy(writer->pool);
+
+    for (size_t i = 0; i < writer->small_count; i++) {
+        free(writer->small[i].source);
+    }
+    free(writer->small);
+
+    for (int i = 0; i < writer->job_count; i++) {
+        huffman_builder_free(writer->jobs[i].builder);
+    }
+    free(writer->jobs);
+
+    if (writer->result == 0 && write_directory(writer) != 0) {
+        writer->result = -1;
+    }
+    free(writer->directory);
+
+    if (fclose(writer->archive) != 0 && writer->result == 0) {
+        perror("Error closing archive");
+        writer->result = -1;
+    }
+    close_previous_archive(writer);
+    return writer->result;
+}
+
+// Cleans a path into the name it is stored under: empty and "."
+// components are dropped and ".." takes back the component before it, so
+// the name never starts with "/" or leaves the archive root.
+// Returns 0 on success, -1 if no name is left or it does not fit.
+static int archive_name(const char *path, char *name, size_t capacity) {
+    size_t length = 0;
+    for (const char *part = path; *part; ) {
+        size_t part_length = strcspn(part, "/");
+        if (part_length == 2 && part[0] == '.' && part[1] == '.') {
+            while (length > 0 && name[length - 1] != '/') {
+                length--;
+            }
+            length -= length > 0;
+        } else if (part_length > 0 && !(part_length == 1 && part[0] == '.')) {
+            if (length + (length > 0) + part_length >= capacity) {
+                return -1;
+            }
+            if (length > 0) {
+                name[length++] = '/';
+            }
+            memcpy(name + length, part, part_length);
+            length += part_length;
+        }
+        part += part_length;
+        part += *part == '/';
+    }
+    name[length] = '\0';
+    return length > 0 ? 0 : -1;
+}
+
+// Queues a file found by the directory scanner. Returns non-zero to stop
+// the scan once the archive has failed.
+static int add_scanned_file(void *context, const char *source, const char *name, const struct stat *file_stat) {
+    ArchiveWriter *writer = context;
+    archive_writer_add(writer, source, name, file_stat);
+    return writer->result;
+}
+
+int compress_directory(const char *input_dir, const char *output_archive, CompressionAlgorithm algorithm,
+                       CompressionLevel level, const ArchiveOptions *options) {
+    // Entries are stored below the directory's own name, or at the root
+    // when it has none, like "." or "/"
+    char prefix[PATH_MAX] = "";
+    if (archive_name(input_dir, prefix, sizeof(prefix)) == 0) {
+        char *slash = strrchr(prefix, '/');
+        if (slash) {
+            memmove(prefix, slash + 1, strlen(slash + 1) + 1);
+        }
+    }
+
+    ArchiveWriter writer;
+    if (archive_writer_open(&writer, output_archive, algorithm, level, options) != 0) {
+        return -1;
+    }
+
+    int scan_threads = options && options->scan_threads > 1 ? options->scan_threads : 1;
+    int result = scan_directory(input_dir, prefix, scan_threads, add_scanned_file, &writer);
+    if (archive_writer_close(&writer) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+int compress_multiple_files(char **input_files, int file_count, const char *output_archive,
+                            CompressionAlgorithm algorithm, CompressionLevel level, const ArchiveOptions *options) {
+    ArchiveWriter writer;
+    if (archive_writer_open(&writer, output_archive, algorithm, level, options) != 0) {
+        return -1;
+    }
+
+    struct stat file_stat;
+    char name[PATH_MAX];
+    for (int i = 0; i < file_count && writer.result == 0; i++) {
+        // Get file information
+        if (stat(input_files[i], &file_stat) < 0) {
+            perror("Error getting file information");
+            continue;
+        }
+        if (archive_name(input_files[i], name, sizeof(name)) != 0) {
+            fprintf(stderr, "No name to store %s under\n", input_files[i]);
+            continue;
+        }
+
+        archive_writer_add(&writer, input_files[i], name, &file_stat);
+    }
+
+    return archive_writer_close(&writer);
+}
+
+int archive_read_directory(FILE *archive, ArchiveDirectory *directory) {
+    memset(directory, 0, sizeof(ArchiveDirectory));
+
+    off_t end;
+    uint8_t footer[ARCHIVE_FOOTER_SIZE];
+    if (fseeko(archive, 0, SEEK_END) != 0 || (end = ftello(archive)) < ARCHIVE_FOOTER_SIZE ||
+        fseeko(archive, end - ARCHIVE_FOOTER_SIZE, SEEK_SET) != 0 ||
+        fread(footer, 1, sizeof(footer), archive) != sizeof(footer) ||
+        memcmp(footer + 8, ARCHIVE_DIRECTORY_MAGIC, 4) != 0) {
+        fprintf(stderr, "Not an archive with a directory\n");
+        return -1;
+    }
+
+    uint64_t size = load_le64(footer);
+    off_t start = end - ARCHIVE_FOOTER_SIZE - (off_t)size;
+    if (size < 2 || size > (uint64_t)(end - ARCHIVE_FOOTER_SIZE) || size > SIZE_MAX) {
+        fprintf(stderr, "Invalid archive directory\n");
+        return -1;
+    }
+
+    // Every path is shorter than its entry, so the names fit in size bytes
+    uint8_t *bytes = malloc(size);
+    directory->names = malloc(size);
+    if (!bytes || !directory->names) {
+        fprintf(stderr, "Memory allocation failed for archive directory\n");
+        free(bytes);
+        archive_directory_free(directory);
+        return -1;
+    }
+    if (fseeko(archive, start, SEEK_SET) != 0 || fread(bytes, 1, size, archive) != size) {
+        perror("Error reading archive directory");
+        free(bytes);
+        archive_directory_free(directory);
+        return -1;
+    }
+
+    int result = 0;
+    uint64_t count = 0;
+    size_t pos = 1;
+    size_t used = decode_varint(bytes + pos, size - pos, &count);
+    if (bytes[0] != ARCHIVE_DIRECTORY_VERSION || used == 0 || count > (size - pos) / ARCHIVE_ENTRY_MIN_SIZE) {
+        result = -1;
+    }
+    pos += used;
+
+    if (result == 0 && count > 0) {
+        directory->entries = calloc(count, sizeof(ArchiveEntry));
+        if (!directory->entries) {
+            fprintf(stderr, "Memory allocation failed for archive directory\n");
+            free(bytes);
+            archive_directory_free(directory);
+            return -1;
+        }
+    }
+
+    // One pass over the whole directory
+    char *name = directory->names;
+    for (uint64_t i = 0; result == 0 && i < count; i++) {
+        ArchiveEntry *entry = &directory->entries[i];
+        used = decode_directory_entry(bytes + pos, size - pos, entry, name);
+        if (used == 0 || entry->offset + ARCHIVE_HEADER_FIXED_SIZE > (uint64_t)start ||
+            entry->compressed_size > (uint64_t)start - entry->offset - ARCHIVE_HEADER_FIXED_SIZE) {
+            result = -1;
+            break;
+        }
+        pos += used;
+        name += strlen(name) + 1;
+        directory->count++;
+    }
+    free(bytes);
+
+    if (result != 0 || pos != size) {
+        fprintf(stderr, "Invalid archive directory\n");
+        archive_directory_free(directory);
+        return -1;
+    }
+    return 0;
+}
+
+void archive_directory_free(ArchiveDirectory *directory) {
+    free(directory->entries);
+    free(directory->names);
+    memset(directory, 0, sizeof(ArchiveDirectory));
+}
+
+// Name of a codec id, for listings
+static const char* codec_name(int codec) {
+    switch (codec) {
+        case FRAME_CODEC_RLE:
+            return "rle";
+        case FRAME_CODEC_HUFFMAN:
+            return "huffman";
+        case FRAME_CODEC_HYBRID:
+            return "hybrid";
+        default:
+            return "unknown";
+    }
+}
+
+// Formats a file mode the way ls does, e.g. "-rw-r--r--"
+static void format_mode(uint32_t mode, char *text) {
+    const char *flags = "rwxrwxrwx";
+    text[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : '-';
+    for (int i = 0; i < 9; i++) {
+        text[1 + i] = (mode & (0400 >> i)) ? flags[i] : '-';
+    }
+    text[10] = '\0';
+}
+
+int list_archive(const char *archive_path, FILE *output) {
+    FILE *archive = fopen(archive_path, "rb");
+    if (!archive) {
+        perror("Error opening archive");
+        return -1;
+    }
+
+    ArchiveDirectory directory;
+    if (archive_read_directory(archive, &directory) != 0) {
+        fclose(archive);
+        return -1;
+    }
+    fclose(archive);
+
+    for (size_t i = 0; i < directory.count; i++) {
+        const ArchiveEntry *entry = &directory.entries[i];
+        char mode[11];
+        char mtime[32] = "?";
+        char compressed_size[24] = "solid";
+        time_t seconds = (time_t)entry->mtime;
+        struct tm local;
+        format_mode(entry->mode, mode);
+        if (!entry->solid) {
+            snprintf(compressed_size, sizeof(compressed_size), "%llu", (unsigned long long)entry->compressed_size);
+        }
+        if (localtime_r(&seconds, &local)) {
+            strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", &local);
+        }
+        fprintf(output, "%s %12llu %12s %s %-7s %s\n", mode, (unsigned long long)entry->size,
+                compressed_size, mtime, codec_name(entry->codec), entry->path);
+    }
+
+    archive_directory_free(&directory);
+    return 0;
+}
+
+// Path an entry is extracted to: its stored path below the current
+// directory, without leading slashes or "./". Returns NULL for paths that
+// would end up outside the current directory.
+static const char* extraction_path(const char *path) {
+    while (*path == '/' || (path[0] == '.' && path[1] == '/')) {
+        path += *path == '/' ? 1 : 2;
+    }
+
+    for (const char *part = path; *part; ) {
+        size_t length = strcspn(part, "/");
+        if (length == 2 && part[0] == '.' && part[1] == '.') {
+            return NULL;
+        }
+        part += length;
+        part += *part == '/';
+    }
+    return *path ? path : NULL;
+}
+
+// Creates the directories leading up to path.
+// Returns 0 on success, -1 on error.
+static int make_parent_directories(const char *path) {
+    char buffer[PATH_MAX];
+    snprintf(buffer, sizeof(buffer), "%s", path);
+
+    for (char *slash = strchr(buffer + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(buffer, 0777) != 0 && errno != EEXIST) {
+            perror("Error creating directory");
+            return -1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
+
+// Tells whether an entry was asked for: all are without paths, otherwise an
+// entry matches a path naming it or a directory above it
+static int entry_selected(const ArchiveEntry *entry, char **paths, int path_count, int *found) {
+    int selected = path_count == 0;
+    for (int i = 0; i < path_count; i++) {
+        size_t length = strlen(paths[i]);
+        while (length > 1 && paths[i][length - 1] == '/') {
+            length--;
+        }
+        if (strncmp(entry->path, paths[i], length) == 0 &&
+            (entry->path[length] == '\0' || entry->path[length] == '/')) {
+            found[i] = 1;
+            selected = 1;
+        }
+    }
+    return selected;
+}
+
+// Entry picked for extraction
+typedef struct {
+    const ArchiveEntry *entry;
+    const char *path;   // Where it is extracted to
+    int ready;          // Its directory exists
+    int done;           // Extracted and verified
+} ExtractTarget;
+
+// One entry, or the files of one solid block, being extracted, with the
+// slot's own handle on the archive
+typedef struct {
+    ThreadPoolTask task;
+    int busy;
+    FILE *archive;
+    ExtractTarget *targets;
+    size_t target_count;
+} ExtractJob;
+
+// Extracts one entry into a file preallocated to its size and verifies
+// its size and checksum. A file that fails is removed again, so no
+// preallocated or partial output is left behind.
+// Returns 0 on success, -1 on error.
+static int extract_entry(FILE *archive, const ArchiveEntry *entry, const char *path) {
+    ArchiveEntry local;
+    char name[PATH_MAX];
+    int flags;
+    if (fseeko(archive, (off_t)entry->offset, SEEK_SET) != 0 ||
+        read_entry_header(archive, &local, name, &flags) == 0 || strcmp(name, entry->path) != 0 ||
+        local.codec != entry->codec || local.size != entry->size ||
+        (!(flags & ARCHIVE_FLAG_DESCRIPTOR) && local.compressed_size != entry->compressed_size)) {
+        fprintf(stderr, "Archive entry %s does not match the directory\n", entry->path);
+        return -1;
+    }
+
+    FILE *output_file = fopen(path, "wb");
+    if (!output_file) {
+        perror("Error opening output file");
+        return -1;
+    }
+    if (entry->size > 0) {
+        // Best effort: file systems without support simply grow the file
+        posix_fallocate(fileno(output_file), 0, (off_t)entry->size);
+    }
+
+    OutputSink sink;
+    FILE *stream = output_sink_open(output_file, entry->size, 1, &sink);
+    int result = stream ? decompress_stream(archive, stream, entry->codec) : -1;
+    if (stream && fclose(stream) != 0) {
+        result = -1;
+    }
+    if (sink.exceeded) {
+        fprintf(stderr, "Archive entry %s decodes to more than its recorded size\n", entry->path);
+    }
+    if (fclose(output_file) != 0) {
+        perror("Error writing output file");
+        result = -1;
+    }
+    if (result != 0) {
+        fprintf(stderr, "Error extracting %s\n", entry->path);
+    } else if (sink.written != entry->size || sink.crc != entry->crc) {
+        fprintf(stderr, "Checksum mismatch for %s\n", entry->path);
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(path);
+    }
+    return result;
+}
+
+// Decodes a solid block into memory once and writes out the files picked
+// from it, checking each against its size and checksum
+static void extract_solid_block(FILE *archive, ExtractTarget *targets, size_t count) {
+    const ArchiveEntry *first = targets[0].entry;
+    ArchiveEntry block;
+    char name[PATH_MAX];
+    int flags;
+    if (fseeko(archive, (off_t)first->offset, SEEK_SET) != 0 ||
+        read_entry_header(archive, &block, name, &flags) == 0 || !(flags & ARCHIVE_FLAG_SOLID) ||
+        block.codec != first->codec || block.compressed_size != first->compressed_size) {
+        fprintf(stderr, "Solid block of %s does not match the directory\n", first->path);
+        return;
+    }
+
+    // No writer packs more than solid_block_size, so a larger block is corrupt
+    int algorithm = codec_algorithm(block.codec);
+    if (algorithm < 0 || block.size > solid_block_size(algorithm)) {
+        fprintf(stderr, "Solid block of %s is larger than a solid block can be\n", first->path);
+        return;
+    }
+
+    // The payload decodes into a buffer of exactly the block size, so a
+    // stream that runs longer fails instead of growing the output
+    uint8_t *payload = malloc(block.compressed_size > 0 ? block.compressed_size : 1);
+    uint8_t *data = malloc(block.size > 0 ? block.size : 1);
+    size_t data_size = 0;
+    int result = -1;
+    if (!payload || !data) {
+        fprintf(stderr, "Memory allocation failed for solid block\n");
+    } else if (fread(payload, 1, block.compressed_size, archive) != block.compressed_size) {
+        fprintf(stderr, "Unexpected end of archive\n");
+    } else {
+        result = codec_decompress(algorithm, payload, block.compressed_size, data, block.size, &data_size);
+    }
+    free(payload);
+    if (result != 0 || data_size != block.size) {
+        fprintf(stderr, "Error extracting the solid block of %s\n", first->path);
+        free(data);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const ArchiveEntry *entry = targets[i].entry;
+        if (!targets[i].ready) {
+            continue;
+        }
+        if (entry->solid_offset > data_size || entry->size > data_size - entry->solid_offset ||
+            crc32_update(0, data + entry->solid_offset, entry->size) != entry->crc) {
+            fprintf(stderr, "Checksum mismatch for %s\n", entry->path);
+            continue;
+        }
+
+        FILE *output_file = fopen(targets[i].path, "wb");
+        if (!output_file) {
+            perror("Error opening output file");
+            continue;
+        }
+        size_t written = fwrite(data + entry->solid_offset, 1, entry->size, output_file);
+        if (fclose(output_file) != 0 || written != entry->size) {
+            perror("Error writing output file");
+            unlink(targets[i].path);
+            continue;
+        }
+        targets[i].done = 1;
+    }
+    free(data);
+}
+
+// Extracts the entry or solid block of a job (pool task)
+static void extract_job(void *arg) {
+    ExtractJob *job = arg;
+    if (job->targets[0].entry->solid) {
+        extract_solid_block(job->archive, job->targets, job->target_count);
+    } else {
+        job->targets[0].done = extract_entry(job->archive, job->targets[0].entry, job->targets[0].path) == 0;
+    }
+}
+
+// Creates the directories of every target, each once; targets are in
+// archive order, so files of one directory follow each other
+static void make_target_directories(ExtractTarget *targets, size_t count) {
+    const char *previous = NULL;
+    size_t previous_length = 0;
+    int previous_ready = 1;
+    for (size_t i = 0; i < count; i++) {
+        const char *slash = strrchr(targets[i].path, '/');
+        size_t length = slash ? (size_t)(slash - targets[i].path) : 0;
+        if (!previous || length != previous_length || strncmp(targets[i].path, previous, length) != 0) {
+            previous = targets[i].path;
+            previous_length = length;
+            previous_ready = make_parent_directories(targets[i].path) == 0;
+        }
+        targets[i].ready = previous_ready;
+    }
+}
+
+// Extracts the targets on thread_count threads. Each slot of the job ring
+// reads the archive through its own handle. Files of one solid block are
+// next to each other in the directory and are extracted by one job.
+// Returns 0 on success, -1 if the archive cannot be opened.
+static int extract_targets(const char *archive_path, ExtractTarget *targets, size_t count, int thread_count) {
+    ThreadPool *pool = thread_count > 1 ? thread_pool_create(thread_count) : NULL;
+    int job_count = pool ? 2 * thread_count : 1;
+    ExtractJob *jobs = calloc(job_count, sizeof(ExtractJob));
+    int result = jobs ? 0 : -1;
+    for (int i = 0; result == 0 && i < job_count; i++) {
+        jobs[i].archive = fopen(archive_path, "rb");
+        if (!jobs[i].archive) {
+            perror("Error opening archive");
+            result = -1;
+        }
+    }
+
+    size_t submitted = 0;
+    for (size_t i = 0; result == 0 && i < count; ) {
+        size_t end = i + 1;
+        if (targets[i].entry->solid) {
+            while (end < count && targets[end].entry->solid && targets[end].entry->offset == targets[i].entry->offset) {
+                end++;
+            }
+        } else if (!targets[i].ready) {
+            i = end;
+            continue;
+        }
+
+        ExtractJob *job = &jobs[submitted++ % job_count];
+        if (job->busy) {
+            thread_pool_wait_task(pool, &job->task);
+        }
+        job->targets = &targets[i];
+        job->target_count = end - i;
+        thread_pool_submit(pool, &job->task, extract_job, job);
+        job->busy = 1;
+        i = end;
+    }
+
+    for (int i = 0; jobs && i < job_count; i++) {
+        if (jobs[i].busy) {
+            thread_pool_wait_task(pool, &jobs[i].task);
+        }
+        if (jobs[i].archive) {
+            fclose(jobs[i].archive);
+        }
+    }
+    free(jobs);
+    thread_pool_destroy(pool);
+    return result;
+}
+
+int extract_archive(const char *archive_path, char **paths, int path_count, const ArchiveOptions *options) {
+    FILE *archive = fopen(archive_path, "rb");
+    if (!archive) {
+        perror("Error opening archive");
+        return -1;
+    }
+
+    ArchiveDirectory directory;
+    int read_result = archive_read_directory(archive, &directory);
+    fclose(archive);
+    if (read_result != 0) {
+        return -1;
+    }
+
+    int *found = calloc(path_count > 0 ? path_count : 1, sizeof(int));
+    ExtractTarget *targets = calloc(directory.count > 0 ? directory.count : 1, sizeof(ExtractTarget));
+    if (!found || !targets) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(found);
+        free(targets);
+        archive_directory_free(&directory);
+        return -1;
+    }
+
+    // Pick the entries asked for and where they go
+    int result = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < directory.count; i++) {
+        const ArchiveEntry *entry = &directory.entries[i];
+        if (!entry_selected(entry, paths, path_count, found)) {
+            continue;
+        }
+        const char *path = extraction_path(entry->path);
+        if (!path) {
+            fprintf(stderr, "Refusing to extract %s outside the current directory\n", entry->path);
+            result = -1;
+            continue;
+        }
+        targets[count].entry = entry;
+        targets[count].path = path;
+        count++;
+    }
+    for (int i = 0; i < path_count; i++) {
+        if (!found[i]) {
+            fprintf(stderr, "Not found in archive: %s\n", paths[i]);
+            result = -1;
+        }
+    }
+
+    // Create the directory tree up front, then decode the files concurrently
+    make_target_directories(targets, count);
+    int thread_count = options && options->thread_count > 0 ? options->thread_count : thread_pool_default_threads();
+    if (extract_targets(archive_path, targets, count, thread_count) != 0) {
+        result = -1;
+    }
+
+    // Restore permissions and modification times in one pass once all data
+    // is written. Setuid, setgid and sticky bits are not restored.
+    for (size_t i = 0; i < count; i++) {
+        if (!targets[i].done) {
+            result = -1;
+            continue;
+        }
+        struct timespec times[2] = { { 0, UTIME_OMIT }, { (time_t)targets[i].entry->mtime, 0 } };
+        if (chmod(targets[i].path, (mode_t)(targets[i].entry->mode & 0777)) != 0 ||
+            utimensat(AT_FDCWD, targets[i].path, times, 0) != 0) {
+            perror("Error restoring file attributes");
+        }
+    }
+
+    free(found);
+    free(targets);
+    archive_directory_free(&directory);
+    return result;
+}
@@ -3,20 +3,62 @@
 
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "../reports/compression_report.h"
 
 
+// Compressed bytes the archive writers hold in memory by default
+#define ARCHIVE_DEFAULT_MEMORY_BUDGET ((size_t)256 * 1024 * 1024)
+
+
+// Largest file packed into a solid block in solid mode
+#define ARCHIVE_SOLID_FILE_MAX (64 * 1024)
+
+// Raw size of a Huffman or hybrid solid block
+#define ARCHIVE_SOLID_TABLE_BLOCK_SIZE (256 * 1024)
+
+
+// Settings for the archive writers. Entries are compressed concurrently
+// and written in order; finished entries wait in memory until their turn,
+// and entries too large for a fair share of the budget are compressed
+// straight into the archive, on all threads, when their turn comes.
+// Directories can be listed by several threads at once, which pays off on
+// network file systems but makes the entry order vary between runs.
+// In solid mode files of up to ARCHIVE_SOLID_FILE_MAX bytes are sorted by
+// extension and size and compressed together in solid blocks, after the
+// other entries, so they share a code table and context instead of paying
+// for their own. A block whose files come out no larger compressed one by
+// one is written as separate entries instead.
+// When updating a previous archive, files whose size, modification time
+// and inode are unchanged, and which were stored with the same codec, are
+// copied from it without compressing them again; a solid block is copied
+// when all of its files are. Comparing content as well reads each such
+// file and checks it against the CRC-32 in the previous directory.
+typedef struct {
+    int thread_count;      // Entries compressed at once; 0 uses every online CPU
+    size_t memory_budget;  // Bytes of compressed entries held in memory; 0 uses the default
+    int scan_threads;      // Threads listing directories; 0 or 1 lists them on the calling thread
+    int solid;             // Pack small files into solid blocks
+    const char *previous_archive;  // Archive to copy unchanged files from, or NULL
+    int compare_content;   // Copy unchanged files only if their content still matches
+} ArchiveOptions;
+
+
 // Compresses an entire directory into an archive
 // input_dir: Path to the directory to compress
 // output_archive: Path to the output archive file
 // algorithm: Compression algorithm to use (RLE, Huffman, or Hybrid)
 // level: Compression intensity (fast, balanced, or maximum)
+// options: Threads, memory budget, scanner threads, solid mode and the
+//          archive to update, or NULL for the defaults
 // Returns: 0 on success, -1 on error
 int compress_directory(
     const char *input_dir,           // Input directory path
     const char *output_archive,      // Output archive file path
     CompressionAlgorithm algorithm,  // Compression algorithm type
-    CompressionLevel level           // Compression intensity level
+    CompressionLevel level,          // Compression intensity level
+    const ArchiveOptions *options    // Threads and memory budget
 );
 
 
@@ -26,14 +68,67 @@ int compress_directory(
 // output_archive: Path to the output archive file
 // algorithm: Compression algorithm to use (RLE, Huffman, or Hybrid)
 // level: Compression intensity (fast, balanced, or maximum)
+// options: Threads, memory budget, solid mode and the archive to update,
+//          or NULL for the defaults
 // Returns: 0 on success, -1 on error
 int compress_multiple_files(
     char **input_files,               // Array of input file paths
     int file_count,                   // Number of input files
     const char *output_archive,       // Output archive file path
     CompressionAlgorithm algorithm,   // Compression algorithm type
-    CompressionLevel level            // Compression intensity level
+    CompressionLevel level,           // Compression intensity level
+    const ArchiveOptions *options     // Threads and memory budget
 );
 
 
+// Entry of an archive's central directory
+typedef struct {
+    const char *path;          // Path relative to the archive root
+    int codec;                 // Codec id of the payload (FRAME_CODEC_*)
+    uint64_t size;             // Original size
+    uint64_t compressed_size;  // Payload size, of the whole block for files in a solid block
+    uint64_t offset;           // Offset of the entry's header, or of its solid block's
+    int solid;                 // Stored in a solid block with other small files
+    uint64_t solid_offset;     // Offset of the data in the solid block's decoded payload
+    uint32_t mode;
+    int64_t mtime;
+    uint64_t inode;            // Inode of the source file, to tell unchanged files
+    uint32_t crc;              // CRC-32 of the original data
+} ArchiveEntry;
+
+
+// Central directory of an archive
+typedef struct {
+    ArchiveEntry *entries;
+    size_t count;
+    char *names;               // Storage for the entry paths
+} ArchiveDirectory;
+
+
+// Reads the central directory at the end of a seekable archive.
+// Returns 0 on success, -1 if the archive has no valid directory.
+int archive_read_directory(FILE *archive, ArchiveDirectory *directory);
+
+
+// Releases a directory read by archive_read_directory
+void archive_directory_free(ArchiveDirectory *directory);
+
+
+// Prints the mode, size, compressed size ("solid" for files in a solid
+// block), modification time, codec and path of every entry from the
+// central directory, without reading any payload.
+// Returns 0 on success, -1 on error.
+int list_archive(const char *archive_path, FILE *output);
+
+
+// Extracts entries below the current directory, restoring their mode and
+// modification time. With no paths every entry is extracted; otherwise
+// only entries named by a path, or below a directory named by one. The
+// directories are created first, then the files are decoded concurrently
+// on options->thread_count threads into preallocated outputs and checked
+// against their size and checksum.
+// Returns 0 if every entry was extracted and every path found, -1 otherwise.
+int extract_archive(const char *archive_path, char **paths, int path_count, const ArchiveOptions *options);
+
+
 #endif // ARCHIVE_H
\ No newline at end of file
@@ -0,0 +1,370 @@
+#define _GNU_SOURCE // openat, fstatat, fdopendir, d_type
+
+#include "directory_scan.h"
+#include "../utils/thread_pool.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Fallback definition if not provided by system headers
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+// Files the scanner threads may find ahead of the calling thread
+#define SCAN_QUEUE_SIZE 1024
+
+// File found by a scanner thread, waiting for the calling thread
+typedef struct {
+    char *path;             // Relative to the root
+    struct stat file_stat;
+} ScannedFile;
+
+// Directory whose subdirectories wait on the stack. It stays open so they
+// can be opened relative to it and is closed once the last one is.
+typedef struct {
+    DIR *dir;
+    int references;              // Queued subdirectories and the thread listing it
+} OpenDirectory;
+
+// Directory waiting to be listed
+typedef struct {
+    OpenDirectory *parent;       // NULL for the root
+    char *path;                  // Relative to the root
+    size_t name_offset;          // Start of the name in path
+} QueuedDirectory;
+
+// State shared by the scanner threads. Directories are listed in any
+// order; the subdirectories they contain go back onto the stack.
+typedef struct {
+    int root_fd;
+    const char *root;
+    const char *prefix;
+    ScanFileFunction file_fn;
+    void *context;
+    int threaded;                // Files are queued for the calling thread
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;   // A directory was queued, or the scan is over
+    pthread_cond_t file_ready;   // A file was queued, or a scanner finished
+    pthread_cond_t space_ready;  // A queued file was taken, or the scan stops
+    QueuedDirectory *directories; // Directories waiting to be listed
+    size_t directory_count;
+    size_t directory_capacity;
+    int listing;                 // Directories being listed
+    int scanners;                // Scanner threads still running
+    ScannedFile *files;          // Ring of files found, threaded scans only
+    size_t file_head;
+    size_t file_count;
+    int stop;                    // file_fn asked to stop
+} DirectoryScan;
+
+// Joins a path relative to the root and an entry name into a new string.
+// Returns NULL on allocation failure.
+static char* join_path(const char *directory, const char *name) {
+    size_t directory_length = strlen(directory);
+    size_t name_length = strlen(name);
+    char *path = malloc(directory_length + name_length + 2);
+    if (!path) {
+        fprintf(stderr, "Memory allocation failed for directory scan\n");
+        return NULL;
+    }
+
+    if (directory_length > 0) {
+        memcpy(path, directory, directory_length);
+        path[directory_length++] = '/';
+    }
+    memcpy(path + directory_length, name, name_length + 1);
+    return path;
+}
+
+// Hands a file to file_fn with the path to open it by and its stored name.
+// Returns what file_fn returns.
+static int report_file(DirectoryScan *scan, const char *path, const struct stat *file_stat) {
+    char source[PATH_MAX];
+    char name[PATH_MAX];
+    if (snprintf(source, sizeof(source), "%s/%s", scan->root, path) >= (int)sizeof(source) ||
+        snprintf(name, sizeof(name), "%s%s%s", scan->prefix, *scan->prefix ? "/" : "", path) >= (int)sizeof(name)) {
+        fprintf(stderr, "Path too long: %s/%s\n", scan->root, path);
+        return 0;
+    }
+    return scan->file_fn(scan->context, source, name, file_stat);
+}
+
+// Drops a reference to an open directory, closing it with the last one.
+// Called with the scan lock held.
+static void release_directory(OpenDirectory *directory) {
+    if (directory && --directory->references == 0) {
+        closedir(directory->dir);
+        free(directory);
+    }
+}
+
+// Puts a subdirectory of parent on the stack of directories to list,
+// taking over path
+static void queue_directory(DirectoryScan *scan, OpenDirectory *parent, char *path, size_t name_offset) {
+    pthread_mutex_lock(&scan->lock);
+    if (scan->directory_count == scan->directory_capacity) {
+        size_t capacity = scan->directory_capacity ? 2 * scan->directory_capacity : 64;
+        QueuedDirectory *directories = realloc(scan->directories, capacity * sizeof(QueuedDirectory));
+        if (!directories) {
+            pthread_mutex_unlock(&scan->lock);
+            fprintf(stderr, "Memory allocation failed for directory scan, skipping %s\n", path);
+            free(path);
+            return;
+        }
+        scan->directories = directories;
+        scan->directory_capacity = capacity;
+    }
+    QueuedDirectory *queued = &scan->directories[scan->directory_count++];
+    queued->parent = parent;
+    queued->path = path;
+    queued->name_offset = name_offset;
+    if (parent) {
+        parent->references++;
+    }
+    pthread_cond_signal(&scan->work_ready);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+// Passes on a file found while listing, taking over path. A threaded scan
+// queues it for the calling thread, waiting while the queue is full.
+// Returns non-zero once the scan is to stop.
+static int found_file(DirectoryScan *scan, char *path, const struct stat *file_stat) {
+    if (!scan->threaded) {
+        scan->stop = report_file(scan, path, file_stat) != 0;
+        free(path);
+        return scan->stop;
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    while (scan->file_count == SCAN_QUEUE_SIZE && !scan->stop) {
+        pthread_cond_wait(&scan->space_ready, &scan->lock);
+    }
+    int stop = scan->stop;
+    if (!stop) {
+        ScannedFile *file = &scan->files[(scan->file_head + scan->file_count) % SCAN_QUEUE_SIZE];
+        file->path = path;
+        file->file_stat = *file_stat;
+        scan->file_count++;
+        pthread_cond_signal(&scan->file_ready);
+    }
+    pthread_mutex_unlock(&scan->lock);
+
+    if (stop) {
+        free(path);
+    }
+    return stop;
+}
+
+// Lists one directory, queueing its subdirectories and passing on its
+// regular files. The directory is opened relative to its parent without
+// following links, so a directory swapped for a link while queued is not
+// entered; path only makes up the names.
+static void list_directory(DirectoryScan *scan, const QueuedDirectory *queued) {
+    const char *path = queued->path;
+    int fd = queued->parent
+        ? openat(dirfd(queued->parent->dir), path + queued->name_offset,
+                 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+        : openat(scan->root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    pthread_mutex_lock(&scan->lock);
+    release_directory(queued->parent);
+    pthread_mutex_unlock(&scan->lock);
+
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        fprintf(stderr, "Error opening input directory %s: %s\n", *path ? path : scan->root, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    OpenDirectory *directory = malloc(sizeof(OpenDirectory));
+    if (!directory) {
+        fprintf(stderr, "Memory allocation failed for directory scan, skipping %s\n", path);
+        closedir(dir);
+        return;
+    }
+    directory->dir = dir;
+    directory->references = 1;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // Skip '.' and '..'
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        // Directories are known from d_type alone, and devices, pipes and
+        // sockets are skipped; files need their information anyway, and
+        // links and file systems without d_type need it to tell the type
+        unsigned char type = entry->d_type;
+        if (type != DT_DIR && type != DT_REG && type != DT_LNK && type != DT_UNKNOWN) {
+            continue;
+        }
+
+        struct stat file_stat;
+        if (type != DT_DIR && fstatat(dirfd(dir), entry->d_name, &file_stat, 0) != 0) {
+            perror("Error getting file information");
+            continue;
+        }
+
+        // Linked directories are not followed, as they may form cycles
+        int is_directory = type == DT_DIR || (type == DT_UNKNOWN && S_ISDIR(file_stat.st_mode));
+        if (!is_directory && !S_ISREG(file_stat.st_mode)) {
+            continue;
+        }
+
+        char *entry_path = join_path(path, entry->d_name);
+        if (!entry_path) {
+            continue;
+        }
+        if (is_directory) {
+            queue_directory(scan, directory, entry_path, strlen(entry_path) - strlen(entry->d_name));
+        } else if (found_file(scan, entry_path, &file_stat)) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    release_directory(directory);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+// Lists directories until none are left and no other scanner can find
+// more (pool task, or run directly for an unthreaded scan)
+static void scan_worker(void *arg) {
+    DirectoryScan *scan = arg;
+
+    pthread_mutex_lock(&scan->lock);
+    for (;;) {
+        while (scan->directory_count == 0 && scan->listing > 0 && !scan->stop) {
+            pthread_cond_wait(&scan->work_ready, &scan->lock);
+        }
+        if (scan->directory_count == 0 || scan->stop) {
+            break;
+        }
+
+        QueuedDirectory queued = scan->directories[--scan->directory_count];
+        scan->listing++;
+        pthread_mutex_unlock(&scan->lock);
+
+        list_directory(scan, &queued);
+        free(queued.path);
+
+        pthread_mutex_lock(&scan->lock);
+        scan->listing--;
+        if (scan->listing == 0 && scan->directory_count == 0) {
+            pthread_cond_broadcast(&scan->work_ready);
+        }
+    }
+
+    scan->scanners--;
+    pthread_cond_signal(&scan->file_ready);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+// Passes the files queued by the scanner threads to file_fn until every
+// scanner has finished. Once file_fn asks to stop, the scanners are told
+// to and the rest of the queue is dropped.
+static void consume_files(DirectoryScan *scan) {
+    pthread_mutex_lock(&scan->lock);
+    for (;;) {
+        while (scan->file_count == 0 && scan->scanners > 0) {
+            pthread_cond_wait(&scan->file_ready, &scan->lock);
+        }
+        if (scan->file_count == 0) {
+            break;
+        }
+
+        ScannedFile file = scan->files[scan->file_head];
+        scan->file_head = (scan->file_head + 1) % SCAN_QUEUE_SIZE;
+        scan->file_count--;
+        pthread_cond_signal(&scan->space_ready);
+        int stop = scan->stop;
+        pthread_mutex_unlock(&scan->lock);
+
+        if (!stop) {
+            stop = report_file(scan, file.path, &file.file_stat) != 0;
+        }
+        free(file.path);
+
+        pthread_mutex_lock(&scan->lock);
+        if (stop && !scan->stop) {
+            scan->stop = 1;
+            pthread_cond_broadcast(&scan->work_ready);
+            pthread_cond_broadcast(&scan->space_ready);
+        }
+    }
+    pthread_mutex_unlock(&scan->lock);
+}
+
+// Walks the tree below input_dir, calling file_fn for every regular file.
+// Returns 0 on success, -1 if input_dir cannot be opened.
+int scan_directory(const char *input_dir, const char *prefix, int thread_count,
+                   ScanFileFunction file_fn, void *context) {
+    DirectoryScan scan;
+    memset(&scan, 0, sizeof(DirectoryScan));
+    scan.root_fd = open(input_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scan.root_fd < 0) {
+        perror("Error opening input directory");
+        return -1;
+    }
+    scan.root = input_dir;
+    scan.prefix = prefix;
+    scan.file_fn = file_fn;
+    scan.context = context;
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.work_ready, NULL);
+    pthread_cond_init(&scan.file_ready, NULL);
+    pthread_cond_init(&scan.space_ready, NULL);
+
+    char *root = join_path("", "");
+    if (root) {
+        queue_directory(&scan, NULL, root, 0);
+    }
+
+    // Scanner threads need a queue to hand files over; without one the
+    // calling thread scans on its own
+    ThreadPool *pool = NULL;
+    ThreadPoolTask *tasks = NULL;
+    if (thread_count > 1) {
+        scan.files = malloc(SCAN_QUEUE_SIZE * sizeof(ScannedFile));
+        tasks = calloc(thread_count, sizeof(ThreadPoolTask));
+        pool = scan.files && tasks ? thread_pool_create(thread_count) : NULL;
+    }
+
+    if (pool) {
+        scan.threaded = 1;
+        scan.scanners = thread_count;
+        for (int i = 0; i < thread_count; i++) {
+            thread_pool_submit(pool, &tasks[i], scan_worker, &scan);
+        }
+        consume_files(&scan);
+        thread_pool_destroy(pool);
+    } else {
+        scan.scanners = 1;
+        scan_worker(&scan);
+    }
+
+    // Directories left over when the scan was stopped
+    for (size_t i = 0; i < scan.directory_count; i++) {
+        release_directory(scan.directories[i].parent);
+        free(scan.directories[i].path);
+    }
+    free(scan.directories);
+    free(scan.files);
+    free(tasks);
+    pthread_cond_destroy(&scan.space_ready);
+    pthread_cond_destroy(&scan.file_ready);
+    pthread_cond_destroy(&scan.work_ready);
+    pthread_mutex_destroy(&scan.lock);
+    close(scan.root_fd);
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef DIRECTORY_SCAN_H
+#define DIRECTORY_SCAN_H
+
+
+#include <sys/stat.h>
+
+
+// Called for every regular file found by scan_directory with the path to
+// open it by, the name it is stored under and its file information.
+// Returns 0 to go on scanning, anything else to stop.
+typedef int (*ScanFileFunction)(void *context, const char *source, const char *name,
+                                const struct stat *file_stat);
+
+
+// Walks the tree below input_dir without recursion. Directories are opened
+// relative to the root with openat and entries stat'ed relative to their
+// directory with fstatat; entries whose type readdir already reports are
+// not stat'ed unless their size is needed, so subdirectories cost no stat
+// at all. Symbolic links to files are followed, links to directories are
+// not. Names are input_dir's relative paths below prefix, or at the root
+// for an empty prefix.
+// With thread_count above 1, that many threads list directories at once
+// and hand the files found to file_fn, which always runs on the calling
+// thread. The order of the files then depends on timing; with one thread
+// it is the same on every run.
+// Returns 0 on success, -1 if input_dir cannot be opened. Entries that
+// cannot be read are reported and skipped.
+int scan_directory(const char *input_dir, const char *prefix, int thread_count,
+                   ScanFileFunction file_fn, void *context);
+
+
+#endif // DIRECTORY_SCAN_H
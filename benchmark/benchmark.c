@@ -2,17 +2,12 @@
 #include "../reports/compression_report.h"
 #include "../rle/rle.h"
 #include "../huffman/huffman.h"
+#include "../hybrid/hybrid.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <sys/resource.h>
 
-// External report variable
-extern CompressionReport report;
-
-// Compresses input to output with the given compression level. Returns 0 on success, < 0 on error.
-int hybrid_compress(FILE *input, FILE *output, int level);
-
 // Helper function to get CPU time
 double get_cpu_time() {
     struct rusage usage;
@@ -61,7 +56,8 @@ int benchmark_compression(const char *input_filename, CompressionAlgorithm algor
     } else if (algorithm == ALG_HUFFMAN) {
         compression_result = huffman_compress(input_file, compressed_file);
     } else if (algorithm == ALG_HYBRID) {
-        compression_result = hybrid_compress(input_file, compressed_file, level);
+        compression_result = hybrid_compress(input_file, compressed_file, hybrid_block_size(level), 1,
+                                             NULL, NULL, NULL, NULL);
     }
 
     if (compression_result != 0) {
@@ -100,12 +96,7 @@ int benchmark_compression(const char *input_filename, CompressionAlgorithm algor
     } else if (algorithm == ALG_HUFFMAN) {
         decompression_result = huffman_decompress(compressed_file, decompressed_file);
     } else if (algorithm == ALG_HYBRID) {
-        // Hybrid decompression is based on what was determined during compression
-        if (report.algorithm == ALG_RLE) {
-            decompression_result = rle_decompress(compressed_file, decompressed_file);
-        } else if (report.algorithm == ALG_HUFFMAN) {
-            decompression_result = huffman_decompress(compressed_file, decompressed_file);
-        }
+        decompression_result = hybrid_decompress(compressed_file, decompressed_file);
     }
         if (decompression_result != 0) {
         fprintf(stderr, "Error during decompression in benchmark\n");
@@ -0,0 +1,315 @@
+#include "codec.h"
+#include "../huffman/huffman.h"
+#include "../hybrid/hybrid.h"
+#include "../rle/rle.h"
+#include "../utils/histogram.h"
+#include "../utils/varint.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Number and size of the samples an estimate reads
+#define ESTIMATE_SAMPLE_COUNT 16
+#define ESTIMATE_SAMPLE_SIZE 4096
+
+// Code length table, block header and stream padding of a Huffman block
+#define HUFFMAN_BLOCK_OVERHEAD (2 + MAX_CHARS / 2 + 2 * VARINT_MAX_BYTES + 1 + HUFFMAN_JUMP_TABLE_SIZE)
+
+struct CodecStream {
+    CompressionAlgorithm algorithm;
+    int started;            // The RLE encoder has been given its first buffer
+    RleEncoder rle;
+    HuffmanEncoder huffman;
+    HybridEncoder hybrid;
+};
+
+// Statistics collected from the samples of an input
+typedef struct {
+    unsigned counts[HISTOGRAM_SIZE];
+    size_t bytes;
+    size_t runs;             // Runs of any length
+    size_t long_runs;        // Runs the RLE encoder turns into run tokens
+    size_t long_run_bytes;   // Bytes covered by those runs
+    size_t run_token_bytes;  // Size of their run tokens
+} SampleStats;
+
+// Adds a sample to the statistics. A run reaching the end of a sample is
+// assumed to go on past it, unless the sample ends the input, so long runs
+// are not counted as one run token per sample.
+static void add_sample(SampleStats *stats, const uint8_t *data, size_t size, int ends_input) {
+    histogram_count(data, size, stats->counts);
+    stats->bytes += size;
+
+    size_t i = 0;
+    while (i < size) {
+        size_t end = i + 1;
+        while (end < size && data[end] == data[i]) {
+            end++;
+        }
+
+        size_t length = end - i;
+        stats->runs++;
+        if (length >= RLE_MIN_RUN) {
+            stats->long_run_bytes += length;
+            if (end < size || ends_input) {
+                uint8_t control[VARINT_MAX_BYTES];
+                stats->long_runs++;
+                stats->run_token_bytes += encode_varint(((uint64_t)length << 1) | 1, control) + 1;
+            }
+        }
+        i = end;
+    }
+}
+
+// Turns sample statistics into predicted sizes for an input of input_size bytes
+static void finish_estimate(const SampleStats *stats, size_t input_size, CodecEstimate *estimate) {
+    estimate->input_size = input_size;
+    estimate->entropy = 0.0;
+    estimate->average_run = 0.0;
+    estimate->rle_size = RLE_MAGIC_SIZE + 1;
+    estimate->huffman_size = huffman_compress_bound(0, 1);
+    if (stats->bytes == 0) {
+        return;
+    }
+
+    estimate->entropy = histogram_entropy(stats->counts);
+    estimate->average_run = (double)stats->bytes / stats->runs;
+    double scale = (double)input_size / stats->bytes;
+
+    // Huffman codes are at least one bit long, except that a block with a
+    // single distinct byte takes none; blocks that do not shrink are stored
+    int symbol_count = 0;
+    for (int i = 0; i < HISTOGRAM_SIZE; i++) {
+        if (stats->counts[i] > 0) {
+            symbol_count++;
+        }
+    }
+    double bits = symbol_count <= 1 ? 0.0 : estimate->entropy < 1.0 ? 1.0 : estimate->entropy;
+    double coded = input_size * bits / 8;
+    if (coded > input_size) {
+        coded = input_size;
+    }
+    size_t block_count = input_size / HUFFMAN_BLOCK_SIZE_BALANCED + 1;
+    estimate->huffman_size += (size_t)coded + block_count * HUFFMAN_BLOCK_OVERHEAD;
+
+    // RLE turns long runs into run tokens and copies everything else into
+    // literal spans, each with a control word of up to two bytes
+    size_t literal_bytes = stats->bytes - stats->long_run_bytes;
+    size_t spans = 0;
+    if (literal_bytes > 0) {
+        spans = stats->long_runs + 1 < literal_bytes ? stats->long_runs + 1 : literal_bytes;
+        spans += literal_bytes / RLE_MAX_LITERAL;
+    }
+    double sampled = (double)(literal_bytes + 2 * spans + stats->run_token_bytes);
+    estimate->rle_size += (size_t)(sampled * scale);
+}
+
+// Predicts the output size of each algorithm for size bytes of data
+void codec_estimate_buffer(const uint8_t *data, size_t size, CodecEstimate *estimate) {
+    SampleStats stats = {{0}};
+
+    if (size <= ESTIMATE_SAMPLE_COUNT * ESTIMATE_SAMPLE_SIZE) {
+        add_sample(&stats, data, size, 1);
+    } else {
+        // The last sample ends the input
+        size_t stride = (size - ESTIMATE_SAMPLE_SIZE) / (ESTIMATE_SAMPLE_COUNT - 1);
+        for (int i = 0; i < ESTIMATE_SAMPLE_COUNT; i++) {
+            size_t offset = i < ESTIMATE_SAMPLE_COUNT - 1 ? i * stride : size - ESTIMATE_SAMPLE_SIZE;
+            add_sample(&stats, data + offset, ESTIMATE_SAMPLE_SIZE, i == ESTIMATE_SAMPLE_COUNT - 1);
+        }
+    }
+
+    finish_estimate(&stats, size, estimate);
+}
+
+// Predicts the output size of each algorithm for the rest of a file.
+// Returns 0 on success, -1 on error.
+int codec_estimate_file(FILE *file, CodecEstimate *estimate) {
+    long start = ftell(file);
+    if (start < 0 || fseek(file, 0, SEEK_END) != 0) {
+        fprintf(stderr, "Cannot sample an input that is not seekable\n");
+        return -1;
+    }
+    long end = ftell(file);
+    size_t size = end > start ? (size_t)(end - start) : 0;
+
+    // Small inputs are read in full, larger ones one sample at a time
+    size_t buffer_size = size < ESTIMATE_SAMPLE_COUNT * ESTIMATE_SAMPLE_SIZE ? size : ESTIMATE_SAMPLE_COUNT * ESTIMATE_SAMPLE_SIZE;
+    uint8_t *buffer = malloc(buffer_size ? buffer_size : 1);
+    if (!buffer) {
+        fprintf(stderr, "Memory allocation failed for input samples\n");
+        fseek(file, start, SEEK_SET);
+        return -1;
+    }
+
+    SampleStats stats = {{0}};
+    int result = 0;
+    if (size <= ESTIMATE_SAMPLE_COUNT * ESTIMATE_SAMPLE_SIZE) {
+        if (fseek(file, start, SEEK_SET) != 0 || fread(buffer, 1, size, file) != size) {
+            result = -1;
+        } else {
+            add_sample(&stats, buffer, size, 1);
+        }
+    } else {
+        size_t stride = (size - ESTIMATE_SAMPLE_SIZE) / (ESTIMATE_SAMPLE_COUNT - 1);
+        for (int i = 0; i < ESTIMATE_SAMPLE_COUNT; i++) {
+            size_t offset = i < ESTIMATE_SAMPLE_COUNT - 1 ? i * stride : size - ESTIMATE_SAMPLE_SIZE;
+            if (fseek(file, start + (long)offset, SEEK_SET) != 0 ||
+                fread(buffer, 1, ESTIMATE_SAMPLE_SIZE, file) != ESTIMATE_SAMPLE_SIZE) {
+                result = -1;
+                break;
+            }
+            add_sample(&stats, buffer, ESTIMATE_SAMPLE_SIZE, i == ESTIMATE_SAMPLE_COUNT - 1);
+        }
+    }
+    free(buffer);
+
+    if (fseek(file, start, SEEK_SET) != 0 || result != 0) {
+        perror("Error sampling input file");
+        return -1;
+    }
+
+    finish_estimate(&stats, size, estimate);
+    return 0;
+}
+
+// Returns the algorithm with the smallest predicted output
+CompressionAlgorithm codec_choose(const CodecEstimate *estimate) {
+    return estimate->rle_size < estimate->huffman_size ? ALG_RLE : ALG_HUFFMAN;
+}
+
+// Largest output codec_compress writes for size bytes of input
+size_t codec_bound(CompressionAlgorithm algorithm, CompressionLevel level, size_t size) {
+    switch (algorithm) {
+        case ALG_RLE:
+            return rle_compress_bound(size);
+        case ALG_HUFFMAN:
+            return huffman_compress_bound(size, huffman_block_size(level));
+        case ALG_HYBRID:
+            return hybrid_compress_bound(size, hybrid_block_size(level));
+        default:
+            return 0;
+    }
+}
+
+int codec_compress(CompressionAlgorithm algorithm, CompressionLevel level,
+                   const void *src, size_t size, void *dst, size_t capacity, size_t *compressed_size) {
+    switch (algorithm) {
+        case ALG_RLE:
+            return rle_compress_buffer(src, size, dst, capacity, compressed_size);
+        case ALG_HUFFMAN:
+            return huffman_compress_buffer(src, size, dst, capacity, huffman_block_size(level), compressed_size);
+        case ALG_HYBRID:
+            return hybrid_compress_buffer(src, size, dst, capacity, hybrid_block_size(level), compressed_size);
+        default:
+            fprintf(stderr, "Unsupported algorithm for buffer compression\n");
+            return -1;
+    }
+}
+
+int codec_decompress(CompressionAlgorithm algorithm, const void *src, size_t size,
+                     void *dst, size_t capacity, size_t *decompressed_size) {
+    switch (algorithm) {
+        case ALG_RLE:
+            return rle_decompress_buffer(src, size, dst, capacity, decompressed_size);
+        case ALG_HUFFMAN:
+            return huffman_decompress_buffer(src, size, dst, capacity, decompressed_size);
+        case ALG_HYBRID:
+            return hybrid_decompress_buffer(src, size, dst, capacity, decompressed_size);
+        default:
+            fprintf(stderr, "Unsupported algorithm for buffer decompression\n");
+            return -1;
+    }
+}
+
+CodecStream* codec_stream_create(CompressionAlgorithm algorithm, CompressionLevel level) {
+    if (algorithm != ALG_RLE && algorithm != ALG_HUFFMAN && algorithm != ALG_HYBRID) {
+        fprintf(stderr, "Unsupported algorithm for stream compression\n");
+        return NULL;
+    }
+
+    CodecStream *stream = calloc(1, sizeof(CodecStream));
+    if (!stream) {
+        fprintf(stderr, "Memory allocation failed for codec stream\n");
+        return NULL;
+    }
+    stream->algorithm = algorithm;
+
+    if (algorithm == ALG_HUFFMAN && huffman_encoder_init(&stream->huffman, huffman_block_size(level)) != 0) {
+        free(stream);
+        return NULL;
+    }
+    if (algorithm == ALG_HYBRID && hybrid_encoder_init(&stream->hybrid, hybrid_block_size(level)) != 0) {
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+// Largest output of an update with size bytes of input, or of finish
+size_t codec_stream_bound(const CodecStream *stream, size_t size) {
+    if (stream->algorithm == ALG_HUFFMAN) {
+        return huffman_encoder_bound(&stream->huffman, size);
+    }
+    if (stream->algorithm == ALG_HYBRID) {
+        return hybrid_encoder_bound(&stream->hybrid, size);
+    }
+    // The new input, plus a pending literal span and an open run
+    return rle_compress_bound(size) + RLE_MAX_LITERAL + 2 * VARINT_MAX_BYTES;
+}
+
+// Gives the RLE encoder the caller's buffer, writing the stream header on
+// the first call. Returns 0 on success, -1 if the buffer is too small.
+static int set_rle_buffer(CodecStream *stream, void *dst, size_t capacity) {
+    if (!stream->started) {
+        stream->started = 1;
+        return rle_encoder_init_buffer(&stream->rle, dst, capacity);
+    }
+    rle_encoder_set_buffer(&stream->rle, dst, capacity);
+    return 0;
+}
+
+int codec_stream_update(CodecStream *stream, const void *src, size_t size,
+                        void *dst, size_t capacity, size_t *written) {
+    if (stream->algorithm == ALG_HUFFMAN) {
+        return huffman_encoder_update(&stream->huffman, src, size, dst, capacity, written);
+    }
+    if (stream->algorithm == ALG_HYBRID) {
+        return hybrid_encoder_update(&stream->hybrid, src, size, dst, capacity, written);
+    }
+
+    if (set_rle_buffer(stream, dst, capacity) != 0 ||
+        rle_encoder_update(&stream->rle, src, size) != 0) {
+        fprintf(stderr, "RLE output buffer too small.\n");
+        return -1;
+    }
+    *written = stream->rle.pos;
+    return 0;
+}
+
+int codec_stream_finish(CodecStream *stream, void *dst, size_t capacity, size_t *written) {
+    if (stream->algorithm == ALG_HUFFMAN) {
+        return huffman_encoder_finish(&stream->huffman, dst, capacity, written);
+    }
+    if (stream->algorithm == ALG_HYBRID) {
+        return hybrid_encoder_finish(&stream->hybrid, dst, capacity, written);
+    }
+
+    if (set_rle_buffer(stream, dst, capacity) != 0 ||
+        rle_encoder_finish(&stream->rle) != 0) {
+        fprintf(stderr, "RLE output buffer too small.\n");
+        return -1;
+    }
+    *written = stream->rle.pos;
+    return 0;
+}
+
+void codec_stream_free(CodecStream *stream) {
+    if (stream == NULL) return;
+
+    if (stream->algorithm == ALG_HUFFMAN) {
+        huffman_encoder_free(&stream->huffman);
+    } else if (stream->algorithm == ALG_HYBRID) {
+        hybrid_encoder_free(&stream->hybrid);
+    }
+    free(stream);
+}
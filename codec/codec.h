@@ -0,0 +1,72 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "../reports/compression_report.h"
+
+// Buffer-to-buffer interface to the compression algorithms, for callers
+// that hold their data in memory. The output is byte for byte what the FILE
+// functions write, so data compressed one way decompresses the other.
+
+// Streaming compression context
+typedef struct CodecStream CodecStream;
+
+// Output sizes predicted for each algorithm from samples of an input
+typedef struct {
+    size_t input_size;
+    size_t rle_size;
+    size_t huffman_size;
+    double entropy;      // Order-0 entropy of the samples, in bits per byte
+    double average_run;  // Average run length in the samples
+} CodecEstimate;
+
+// Largest output codec_compress writes for size bytes of input.
+// Returns 0 for an unsupported algorithm.
+size_t codec_bound(CompressionAlgorithm algorithm, CompressionLevel level, size_t size);
+
+// Compresses size bytes of src into dst, which holds capacity bytes
+// (codec_bound is always enough), and stores the compressed size.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int codec_compress(CompressionAlgorithm algorithm, CompressionLevel level,
+                   const void *src, size_t size, void *dst, size_t capacity, size_t *compressed_size);
+
+// Decompresses size bytes of src into dst, which holds capacity bytes, and
+// stores the decompressed size.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int codec_decompress(CompressionAlgorithm algorithm, const void *src, size_t size,
+                     void *dst, size_t capacity, size_t *decompressed_size);
+
+// Predicts the output size of each algorithm for size bytes of data from
+// samples spread evenly over it. Small inputs are read in full.
+void codec_estimate_buffer(const uint8_t *data, size_t size, CodecEstimate *estimate);
+
+// Same as codec_estimate_buffer for the rest of a seekable file, whose
+// position is restored afterwards. Returns 0 on success, -1 on error.
+int codec_estimate_file(FILE *file, CodecEstimate *estimate);
+
+// Returns the algorithm with the smallest predicted output
+CompressionAlgorithm codec_choose(const CodecEstimate *estimate);
+
+// Creates a streaming compression context. Returns NULL on error.
+CodecStream* codec_stream_create(CompressionAlgorithm algorithm, CompressionLevel level);
+
+// Largest output of codec_stream_update with size bytes of input, or of
+// codec_stream_finish when size is 0.
+size_t codec_stream_bound(const CodecStream *stream, size_t size);
+
+// Compresses size more bytes of src, writing whatever output is ready to
+// dst, which holds capacity bytes. Stores the number of bytes written.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int codec_stream_update(CodecStream *stream, const void *src, size_t size,
+                        void *dst, size_t capacity, size_t *written);
+
+// Writes the rest of the compressed stream to dst and stores the number of
+// bytes written. Returns 0 on success, -1 on error or if the output does not fit.
+int codec_stream_finish(CodecStream *stream, void *dst, size_t capacity, size_t *written);
+
+// Releases a streaming context
+void codec_stream_free(CodecStream *stream);
+
+#endif // CODEC_H
@@ -4,38 +4,68 @@
 #include <openssl/rand.h>
 #include <string.h>
 
-// Salt length
-#define SALT_LENGTH 8
-
 // Key length for AES-256
 #define KEY_LENGTH 32
 
-// IV length for AES
-#define IV_LENGTH 16
-
 // PBKDF2 iterations
 #define PBKDF2_ITERATIONS 10000
 
-int encrypt_compressed_file(FILE *compressed_file, FILE *output_file, const char *password) {
-    unsigned char key[KEY_LENGTH];
-    unsigned char iv[IV_LENGTH];
-    unsigned char salt[SALT_LENGTH];
+// Largest chunk passed to a single EVP update call, whose lengths are ints
+#define MAX_UPDATE_SIZE (1 << 30)
 
-    // Generate a random salt
+/**
+ * @brief Generates a random salt and IV for a new encrypted stream.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int generate_salt_iv(unsigned char *salt, unsigned char *iv) {
     if (RAND_bytes(salt, SALT_LENGTH) != 1) {
         fprintf(stderr, "Error generating salt\n");
         return -1;
     }
+    if (RAND_bytes(iv, IV_LENGTH) != 1) {
+        fprintf(stderr, "Error generating IV\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Derives the key from the password and salt and sets up an AES-256
+ * cipher context.
+ *
+ * @param encrypt 1 to encrypt, 0 to decrypt.
+ * @return EVP_CIPHER_CTX* The context, or NULL on error.
+ */
+static EVP_CIPHER_CTX *create_cipher(const char *password, const unsigned char *salt,
+                                     const unsigned char *iv, int encrypt) {
+    unsigned char key[KEY_LENGTH];
 
     // Derive key from password using PBKDF2
     if (PKCS5_PBKDF2_HMAC(password, strlen(password), salt, SALT_LENGTH, PBKDF2_ITERATIONS, EVP_sha256(), KEY_LENGTH, key) != 1) {
         fprintf(stderr, "Error deriving key\n");
-        return -1;
+        return NULL;
     }
 
-    // Generate a random IV
-    if (RAND_bytes(iv, IV_LENGTH) != 1) {
-        fprintf(stderr, "Error generating IV\n");
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        fprintf(stderr, "Error creating cipher context\n");
+        return NULL;
+    }
+
+    if (EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, encrypt) != 1) {
+        fprintf(stderr, encrypt ? "Error initializing encryption\n" : "Error initializing decryption\n");
+        EVP_CIPHER_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+int encrypt_compressed_file(FILE *compressed_file, FILE *output_file, const char *password) {
+    unsigned char iv[IV_LENGTH];
+    unsigned char salt[SALT_LENGTH];
+
+    if (generate_salt_iv(salt, iv) != 0) {
         return -1;
     }
 
@@ -50,15 +80,8 @@ int encrypt_compressed_file(FILE *compressed_file, FILE *output_file, const char
     }
 
     // Initialize encryption context
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    EVP_CIPHER_CTX *ctx = create_cipher(password, salt, iv, 1);
     if (!ctx) {
-        fprintf(stderr, "Error creating cipher context\n");
-        return -1;
-    }
-
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) != 1) {
-        fprintf(stderr, "Error initializing encryption\n");
-        EVP_CIPHER_CTX_free(ctx);
         return -1;
     }
 
@@ -101,7 +124,6 @@ int encrypt_compressed_file(FILE *compressed_file, FILE *output_file, const char
 }
 
 int decrypt_compressed_file(FILE *encrypted_file, FILE *output_file, const char *password) {
-    unsigned char key[KEY_LENGTH];
     unsigned char iv[IV_LENGTH];
     unsigned char salt[SALT_LENGTH];
 
@@ -115,22 +137,9 @@ int decrypt_compressed_file(FILE *encrypted_file, FILE *output_file, const char
         return -1;
     }
 
-    // Derive key from password using PBKDF2
-    if (PKCS5_PBKDF2_HMAC(password, strlen(password), salt, SALT_LENGTH, PBKDF2_ITERATIONS, EVP_sha256(), KEY_LENGTH, key) != 1) {
-        fprintf(stderr, "Error deriving key\n");
-        return -1;
-    }
-
     // Initialize decryption context
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    EVP_CIPHER_CTX *ctx = create_cipher(password, salt, iv, 0);
     if (!ctx) {
-        fprintf(stderr, "Error creating cipher context\n");
-        return -1;
-    }
-
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) != 1) {
-        fprintf(stderr, "Error initializing decryption\n");
-        EVP_CIPHER_CTX_free(ctx);
         return -1;
     }
 
@@ -168,4 +177,88 @@ int decrypt_compressed_file(FILE *encrypted_file, FILE *output_file, const char
     // Clean up
     EVP_CIPHER_CTX_free(ctx);
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Runs size bytes of src through the cipher, including the final
+ * block, and stores the number of bytes written to dst.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int cipher_buffer(EVP_CIPHER_CTX *ctx, const uint8_t *src, size_t size, uint8_t *dst, size_t *written) {
+    size_t pos = 0;
+    int out_len;
+
+    while (size > 0) {
+        int chunk = size < MAX_UPDATE_SIZE ? (int)size : MAX_UPDATE_SIZE;
+        if (EVP_CipherUpdate(ctx, dst + pos, &out_len, src, chunk) != 1) {
+            return -1;
+        }
+        pos += out_len;
+        src += chunk;
+        size -= chunk;
+    }
+
+    if (EVP_CipherFinal_ex(ctx, dst + pos, &out_len) != 1) {
+        return -1;
+    }
+    *written = pos + out_len;
+    return 0;
+}
+
+int encrypt_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                   const char *password, size_t *encrypted_size) {
+    if (capacity < size + ENCRYPTION_OVERHEAD) {
+        fprintf(stderr, "Encryption output buffer too small\n");
+        return -1;
+    }
+
+    // Salt and IV lead the output, as in the file format
+    unsigned char *salt = dst;
+    unsigned char *iv = dst + SALT_LENGTH;
+    if (generate_salt_iv(salt, iv) != 0) {
+        return -1;
+    }
+
+    EVP_CIPHER_CTX *ctx = create_cipher(password, salt, iv, 1);
+    if (!ctx) {
+        return -1;
+    }
+
+    size_t written;
+    int result = cipher_buffer(ctx, src, size, dst + SALT_LENGTH + IV_LENGTH, &written);
+    if (result != 0) {
+        fprintf(stderr, "Error encrypting data\n");
+    } else {
+        *encrypted_size = SALT_LENGTH + IV_LENGTH + written;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return result;
+}
+
+int decrypt_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                   const char *password, size_t *decrypted_size) {
+    if (size < SALT_LENGTH + IV_LENGTH) {
+        fprintf(stderr, "Error reading salt and IV\n");
+        return -1;
+    }
+    size_t cipher_size = size - SALT_LENGTH - IV_LENGTH;
+    if (capacity < cipher_size) {
+        fprintf(stderr, "Decryption output buffer too small\n");
+        return -1;
+    }
+
+    EVP_CIPHER_CTX *ctx = create_cipher(password, src, src + SALT_LENGTH, 0);
+    if (!ctx) {
+        return -1;
+    }
+
+    int result = cipher_buffer(ctx, src + SALT_LENGTH + IV_LENGTH, cipher_size, dst, decrypted_size);
+    if (result != 0) {
+        fprintf(stderr, "Error decrypting data\n");
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return result;
+}
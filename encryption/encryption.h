@@ -2,6 +2,21 @@
 #define ENCRYPTION_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Salt length
+#define SALT_LENGTH 8
+
+// IV length for AES
+#define IV_LENGTH 16
+
+// AES block size; CBC padding adds up to one block
+#define CIPHER_BLOCK_LENGTH 16
+
+// Bytes encryption adds to its input at most: the salt, the IV and one
+// block of padding
+#define ENCRYPTION_OVERHEAD (SALT_LENGTH + IV_LENGTH + CIPHER_BLOCK_LENGTH)
 
 /**
  * @brief Encrypts the compressed file with a password.
@@ -23,4 +38,33 @@ int encrypt_compressed_file(FILE *compressed_file, FILE *output_file, const char
  */
 int decrypt_compressed_file(FILE *encrypted_file, FILE *output_file, const char *password);
 
+/**
+ * @brief Encrypts a buffer with a password, in the same format as
+ * encrypt_compressed_file.
+ *
+ * @param src Data to encrypt.
+ * @param size Size of the data.
+ * @param dst Output buffer, at least size + ENCRYPTION_OVERHEAD bytes.
+ * @param capacity Size of the output buffer.
+ * @param password Encryption password.
+ * @param encrypted_size Receives the size of the encrypted data.
+ * @return int 0 on success, -1 on error.
+ */
+int encrypt_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                   const char *password, size_t *encrypted_size);
+
+/**
+ * @brief Decrypts a buffer written by encrypt_buffer or encrypt_compressed_file.
+ *
+ * @param src Encrypted data.
+ * @param size Size of the encrypted data.
+ * @param dst Output buffer, at least as large as the encrypted data.
+ * @param capacity Size of the output buffer.
+ * @param password Decryption password.
+ * @param decrypted_size Receives the size of the decrypted data.
+ * @return int 0 on success, -1 on error.
+ */
+int decrypt_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                   const char *password, size_t *decrypted_size);
+
 #endif // ENCRYPTION_H
\ No newline at end of file
@@ -0,0 +1,513 @@
+#define _GNU_SOURCE // ftello, fseeko, posix_fallocate
+
+#include "frame.h"
+#include "../rle/rle.h"
+#include "../hybrid/hybrid.h"
+#include "../utils/output_sink.h"
+#include "../utils/varint.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Stores a little-endian value of size bytes
+static void put_le(uint8_t *dst, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) {
+        dst[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+// Loads a little-endian value of size bytes
+static uint64_t get_le(const uint8_t *src, int size) {
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++) {
+        value |= (uint64_t)src[i] << (8 * i);
+    }
+    return value;
+}
+
+// Writes a frame header. Returns 0 on success, -1 on error.
+static int write_frame_header(FILE *output_file, const FrameHeader *header) {
+    uint8_t bytes[FRAME_HEADER_SIZE];
+    memcpy(bytes, FRAME_MAGIC, FRAME_MAGIC_SIZE);
+    bytes[FRAME_MAGIC_SIZE] = FRAME_VERSION;
+    bytes[FRAME_MAGIC_SIZE + 1] = (uint8_t)header->codec;
+    bytes[FRAME_MAGIC_SIZE + 2] = (uint8_t)header->flags;
+    bytes[FRAME_MAGIC_SIZE + 3] = 0;
+    put_le(bytes + FRAME_MAGIC_SIZE + 4, header->original_size, 8);
+
+    return fwrite(bytes, 1, sizeof(bytes), output_file) == sizeof(bytes) ? 0 : -1;
+}
+
+// Writes the block table and its footer. Returns 0 on success, -1 on error.
+static int write_frame_table(FILE *output_file, const BlockTable *table) {
+    uint8_t *bytes = malloc((2 + 2 * table->count) * VARINT_MAX_BYTES + FRAME_TABLE_FOOTER_SIZE);
+    if (!bytes) {
+        fprintf(stderr, "Memory allocation failed for block table\n");
+        return -1;
+    }
+
+    size_t size = encode_varint(table->count, bytes);
+    size += encode_varint(table->start, bytes + size);
+    for (size_t i = 0; i < 2 * table->count; i++) {
+        size += encode_varint(table->sizes[i], bytes + size);
+    }
+    put_le(bytes + size, size, 4);
+    memcpy(bytes + size + 4, FRAME_TABLE_MAGIC, 4);
+    size += FRAME_TABLE_FOOTER_SIZE;
+
+    int result = fwrite(bytes, 1, size, output_file) == size ? 0 : -1;
+    free(bytes);
+    return result;
+}
+
+// Maps an algorithm to its codec id, or -1 if it has none
+int frame_codec_id(CompressionAlgorithm algorithm) {
+    switch (algorithm) {
+        case ALG_RLE:
+            return FRAME_CODEC_RLE;
+        case ALG_HUFFMAN:
+            return FRAME_CODEC_HUFFMAN;
+        case ALG_HYBRID:
+            return FRAME_CODEC_HYBRID;
+        default:
+            return -1;
+    }
+}
+
+// Compresses the rest of the input into a frame.
+// Returns 0 on success, -1 on error.
+int frame_compress(FILE *input_file, FILE *output_file, CompressionAlgorithm algorithm,
+                   CompressionLevel level, int thread_count,
+                   ProgressCallback progress_fn, void *user_data, size_t *block_counts) {
+    FrameHeader header = {frame_codec_id(algorithm), FRAME_FLAG_BLOCK_TABLE, 0};
+    if (header.codec < 0) {
+        fprintf(stderr, "Invalid algorithm for a frame\n");
+        return -1;
+    }
+
+    // A regular input file tells its size up front; otherwise the size is
+    // patched in afterwards if the output allows it
+    struct stat input_stat;
+    off_t input_start = ftello(input_file);
+    if (input_start >= 0 && fstat(fileno(input_file), &input_stat) == 0 &&
+        S_ISREG(input_stat.st_mode) && input_stat.st_size >= input_start) {
+        header.flags |= FRAME_FLAG_SIZE;
+        header.original_size = (uint64_t)(input_stat.st_size - input_start);
+    }
+
+    off_t frame_start = ftello(output_file);
+    if (write_frame_header(output_file, &header) != 0) {
+        perror("Error writing frame header");
+        return -1;
+    }
+
+    BlockTable table = {0};
+    int result;
+    switch (algorithm) {
+        case ALG_RLE:
+            result = rle_compress_with_table(input_file, output_file, FRAME_RLE_BLOCK_SIZE, &table,
+                                             progress_fn, user_data);
+            break;
+        case ALG_HUFFMAN:
+            result = huffman_compress_blocks(input_file, output_file, huffman_block_size(level),
+                                             thread_count, progress_fn, user_data, &table);
+            break;
+        default:
+            result = hybrid_compress(input_file, output_file, hybrid_block_size(level), thread_count,
+                                     progress_fn, user_data, block_counts, &table);
+            break;
+    }
+
+    if (result == 0 && write_frame_table(output_file, &table) != 0) {
+        perror("Error writing block table");
+        result = -1;
+    }
+
+    // Fill in the size when it was not known up front, or the input changed
+    uint64_t original_size = block_table_raw_size(&table);
+    if (result == 0 && (!(header.flags & FRAME_FLAG_SIZE) || header.original_size != original_size)) {
+        int known = header.flags & FRAME_FLAG_SIZE;
+        header.flags |= FRAME_FLAG_SIZE;
+        header.original_size = original_size;
+
+        off_t frame_end;
+        if (frame_start < 0 || (frame_end = ftello(output_file)) < 0 ||
+            fseeko(output_file, frame_start, SEEK_SET) != 0) {
+            // Unseekable output: a missing size stays missing, a wrong one is an error
+            if (known) {
+                fprintf(stderr, "Input size changed during compression\n");
+                result = -1;
+            }
+        } else if (write_frame_header(output_file, &header) != 0 ||
+                   fseeko(output_file, frame_end, SEEK_SET) != 0) {
+            perror("Error writing frame header");
+            result = -1;
+        }
+    }
+
+    block_table_free(&table);
+    return result;
+}
+
+// Checks whether the input starts with a frame and consumes its header.
+// Returns 1 for a frame, 0 otherwise, -1 on error.
+int frame_read_header(FILE *input_file, FrameHeader *header) {
+    // Anything that does not start like a frame is handed back with ungetc,
+    // which also works on pipes
+    int first = fgetc(input_file);
+    if (first == EOF) {
+        return 0;
+    }
+    if (first != FRAME_MAGIC[0]) {
+        ungetc(first, input_file);
+        return 0;
+    }
+
+    uint8_t bytes[FRAME_HEADER_SIZE];
+    bytes[0] = (uint8_t)first;
+    size_t size = 1 + fread(bytes + 1, 1, FRAME_HEADER_SIZE - 1, input_file);
+    if (size < FRAME_HEADER_SIZE || memcmp(bytes, FRAME_MAGIC, FRAME_MAGIC_SIZE) != 0) {
+        if (fseeko(input_file, -(off_t)size, SEEK_CUR) != 0) {
+            fprintf(stderr, "Unrecognized input format\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (bytes[FRAME_MAGIC_SIZE] != FRAME_VERSION) {
+        fprintf(stderr, "Unsupported frame version %d\n", bytes[FRAME_MAGIC_SIZE]);
+        return -1;
+    }
+    header->codec = bytes[FRAME_MAGIC_SIZE + 1];
+    header->flags = bytes[FRAME_MAGIC_SIZE + 2];
+    header->original_size = get_le(bytes + FRAME_MAGIC_SIZE + 4, 8);
+    if (header->codec != FRAME_CODEC_RLE && header->codec != FRAME_CODEC_HUFFMAN &&
+        header->codec != FRAME_CODEC_HYBRID) {
+        fprintf(stderr, "Unknown codec id %d in frame header\n", header->codec);
+        return -1;
+    }
+    return 1;
+}
+
+// Parses a block table of size bytes. Returns 0 on success, -1 on error.
+static int parse_frame_table(const uint8_t *bytes, size_t size, BlockTable *table) {
+    uint64_t count, start;
+    size_t pos = decode_varint(bytes, size, &count);
+    size_t length = pos ? decode_varint(bytes + pos, size - pos, &start) : 0;
+    if (length == 0 || count > size / 2) {
+        return -1;
+    }
+    pos += length;
+
+    table->start = start;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t stored_size, raw_size;
+        if ((length = decode_varint(bytes + pos, size - pos, &stored_size)) == 0 ||
+            (pos += length, length = decode_varint(bytes + pos, size - pos, &raw_size)) == 0 ||
+            block_table_add(table, stored_size, raw_size) != 0) {
+            block_table_free(table);
+            return -1;
+        }
+        pos += length;
+    }
+    if (pos != size) {
+        block_table_free(table);
+        return -1;
+    }
+    return 0;
+}
+
+// Loads the block table from the end of a seekable input. The input
+// position is restored. Returns 0 on success, -1 if no valid table is found.
+int frame_read_table(FILE *input_file, off_t frame_start, BlockTable *table, off_t *stream_end) {
+    struct stat input_stat;
+    off_t position = ftello(input_file);
+    if (position < 0 || fstat(fileno(input_file), &input_stat) != 0 || !S_ISREG(input_stat.st_mode) ||
+        input_stat.st_size < frame_start + FRAME_HEADER_SIZE + FRAME_TABLE_FOOTER_SIZE) {
+        return -1;
+    }
+
+    uint8_t footer[FRAME_TABLE_FOOTER_SIZE];
+    uint8_t *bytes = NULL;
+    off_t table_start = 0;
+    int result = -1;
+    if (fseeko(input_file, input_stat.st_size - FRAME_TABLE_FOOTER_SIZE, SEEK_SET) == 0 &&
+        fread(footer, 1, sizeof(footer), input_file) == sizeof(footer) &&
+        memcmp(footer + 4, FRAME_TABLE_MAGIC, 4) == 0) {
+        uint64_t table_size = get_le(footer, 4);
+        table_start = input_stat.st_size - FRAME_TABLE_FOOTER_SIZE - (off_t)table_size;
+        if (table_start >= frame_start + FRAME_HEADER_SIZE && (bytes = malloc(table_size)) != NULL &&
+            fseeko(input_file, table_start, SEEK_SET) == 0 &&
+            fread(bytes, 1, table_size, input_file) == table_size) {
+            result = parse_frame_table(bytes, table_size, table);
+        }
+    }
+    free(bytes);
+
+    // The blocks must fit in the codec stream
+    if (result == 0) {
+        uint64_t stored_total = table->start;
+        for (size_t i = 0; i < table->count; i++) {
+            stored_total += table->sizes[2 * i];
+        }
+        if (stored_total > (uint64_t)(table_start - frame_start - FRAME_HEADER_SIZE)) {
+            block_table_free(table);
+            result = -1;
+        }
+    }
+
+    if (fseeko(input_file, position, SEEK_SET) != 0) {
+        block_table_free(table);
+        return -1;
+    }
+    if (result == 0) {
+        *stream_end = table_start;
+    }
+    return result;
+}
+
+// Decompresses the codec stream of a frame whose header has been read.
+// Returns 0 on success, -1 on error.
+static int decompress_frame_body(FILE *input_file, FILE *output_file, const FrameHeader *header,
+                                 int thread_count) {
+    uint64_t original_size = header->original_size;
+    int size_known = header->flags & FRAME_FLAG_SIZE;
+
+    // Frames read from a file have their table at the end, which gives the
+    // end of the codec stream and, for frames written to a pipe, the size
+    off_t stream_end = -1;
+    BlockTable table = {0};
+    off_t frame_start = ftello(input_file) - FRAME_HEADER_SIZE;
+    int size_checked = 0;
+    if ((header->flags & FRAME_FLAG_BLOCK_TABLE) && frame_start >= 0 &&
+        frame_read_table(input_file, frame_start, &table, &stream_end) == 0) {
+        uint64_t table_size = block_table_raw_size(&table);
+        block_table_free(&table);
+        if (size_known && original_size != table_size) {
+            fprintf(stderr, "Frame header size does not match the block table\n");
+            return -1;
+        }
+        original_size = table_size;
+        size_known = 1;
+        size_checked = 1;
+    }
+
+    // Reserve the whole output up front so the file does not grow block by
+    // block, but only for a size the block table agrees with
+    struct stat output_stat;
+    off_t output_start = -1;
+    if (fflush(output_file) == 0 && fstat(fileno(output_file), &output_stat) == 0 &&
+        S_ISREG(output_stat.st_mode)) {
+        output_start = ftello(output_file);
+    }
+    if (size_checked && original_size > 0 && output_start >= 0) {
+        // Best effort: file systems without support simply grow the file
+        posix_fallocate(fileno(output_file), output_start, (off_t)original_size);
+    }
+
+    // With a known size the decoders write through a sink that stops them
+    // at that size
+    OutputSink sink = {0};
+    FILE *stream = output_file;
+    int result = 0;
+    if (size_known && !(stream = output_sink_open(output_file, original_size, 0, &sink))) {
+        result = -1;
+    }
+
+    if (result == 0) {
+        switch (header->codec) {
+            case FRAME_CODEC_RLE:
+                result = rle_decompress(input_file, stream);
+                break;
+            case FRAME_CODEC_HUFFMAN:
+                if (!size_known) {
+                    result = huffman_decompress_parallel_until(input_file, output_file, thread_count, stream_end);
+                    break;
+                }
+                // Indexed blocks are written in place, checked against the size up front
+                result = huffman_decompress_indexed(input_file, output_file, thread_count, stream_end,
+                                                    original_size);
+                if (result == 1) {
+                    result = huffman_decompress(input_file, stream);
+                } else {
+                    off_t output_end;
+                    sink.written = result == 0 && output_start >= 0 && (output_end = ftello(output_file)) >= 0
+                                       ? (uint64_t)(output_end - output_start)
+                                       : 0;
+                }
+                break;
+            default:
+                result = hybrid_decompress(input_file, stream);
+                break;
+        }
+    }
+    if (stream && stream != output_file && fclose(stream) != 0 && result == 0) {
+        perror("Error writing decompressed data");
+        result = -1;
+    }
+
+    if (sink.exceeded) {
+        fprintf(stderr, "Decompressed data exceeds the size recorded in the frame\n");
+        result = -1;
+    } else if (result == 0 && size_known && sink.written != original_size) {
+        fprintf(stderr, "Decompressed size does not match the frame header\n");
+        result = -1;
+    }
+
+    // Take back the partial or preallocated output of a failed frame
+    if (result != 0 && output_start >= 0) {
+        fflush(output_file);
+        if (ftruncate(fileno(output_file), output_start) != 0 || fseeko(output_file, output_start, SEEK_SET) != 0) {
+            perror("Error truncating output file");
+        }
+    }
+    return result;
+}
+
+// Decodes the blocks of a Huffman or hybrid frame from first on, writing
+// length bytes starting skip bytes into the first one. position is the
+// input offset of the first block. Returns 0 on success, -1 on error.
+static int decode_block_range(FILE *input_file, FILE *output_file, int codec, const BlockTable *table,
+                              size_t first, off_t position, uint64_t skip, uint64_t length) {
+    uint8_t *stored = NULL;
+    uint8_t *raw = NULL;
+    size_t stored_capacity = 0;
+    size_t raw_capacity = 0;
+    int result = 0;
+
+    if (fseeko(input_file, position, SEEK_SET) != 0) {
+        perror("Error seeking in input file");
+        return -1;
+    }
+    for (size_t i = first; result == 0 && length > 0 && i < table->count; i++) {
+        uint64_t stored_size = table->sizes[2 * i];
+        uint64_t raw_size = table->sizes[2 * i + 1];
+
+        // Blocks never exceed the largest block size a decoder accepts
+        if (raw_size > HUFFMAN_MAX_BLOCK_SIZE || stored_size > raw_size + 2 * VARINT_MAX_BYTES + 1) {
+            fprintf(stderr, "Invalid block table entry\n");
+            result = -1;
+            break;
+        }
+        if (stored_size > stored_capacity || raw_size > raw_capacity) {
+            free(stored);
+            free(raw);
+            stored_capacity = stored_size > stored_capacity ? stored_size : stored_capacity;
+            raw_capacity = raw_size > raw_capacity ? raw_size : raw_capacity;
+            stored = malloc(stored_capacity);
+            raw = malloc(raw_capacity);
+            if (!stored || !raw) {
+                fprintf(stderr, "Memory allocation failed for range decompression\n");
+                result = -1;
+                break;
+            }
+        }
+
+        if (fread(stored, 1, stored_size, input_file) != stored_size) {
+            fprintf(stderr, "Unexpected end of file during decompression\n");
+            result = -1;
+            break;
+        }
+        result = codec == FRAME_CODEC_HUFFMAN
+                     ? huffman_decode_indexed_block(stored, stored_size, raw, raw_size)
+                     : hybrid_decode_indexed_block(stored, stored_size, raw, raw_size);
+        if (result != 0) {
+            break;
+        }
+
+        uint64_t take = raw_size - skip < length ? raw_size - skip : length;
+        if (fwrite(raw + skip, 1, take, output_file) != take) {
+            fprintf(stderr, "Error writing decompressed data\n");
+            result = -1;
+        }
+        length -= take;
+        skip = 0;
+    }
+
+    free(stored);
+    free(raw);
+    return result;
+}
+
+// Decompresses a range of the original data from a frame.
+// Returns 0 on success, -1 on error.
+int frame_decompress_range(FILE *input_file, FILE *output_file, uint64_t offset, uint64_t length) {
+    off_t frame_start = ftello(input_file);
+    FrameHeader header;
+    int framed = frame_read_header(input_file, &header);
+    if (framed <= 0) {
+        if (framed == 0) {
+            fprintf(stderr, "Range decompression needs a framed input\n");
+        }
+        return -1;
+    }
+
+    BlockTable table = {0};
+    off_t stream_end;
+    if (frame_start < 0 || !(header.flags & FRAME_FLAG_BLOCK_TABLE) ||
+        frame_read_table(input_file, frame_start, &table, &stream_end) != 0) {
+        fprintf(stderr, "Range decompression needs a seekable input with a block table\n");
+        return -1;
+    }
+
+    // Find the block holding the first byte of the range
+    uint64_t total_size = block_table_raw_size(&table);
+    uint64_t block_start = 0;
+    off_t position = frame_start + FRAME_HEADER_SIZE + (off_t)table.start;
+    size_t first = 0;
+    if (offset < total_size) {
+        while (block_start + table.sizes[2 * first + 1] <= offset) {
+            block_start += table.sizes[2 * first + 1];
+            position += (off_t)table.sizes[2 * first];
+            first++;
+        }
+    }
+    if (offset >= total_size || length > total_size - offset) {
+        length = offset < total_size ? total_size - offset : 0;
+    }
+
+    int result = 0;
+    if (length > 0) {
+        if (header.codec == FRAME_CODEC_RLE) {
+            // RLE blocks start at token boundaries and the tokens run on, so
+            // decoding continues into later blocks by itself
+            result = fseeko(input_file, position, SEEK_SET) == 0
+                         ? rle_decompress_range(input_file, output_file, offset - block_start, length)
+                         : -1;
+        } else {
+            result = decode_block_range(input_file, output_file, header.codec, &table, first, position,
+                                        offset - block_start, length);
+        }
+    }
+
+    block_table_free(&table);
+    return result;
+}
+
+// Decompresses a frame, or a bare stream of fallback_algorithm.
+// Returns 0 on success, -1 on error.
+int frame_decompress(FILE *input_file, FILE *output_file, CompressionAlgorithm fallback_algorithm,
+                     int thread_count) {
+    FrameHeader header;
+    int framed = frame_read_header(input_file, &header);
+    if (framed < 0) {
+        return -1;
+    }
+    if (framed) {
+        return decompress_frame_body(input_file, output_file, &header, thread_count);
+    }
+
+    switch (fallback_algorithm) {
+        case ALG_RLE:
+            return rle_decompress(input_file, output_file);
+        case ALG_HUFFMAN:
+            return huffman_decompress_parallel(input_file, output_file, thread_count);
+        case ALG_HYBRID:
+            return hybrid_decompress(input_file, output_file);
+        default:
+            fprintf(stderr, "Invalid algorithm specified for decompression\n");
+            return -1;
+    }
+}
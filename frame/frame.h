@@ -0,0 +1,88 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "../huffman/huffman.h"
+#include "../reports/compression_report.h"
+#include "../utils/block_table.h"
+
+// Frame layout, written around every compressed single file:
+//   "CMPF" | version | codec id | flags | reserved (0) |
+//   uint64 little-endian original size |
+//   codec stream (RLE v2 stream, Huffman or hybrid block container) |
+//   block table
+// Block table:
+//   varint block count | varint offset of the first block in the codec
+//   stream | per block: varint stored size | varint raw size |
+//   uint32 little-endian table size | "CMPT"
+// where the table size covers everything from the block count up to the
+// footer. The header names the decoder, so decompression needs no -a, and
+// the original size lets the decoder size the output before it starts.
+#define FRAME_MAGIC "CMPF"
+#define FRAME_MAGIC_SIZE 4
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE (FRAME_MAGIC_SIZE + 4 + 8)
+#define FRAME_TABLE_MAGIC "CMPT"
+#define FRAME_TABLE_FOOTER_SIZE 8
+
+// Codec ids
+#define FRAME_CODEC_RLE 0
+#define FRAME_CODEC_HUFFMAN 1
+#define FRAME_CODEC_HYBRID 2
+
+// Frame flags
+#define FRAME_FLAG_SIZE 0x01         // The original size field is valid
+#define FRAME_FLAG_BLOCK_TABLE 0x02  // The codec stream is followed by a block table
+
+// Input bytes per block of the table for RLE streams, which have no blocks
+// of their own
+#define FRAME_RLE_BLOCK_SIZE (1024 * 1024)
+
+// Decoded frame header
+typedef struct {
+    int codec;
+    int flags;
+    uint64_t original_size;
+} FrameHeader;
+
+// Maps an algorithm to its codec id, or -1 if it has none
+int frame_codec_id(CompressionAlgorithm algorithm);
+
+// Compresses the rest of the input into a frame with the given algorithm.
+// The original size is taken from a seekable input up front, or patched
+// into the header afterwards when the output is seekable. If block_counts is
+// not NULL and the algorithm is ALG_HYBRID it receives the number of hybrid
+// blocks of each type. Returns 0 on success, -1 on error.
+int frame_compress(FILE *input_file, FILE *output_file, CompressionAlgorithm algorithm,
+                   CompressionLevel level, int thread_count,
+                   ProgressCallback progress_fn, void *user_data, size_t *block_counts);
+
+// Checks whether the input starts with a frame. On a match the frame header
+// is consumed and stored in header, and 1 is returned. Otherwise the input
+// is left where it was and 0 is returned. Returns -1 on error, including a
+// non-frame input that cannot be rewound.
+int frame_read_header(FILE *input_file, FrameHeader *header);
+
+// Loads the block table of a frame that ends at the end of a seekable
+// input. frame_start is the offset of the frame header. Stores the offset
+// where the codec stream ends in stream_end.
+// Returns 0 on success, -1 if no valid table is found.
+int frame_read_table(FILE *input_file, off_t frame_start, BlockTable *table, off_t *stream_end);
+
+// Decompresses a frame, picking the decoder from its header. A regular
+// output file is preallocated to the original size before decoding. Input
+// that is not a frame is decoded as a bare stream of fallback_algorithm.
+// Returns 0 on success, -1 on error.
+int frame_decompress(FILE *input_file, FILE *output_file, CompressionAlgorithm fallback_algorithm,
+                     int thread_count);
+
+// Decompresses length bytes starting at offset of the original data from a
+// frame at the position of a seekable input. Only the blocks covering the
+// range are read and decoded. A range reaching past the end of the data is
+// cut short there. Returns 0 on success, -1 on error.
+int frame_decompress_range(FILE *input_file, FILE *output_file, uint64_t offset, uint64_t length);
+
+#endif // FRAME_H
@@ -4,24 +4,133 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include "../reports/compression_report.h"
+#include "../utils/block_table.h"
 
 #define MAX_CHARS 256
 #define MAX_TREE_HEIGHT 256
 
-// Huffman tree node structure
-typedef struct HuffmanNode {
+// Number of bits resolved by the primary decoding table. Longer codes are
+// resolved through a second-level subtable.
+#define HUFFMAN_TABLE_BITS 11
+
+// Longest code the table-driven decoder accepts
+#define HUFFMAN_MAX_DECODE_BITS 32
+
+// Longest code the encoder emits. Lengths up to 15 fit in a nibble.
+#define HUFFMAN_MAX_CODE_LENGTH 15
+
+// Canonical Huffman stream layout:
+//   "HUF2" | varint original size | first symbol | last symbol |
+//   nibble-packed code lengths for first..last | code bits
+// Streams without the magic use the legacy size + frequency table header.
+#define HUFFMAN_MAGIC "HUF2"
+#define HUFFMAN_MAGIC_SIZE 4
+
+// Block container layout, written by all compress functions:
+//   "HUFB" | version | flags | varint block size |
+//   per block: varint raw size | block type | varint payload size | payload
+//   varint 0 (end of blocks)
+// With HUFFMAN_FLAG_BLOCK_INDEX the end marker is followed by a trailer:
+//   varint block count | per block: varint stored size | varint raw size
+//   uint32 little-endian index size | "HUFI"
+// where the stored size covers the block header and payload, and the index
+// size covers everything from the block count up to the footer.
+// Every block is coded independently with its own code length table, so
+// blocks can be encoded in parallel, and with the index decoded in parallel.
+#define HUFFMAN_BLOCK_MAGIC "HUFB"
+#define HUFFMAN_BLOCK_VERSION 1
+#define HUFFMAN_INDEX_MAGIC "HUFI"
+#define HUFFMAN_INDEX_FOOTER_SIZE 8
+
+// Container flags
+#define HUFFMAN_FLAG_BLOCK_INDEX 0x01
+
+// Block types
+#define HUFFMAN_BLOCK_STORED 0   // Payload is the raw data
+#define HUFFMAN_BLOCK_CODED 1    // Payload is a code length table and code bits
+#define HUFFMAN_BLOCK_CODED_4X 2 // Code length table, jump table and 4 sub-streams
+
+// A CODED_4X block splits its data into HUFFMAN_STREAM_COUNT segments of
+// (raw size + 3) / 4 bytes (the last one gets the remainder), each coded as
+// its own byte-aligned bit stream with the block's shared code table. The
+// jump table holds the byte sizes of the first three streams as uint32
+// little-endian values, so the decoder can run all four streams at once.
+#define HUFFMAN_STREAM_COUNT 4
+#define HUFFMAN_JUMP_TABLE_SIZE (4 * (HUFFMAN_STREAM_COUNT - 1))
+
+// Blocks at least this large are coded as four streams
+#define HUFFMAN_MULTI_STREAM_MIN_SIZE (16 * 1024)
+
+// Block sizes selected by the compression level
+#define HUFFMAN_BLOCK_SIZE_FAST (1024 * 1024)
+#define HUFFMAN_BLOCK_SIZE_BALANCED (2 * 1024 * 1024)
+#define HUFFMAN_BLOCK_SIZE_MAX (4 * 1024 * 1024)
+
+// Largest block size a decoder accepts
+#define HUFFMAN_MAX_BLOCK_SIZE (64 * 1024 * 1024)
+
+// A full binary tree over 256 leaves has at most 511 nodes
+#define HUFFMAN_MAX_NODES (2 * MAX_CHARS - 1)
+
+// Huffman tree node. Nodes live in a builder's arena and link to their
+// children by index; leaves have no children (left == right == -1).
+typedef struct {
+    uint64_t frequency;
+    int16_t left;
+    int16_t right;
     uint8_t character;
-    unsigned frequency;
-    struct HuffmanNode *left;
-    struct HuffmanNode *right;
 } HuffmanNode;
 
+typedef struct PackageItem PackageItem;
+
+// Reusable tree builder. The tree is built in a fixed node arena, so no
+// allocation happens per build and one builder can serve any number of
+// compress calls (one builder per thread).
+typedef struct {
+    HuffmanNode nodes[HUFFMAN_MAX_NODES];
+    int node_count;
+    int root;                    // Index of the root node, -1 when empty
+    PackageItem *package_items;  // Scratch space for length limiting
+} HuffmanBuilder;
+
 // Huffman coding table entry
 typedef struct {
     uint32_t code;       // Bit representation of the code
     uint8_t code_length; // Length of the code in bits
 } HuffmanCode;
 
+// Decoding table entry. A primary entry either resolves a symbol directly
+// (length > 0) or links to a subtable (length == 0, sub_bits > 0) that is
+// indexed by the next sub_bits bits of the stream. An entry with both fields
+// zero marks a bit pattern that no code maps to.
+typedef struct {
+    uint16_t value;   // Decoded symbol, or subtable offset for links
+    uint8_t length;   // Total code length in bits
+    uint8_t sub_bits; // Index width of the linked subtable
+} HuffmanDecodeEntry;
+
+// Two-level decoding table: the first (1 << HUFFMAN_TABLE_BITS) entries are
+// the primary table, subtables follow.
+typedef struct {
+    HuffmanDecodeEntry *entries;
+    size_t entry_count;
+    uint8_t max_length;
+} HuffmanDecodeTable;
+
+// Streaming block container encoder writing to caller-provided buffers.
+// Input is collected into blocks of block_size bytes; each block is encoded
+// once it fills up, and the last one by huffman_encoder_finish.
+typedef struct {
+    HuffmanBuilder *builder;
+    size_t block_size;
+    uint8_t *block;          // Pending input, allocated on first use
+    size_t block_fill;
+    BlockTable index;        // Blocks written so far, for the index
+    int header_written;
+} HuffmanEncoder;
+
 // Compression metadata structure
 typedef struct {
     size_t original_file_size;
@@ -32,14 +141,38 @@ typedef struct {
 int huffman_compress(FILE *input_file, FILE *output_file);
 int huffman_decompress(FILE *input_file, FILE *output_file);
 
-// Utility functions
-HuffmanNode* create_node(uint8_t character, unsigned frequency);
-void free_huffman_tree(HuffmanNode* node);
-void build_huffman_codes(HuffmanNode* root, HuffmanCode* codes, 
-                          uint32_t current_code, uint8_t code_length);
+// Tree builder
+HuffmanBuilder* huffman_builder_create(void);
+void huffman_builder_free(HuffmanBuilder* builder);
+
+// Builds an optimal tree in O(n log n). Returns 0 on success, -1 if no symbol is used.
+int huffman_builder_build(HuffmanBuilder* builder, const unsigned* frequencies);
 
-// Add this line to declare the build_huffman_tree function
-HuffmanNode* build_huffman_tree(unsigned* frequencies);
+// Builds the tree shape used by legacy streams. Returns 0 on success, -1 if no symbol is used.
+int huffman_builder_build_legacy(HuffmanBuilder* builder, const unsigned* frequencies);
+
+// Assigns codes following the shape of the last built tree
+void huffman_builder_codes(const HuffmanBuilder* builder, HuffmanCode* codes);
+
+// Computes code lengths no longer than max_length for the given frequencies.
+// Returns 0 on success, -1 on error.
+int huffman_code_lengths(HuffmanBuilder* builder, const unsigned* frequencies,
+                         uint8_t* lengths, int max_length);
+
+// Assigns canonical codes from code lengths (at most HUFFMAN_MAX_CODE_LENGTH).
+// Returns 0 on success, -1 if the lengths do not form a valid prefix code.
+int assign_canonical_codes(const uint8_t *lengths, HuffmanCode *codes);
+
+// Writes the nibble-packed code lengths of the used symbol range to dst,
+// which must hold 2 + MAX_CHARS / 2 bytes. Returns the number of bytes written.
+size_t write_code_lengths(const uint8_t *lengths, uint8_t *dst);
+
+// Parses a code length table. Returns the number of bytes consumed, 0 on error.
+size_t parse_code_lengths(const uint8_t *src, size_t size, uint8_t *lengths);
+
+// Builds a decoding table for the given codes. Returns 0 on success, -1 on error.
+int build_decode_table(const HuffmanCode *codes, HuffmanDecodeTable *table);
+void free_decode_table(HuffmanDecodeTable *table);
 
 // Progress callback function
 typedef void (*ProgressCallback)(size_t bytes_processed, size_t total_bytes, void *user_data);
@@ -47,4 +180,95 @@ typedef void (*ProgressCallback)(size_t bytes_processed, size_t total_bytes, voi
 // Function to build Huffman tree with progress callback
 int huffman_compress_with_progress(FILE *input_file, FILE *output_file, ProgressCallback progress_fn, void *user_data);
 
+// Same as huffman_compress_with_progress with blocks of block_size bytes,
+// reusing a caller-owned tree builder
+int huffman_compress_with_builder(FILE *input_file, FILE *output_file, HuffmanBuilder *builder, size_t block_size,
+                                  ProgressCallback progress_fn, void *user_data);
+
+// Block size used for a compression level
+size_t huffman_block_size(CompressionLevel level);
+
+// Compresses the input in independent blocks of block_size bytes, encoding
+// up to thread_count blocks concurrently. Blocks are written in input order.
+// If table is not NULL it receives the stored and raw size of every block.
+// Returns 0 on success, -1 on error.
+int huffman_compress_blocks(FILE *input_file, FILE *output_file, size_t block_size, int thread_count,
+                            ProgressCallback progress_fn, void *user_data, BlockTable *table);
+
+// Encodes one block as a code length table followed by the code bits, in
+// one stream or (with HUFFMAN_STREAM_COUNT) in interleavable sub-streams.
+// Returns 0 on success, -1 if the result does not fit in capacity bytes.
+int huffman_encode_block(HuffmanBuilder *builder, const uint8_t *src, size_t size,
+                         uint8_t *dst, size_t capacity, int stream_count, size_t *encoded_size);
+
+// Decompresses using up to thread_count threads. Block containers with an
+// index are decoded in parallel when the input holds the stream up to its
+// end and both files are seekable regular files; everything else falls back
+// to huffman_decompress.
+// Returns 0 on success, -1 on error.
+int huffman_decompress_parallel(FILE *input_file, FILE *output_file, int thread_count);
+
+// Same as huffman_decompress_parallel for a stream that ends at stream_end
+// rather than at the end of the input file, such as one followed by a
+// trailer. A negative stream_end means the end of the input.
+// Returns 0 on success, -1 on error.
+int huffman_decompress_parallel_until(FILE *input_file, FILE *output_file, int thread_count, off_t stream_end);
+
+// Decodes an indexed block container ending at stream_end in parallel, as
+// huffman_decompress_parallel_until does, but fails without writing when
+// the index adds up to more than max_size bytes.
+// Returns 0 on success, -1 on error, 1 if the stream cannot be decoded in
+// parallel (the input position is then unchanged).
+int huffman_decompress_indexed(FILE *input_file, FILE *output_file, int thread_count, off_t stream_end,
+                               uint64_t max_size);
+
+// Decodes a block written by huffman_encode_block with the same stream
+// count into raw_size bytes of dst.
+// Returns 0 on success, -1 on error.
+int huffman_decode_block(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size, int stream_count);
+
+// Decodes one block of a block container, header included, whose stored
+// and raw size come from the container's index (or a frame's block table)
+// into raw_size bytes of dst.
+// Returns 0 on success, -1 on error.
+int huffman_decode_indexed_block(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size);
+
+// Largest container huffman_compress_buffer writes for size bytes of input
+size_t huffman_compress_bound(size_t size, size_t block_size);
+
+// Compresses size bytes of src into a block container in dst, which holds
+// capacity bytes (huffman_compress_bound is always enough). Blocks are
+// encoded straight from src. Stores the container size in compressed_size.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int huffman_compress_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                            size_t block_size, size_t *compressed_size);
+
+// Decodes a block container of size bytes from src into dst, which holds
+// capacity bytes, and stores the decoded size. Older stream formats are
+// only read by the FILE functions.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int huffman_decompress_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                              size_t *decompressed_size);
+
+// Initializes a streaming encoder. Returns 0 on success, -1 on error.
+int huffman_encoder_init(HuffmanEncoder *encoder, size_t block_size);
+
+// Largest output of huffman_encoder_update with size bytes of input, or of
+// huffman_encoder_finish when size is 0.
+size_t huffman_encoder_bound(const HuffmanEncoder *encoder, size_t size);
+
+// Encodes size more bytes of src, writing every completed block to dst,
+// which holds capacity bytes. Stores the number of bytes written.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int huffman_encoder_update(HuffmanEncoder *encoder, const uint8_t *src, size_t size,
+                           uint8_t *dst, size_t capacity, size_t *written);
+
+// Encodes the last block and writes the end marker and index to dst.
+// Stores the number of bytes written.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int huffman_encoder_finish(HuffmanEncoder *encoder, uint8_t *dst, size_t capacity, size_t *written);
+
+// Releases the encoder's builder and buffers.
+void huffman_encoder_free(HuffmanEncoder *encoder);
+
 #endif // HUFFMAN_H
\ No newline at end of file
@@ -1,228 +1,567 @@
 #include "huffman.h"
 #include "../utils/bit_manipulation.h"
+#include "../utils/block_pipeline.h"
+#include "../utils/histogram.h"
+#include "../utils/varint.h"
 #include <stdlib.h>
 #include <string.h>
 
-// Utility function to create a new Huffman node
-HuffmanNode* create_node(uint8_t character, unsigned frequency) {
-    HuffmanNode* node = malloc(sizeof(HuffmanNode));
-    if (!node) return NULL;
-    
-    node->character = character;
-    node->frequency = frequency;
-    node->left = NULL;
-    node->right = NULL;
-    
-    return node;
-}
-
-// Free Huffman tree
-void free_huffman_tree(HuffmanNode* node) {
-    if (node == NULL) return;
-    
-    free_huffman_tree(node->left);
-    free_huffman_tree(node->right);
-    free(node);
-}
-
-// Compare function for sorting nodes
-int compare_nodes(const void* a, const void* b) {
-    HuffmanNode* node_a = *(HuffmanNode**)a;
-    HuffmanNode* node_b = *(HuffmanNode**)b;
-    return node_a->frequency - node_b->frequency;
-}
-
-// Build Huffman codes recursively
-void build_huffman_codes(HuffmanNode* root, HuffmanCode* codes, 
-                          uint32_t current_code, uint8_t code_length) {
-    if (root == NULL) return;
-    
-    // Leaf node
-    if (!root->left && !root->right) {
-        codes[root->character].code = current_code;
-        codes[root->character].code_length = code_length;
-        return;
-    }
-    
-    // Traverse left
-    if (root->left) {
-        build_huffman_codes(root->left, codes, 
-                             (current_code << 1), 
-                             code_length + 1);
-    }
-    
-    // Traverse right
-    if (root->right) {
-        build_huffman_codes(root->right, codes, 
-                             (current_code << 1) | 1, 
-                             code_length + 1);
-    }
-}
-
-// Build Huffman tree
-HuffmanNode* build_huffman_tree(unsigned* frequencies) {
-    HuffmanNode* nodes[MAX_CHARS];
-    int node_count = 0;
-    
-    // Create nodes for characters with non-zero frequency
-    for (int i = 0; i < MAX_CHARS; i++) {
-        if (frequencies[i] > 0) {
-            nodes[node_count++] = create_node(i, frequencies[i]);
-        }
+// Writes the nibble-packed code lengths of the used symbol range to dst,
+// which must hold 2 + MAX_CHARS / 2 bytes. Returns the number of bytes written.
+size_t write_code_lengths(const uint8_t *lengths, uint8_t *dst) {
+    int first = 0, last = MAX_CHARS - 1;
+    while (first < last && lengths[first] == 0) first++;
+    while (last > first && lengths[last] == 0) last--;
+
+    size_t size = 0;
+    dst[size++] = (uint8_t)first;
+    dst[size++] = (uint8_t)last;
+    for (int i = first; i <= last; i += 2) {
+        uint8_t high = lengths[i];
+        uint8_t low = i + 1 <= last ? lengths[i + 1] : 0;
+        dst[size++] = (uint8_t)((high << 4) | low);
     }
-    
-    // Sort nodes by frequency
-    for (int i = 0; i < node_count - 1; i++) {
-        for (int j = 0; j < node_count - i - 1; j++) {
-            if (nodes[j]->frequency > nodes[j + 1]->frequency) {
-                HuffmanNode* temp = nodes[j];
-                nodes[j] = nodes[j + 1];
-                nodes[j + 1] = temp;
-            }
-        }
+
+    return size;
+}
+
+// Block size used for a compression level
+size_t huffman_block_size(CompressionLevel level) {
+    switch (level) {
+        case COMPRESSION_FAST:
+            return HUFFMAN_BLOCK_SIZE_FAST;
+        case COMPRESSION_MAX:
+            return HUFFMAN_BLOCK_SIZE_MAX;
+        case COMPRESSION_BALANCED:
+        default:
+            return HUFFMAN_BLOCK_SIZE_BALANCED;
     }
-    
-    // Build tree
-    while (node_count > 1) {
-        HuffmanNode* left = nodes[0];
-        HuffmanNode* right = nodes[1];
-        
-        HuffmanNode* parent = create_node(0, left->frequency + right->frequency);
-        parent->left = left;
-        parent->right = right;
-        
-        // Remove first two nodes and insert parent
-        for (int i = 2; i < node_count; i++) {
-            nodes[i - 2] = nodes[i];
-        }
-        nodes[node_count - 2] = parent;
-        node_count--;
-        
-        // Maintain sorted order after inserting parent
-        for (int i = 0; i < node_count - 1; i++) {
-            if (nodes[i]->frequency > nodes[i + 1]->frequency) {
-                HuffmanNode* temp = nodes[i];
-                nodes[i] = nodes[i + 1];
-                nodes[i + 1] = temp;
-            } else {
-                break; // The remaining nodes are already sorted
-            }
+}
+
+// Writes the codes of size bytes of src as one byte-aligned bit stream.
+// Returns the number of bytes written, or 0 if they do not fit in capacity.
+static size_t encode_stream(const HuffmanCode *codes, const uint8_t *src, size_t size,
+                            uint8_t *dst, size_t capacity) {
+    BitWriter writer;
+    bit_writer_init_buffer(&writer, dst, capacity);
+    for (size_t i = 0; i < size; i++) {
+        HuffmanCode code = codes[src[i]];
+        if (put_bits(&writer, code.code, code.code_length) != 0) {
+            return 0;
         }
     }
-    
-    return nodes[0];
+    if (flush_bits(&writer) != 0) {
+        return 0;
+    }
+    return writer.pos;
 }
 
-int huffman_compress(FILE *input_file, FILE *output_file) {
-    // Frequency calculation
+// Encodes one block as a code length table followed by the code bits, in
+// one stream or (with HUFFMAN_STREAM_COUNT) in interleavable sub-streams.
+// Returns 0 on success, -1 if the result does not fit in capacity bytes.
+int huffman_encode_block(HuffmanBuilder *builder, const uint8_t *src, size_t size,
+                         uint8_t *dst, size_t capacity, int stream_count, size_t *encoded_size) {
     unsigned frequencies[MAX_CHARS] = {0};
-    int c;
-    size_t file_size = 0;
-    
-    // First pass: calculate frequencies
-    while ((c = fgetc(input_file)) != EOF) {
-        frequencies[c]++;
-        file_size++;
-    }
-    rewind(input_file);
-    
-    // Build Huffman tree
-    HuffmanNode* root = build_huffman_tree(frequencies);
-    
-    // Build Huffman codes
-    HuffmanCode codes[MAX_CHARS] = {0};
-    build_huffman_codes(root, codes, 0, 0);
-    
-    // Write file size and frequency table
-    fwrite(&file_size, sizeof(size_t), 1, output_file);
-    fwrite(frequencies, sizeof(unsigned), MAX_CHARS, output_file);
-    
-    // Compress file
-    while ((c = fgetc(input_file)) != EOF) {
-        HuffmanCode code = codes[c];
-        
-        // Write code bit by bit
-        for (int i = code.code_length - 1; i >= 0; i--) {
-            uint8_t bit = (code.code >> i) & 1;
-            if (write_bit(output_file, bit) != 0) {
-                free_huffman_tree(root);
+    histogram_count(src, size, frequencies);
+
+    // Canonical, length-limited codes
+    uint8_t lengths[MAX_CHARS];
+    HuffmanCode codes[MAX_CHARS];
+    if (huffman_code_lengths(builder, frequencies, lengths, HUFFMAN_MAX_CODE_LENGTH) != 0 ||
+        assign_canonical_codes(lengths, codes) != 0) {
+        return -1;
+    }
+
+    uint8_t table[2 + MAX_CHARS / 2];
+    size_t table_size = write_code_lengths(lengths, table);
+    if (table_size > capacity) {
+        return -1;
+    }
+    memcpy(dst, table, table_size);
+
+    // A single distinct byte needs no bits
+    int symbol_count = 0;
+    for (int i = 0; i < MAX_CHARS; i++) {
+        if (lengths[i] > 0) {
+            symbol_count++;
+        }
+    }
+    if (symbol_count <= 1) {
+        *encoded_size = table_size;
+        return 0;
+    }
+
+    if (stream_count != HUFFMAN_STREAM_COUNT) {
+        size_t stream_size = encode_stream(codes, src, size, dst + table_size, capacity - table_size);
+        if (stream_size == 0) {
+            return -1;
+        }
+        *encoded_size = table_size + stream_size;
+        return 0;
+    }
+
+    // Four segments coded back to back after the jump table
+    size_t pos = table_size + HUFFMAN_JUMP_TABLE_SIZE;
+    size_t segment = (size + 3) / 4;
+    if (pos > capacity) {
+        return -1;
+    }
+    for (int s = 0; s < HUFFMAN_STREAM_COUNT; s++) {
+        size_t start = s * segment < size ? s * segment : size;
+        size_t end = start + segment < size ? start + segment : size;
+        size_t stream_size = 0;
+        if (end > start) {
+            stream_size = encode_stream(codes, src + start, end - start, dst + pos, capacity - pos);
+            if (stream_size == 0) {
                 return -1;
             }
         }
+        if (s < HUFFMAN_STREAM_COUNT - 1) {
+            uint8_t *jump = dst + table_size + 4 * s;
+            jump[0] = (uint8_t)stream_size;
+            jump[1] = (uint8_t)(stream_size >> 8);
+            jump[2] = (uint8_t)(stream_size >> 16);
+            jump[3] = (uint8_t)(stream_size >> 24);
+        }
+        pos += stream_size;
+    }
+
+    *encoded_size = pos;
+    return 0;
+}
+
+// Largest container header: magic, version, flags and block size
+#define CONTAINER_HEADER_MAX (HUFFMAN_MAGIC_SIZE + 2 + VARINT_MAX_BYTES)
+
+// Largest block header: raw size, type and payload size
+#define BLOCK_HEADER_MAX (2 * VARINT_MAX_BYTES + 1)
+
+// Largest index trailer for a block count
+#define BLOCK_INDEX_MAX(count) \
+    (VARINT_MAX_BYTES + 2 * VARINT_MAX_BYTES * (count) + HUFFMAN_INDEX_FOOTER_SIZE)
+
+// Encodes a block into dst, which holds size bytes, and returns the block
+// type. Blocks that coding does not make smaller are stored raw, in which
+// case dst is left unused.
+static int encode_block(HuffmanBuilder *builder, const uint8_t *src, size_t size,
+                        uint8_t *dst, size_t *encoded_size) {
+    int stream_count = size >= HUFFMAN_MULTI_STREAM_MIN_SIZE ? HUFFMAN_STREAM_COUNT : 1;
+
+    if (huffman_encode_block(builder, src, size, dst, size, stream_count, encoded_size) == 0 &&
+        *encoded_size < size) {
+        return stream_count == HUFFMAN_STREAM_COUNT ? HUFFMAN_BLOCK_CODED_4X : HUFFMAN_BLOCK_CODED;
+    }
+    *encoded_size = size;
+    return HUFFMAN_BLOCK_STORED;
+}
+
+// Writes the container header to dst, which must hold CONTAINER_HEADER_MAX
+// bytes. Returns the number of bytes written.
+static size_t write_container_header(uint8_t *dst, size_t block_size) {
+    memcpy(dst, HUFFMAN_BLOCK_MAGIC, HUFFMAN_MAGIC_SIZE);
+    dst[HUFFMAN_MAGIC_SIZE] = HUFFMAN_BLOCK_VERSION;
+    dst[HUFFMAN_MAGIC_SIZE + 1] = HUFFMAN_FLAG_BLOCK_INDEX;
+    return HUFFMAN_MAGIC_SIZE + 2 + encode_varint(block_size, dst + HUFFMAN_MAGIC_SIZE + 2);
+}
+
+// Writes a block header to dst, which must hold BLOCK_HEADER_MAX bytes.
+// Returns the number of bytes written.
+static size_t write_block_header(uint8_t *dst, size_t raw_size, int type, size_t payload_size) {
+    size_t size = encode_varint(raw_size, dst);
+    dst[size++] = (uint8_t)type;
+    size += encode_varint(payload_size, dst + size);
+    return size;
+}
+
+// One block in flight: its input, its encoded form and the builder used
+// to encode it
+typedef struct {
+    BlockPipelineJob base;
+    HuffmanBuilder *builder;
+    int owns_builder;
+    uint8_t *output;
+    size_t output_size;
+    int type;
+} BlockJob;
+
+// Thread pool task: encodes a block
+static void encode_block_job(void *arg) {
+    BlockJob *job = arg;
+    job->type = encode_block(job->builder, job->base.input, job->base.input_size, job->output, &job->output_size);
+}
+
+// Pipeline callback: writes a finished block with its header and stores the
+// number of bytes written in stored_size.
+// Returns 0 on success, -1 on error.
+static int write_block(FILE *output_file, const BlockPipelineJob *base, size_t *stored_size, void *context) {
+    (void)context;
+    const BlockJob *job = (const BlockJob *)base;
+    const uint8_t *payload = job->type == HUFFMAN_BLOCK_STORED ? base->input : job->output;
+
+    uint8_t header[BLOCK_HEADER_MAX];
+    size_t header_size = write_block_header(header, base->input_size, job->type, job->output_size);
+
+    if (fwrite(header, 1, header_size, output_file) != header_size ||
+        fwrite(payload, 1, job->output_size, output_file) != job->output_size) {
+        return -1;
+    }
+    *stored_size = header_size + job->output_size;
+    return 0;
+}
+
+// Writes the block index trailer to dst, which must hold
+// BLOCK_INDEX_MAX(index->count) bytes. Returns the number of bytes written.
+static size_t write_block_index(uint8_t *dst, const BlockTable *index) {
+    uint32_t index_size = encode_varint(index->count, dst);
+    for (size_t i = 0; i < 2 * index->count; i++) {
+        index_size += encode_varint(index->sizes[i], dst + index_size);
+    }
+
+    uint8_t *footer = dst + index_size;
+    footer[0] = (uint8_t)index_size;
+    footer[1] = (uint8_t)(index_size >> 8);
+    footer[2] = (uint8_t)(index_size >> 16);
+    footer[3] = (uint8_t)(index_size >> 24);
+    memcpy(footer + 4, HUFFMAN_INDEX_MAGIC, 4);
+    return index_size + HUFFMAN_INDEX_FOOTER_SIZE;
+}
+
+// Writes the end of blocks marker and the index trailer to a file.
+// Returns 0 on success, -1 on error.
+static int write_container_end(FILE *output_file, const BlockTable *index) {
+    uint8_t *trailer = malloc(1 + BLOCK_INDEX_MAX(index->count));
+    if (!trailer) {
+        return -1;
+    }
+    trailer[0] = 0; // End of blocks
+    size_t size = 1 + write_block_index(trailer + 1, index);
+
+    int result = fwrite(trailer, 1, size, output_file) == size ? 0 : -1;
+    free(trailer);
+    return result;
+}
+
+// Pipeline callback: sets up the output buffer and builder of a job. A
+// caller-owned builder is only used when there is a single job.
+static int init_block_job(BlockPipelineJob *base, size_t block_size, int job_count, void *context) {
+    BlockJob *job = (BlockJob *)base;
+    HuffmanBuilder *shared_builder = context;
+    job->output = malloc(block_size);
+    if (shared_builder && job_count == 1) {
+        job->builder = shared_builder;
+    } else {
+        job->builder = huffman_builder_create();
+        job->owns_builder = 1;
+    }
+    return job->output && job->builder ? 0 : -1;
+}
+
+// Pipeline callback: frees the output buffer and builder of a job
+static void free_block_job(BlockPipelineJob *base, void *context) {
+    (void)context;
+    BlockJob *job = (BlockJob *)base;
+    free(job->output);
+    if (job->owns_builder) {
+        huffman_builder_free(job->builder);
+    }
+}
+
+// Pipeline callback: writes the container header
+static int write_block_container_header(FILE *output_file, size_t block_size, size_t *header_size, void *context) {
+    (void)context;
+    uint8_t header[CONTAINER_HEADER_MAX];
+    *header_size = write_container_header(header, block_size);
+    if (fwrite(header, 1, *header_size, output_file) != *header_size) {
+        perror("Error writing Huffman header");
+        return -1;
     }
-    
-    // Flush remaining bits
-    flush_bit_buffer(output_file);
-    
-    // Clean up
-    free_huffman_tree(root);
-    
     return 0;
 }
 
+// Shared implementation of the compress functions: runs the blocks through
+// the block pipeline, then writes the end marker and the index.
+// Returns 0 on success, -1 on error.
+static int compress_blocks(FILE *input_file, FILE *output_file, size_t block_size, int thread_count,
+                           HuffmanBuilder *shared_builder, ProgressCallback progress_fn, void *user_data,
+                           BlockTable *table) {
+    if (block_size == 0 || block_size > HUFFMAN_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Invalid Huffman block size\n");
+        return -1;
+    }
+
+    BlockPipeline pipeline = {
+        .job_size = sizeof(BlockJob),
+        .init_job = init_block_job,
+        .free_job = free_block_job,
+        .write_header = write_block_container_header,
+        .encode = encode_block_job,
+        .write_block = write_block,
+        .context = shared_builder,
+    };
+    BlockTable index = {0};
+    if (block_pipeline_run(&pipeline, input_file, output_file, block_size, thread_count,
+                           progress_fn, user_data, &index) != 0) {
+        return -1;
+    }
+
+    // End of blocks, then the index
+    int result = 0;
+    if (write_container_end(output_file, &index) != 0) {
+        perror("Error writing compressed data");
+        result = -1;
+    }
+
+    if (result == 0 && table) {
+        *table = index;
+    } else {
+        block_table_free(&index);
+    }
+    return result;
+}
+
+// Compresses the input in independent blocks of block_size bytes, encoding
+// up to thread_count blocks concurrently. Blocks are written in input order.
+// If table is not NULL it receives the stored and raw size of every block.
+// Returns 0 on success, -1 on error.
+int huffman_compress_blocks(FILE *input_file, FILE *output_file, size_t block_size, int thread_count,
+                            ProgressCallback progress_fn, void *user_data, BlockTable *table) {
+    return compress_blocks(input_file, output_file, block_size, thread_count, NULL, progress_fn, user_data, table);
+}
+
+int huffman_compress(FILE *input_file, FILE *output_file) {
+    return huffman_compress_with_progress(input_file, output_file, NULL, NULL);
+}
+
 // Add the progress callback function
 typedef void (*ProgressCallback)(size_t bytes_processed, size_t total_bytes, void *user_data);
 
 // Function to build Huffman tree with progress callback
 int huffman_compress_with_progress(FILE *input_file, FILE *output_file, ProgressCallback progress_fn, void *user_data) {
-    // Frequency calculation
-    unsigned frequencies[MAX_CHARS] = {0};
-    int c;
-    size_t file_size = 0;
-
-    // Get the total size of the input file for progress tracking
-    fseek(input_file, 0, SEEK_END);
-    size_t total_size = ftell(input_file);
-    rewind(input_file);
-
-    // First pass: calculate frequencies
-    while ((c = fgetc(input_file)) != EOF) {
-        frequencies[c]++;
-        file_size++;
-        if (progress_fn) {
-            progress_fn(file_size, total_size, user_data);
+    return compress_blocks(input_file, output_file, HUFFMAN_BLOCK_SIZE_BALANCED, 1, NULL, progress_fn, user_data, NULL);
+}
+
+// Same as huffman_compress_with_progress with blocks of block_size bytes,
+// reusing a caller-owned tree builder
+int huffman_compress_with_builder(FILE *input_file, FILE *output_file, HuffmanBuilder *builder, size_t block_size,
+                                  ProgressCallback progress_fn, void *user_data) {
+    return compress_blocks(input_file, output_file, block_size, 1, builder, progress_fn, user_data, NULL);
+}
+
+// Encodes a block with its header into dst and adds it to the index. The
+// payload is encoded past room for the largest header and moved down once
+// the header size is known. Stores the number of bytes written.
+// Returns 0 on success, -1 on error or if the block does not fit.
+static int emit_block(HuffmanBuilder *builder, BlockTable *index, const uint8_t *src, size_t size,
+                      uint8_t *dst, size_t capacity, size_t *written) {
+    if (capacity < BLOCK_HEADER_MAX + size) {
+        fprintf(stderr, "Huffman output buffer too small\n");
+        return -1;
+    }
+
+    size_t payload_size;
+    int type = encode_block(builder, src, size, dst + BLOCK_HEADER_MAX, &payload_size);
+    const uint8_t *payload = type == HUFFMAN_BLOCK_STORED ? src : dst + BLOCK_HEADER_MAX;
+
+    size_t header_size = write_block_header(dst, size, type, payload_size);
+    memmove(dst + header_size, payload, payload_size);
+
+    if (block_table_add(index, header_size + payload_size, size) != 0) {
+        fprintf(stderr, "Memory allocation failed for block index\n");
+        return -1;
+    }
+    *written = header_size + payload_size;
+    return 0;
+}
+
+// Writes the end of blocks marker and the index trailer to dst.
+// Returns the number of bytes written, 0 if they do not fit.
+static size_t emit_container_end(const BlockTable *index, uint8_t *dst, size_t capacity) {
+    if (capacity < 1 + BLOCK_INDEX_MAX(index->count)) {
+        fprintf(stderr, "Huffman output buffer too small\n");
+        return 0;
+    }
+    dst[0] = 0; // End of blocks
+    return 1 + write_block_index(dst + 1, index);
+}
+
+// Largest container huffman_compress_buffer writes for size bytes of input
+size_t huffman_compress_bound(size_t size, size_t block_size) {
+    size_t block_count = block_size ? (size + block_size - 1) / block_size : 0;
+    return CONTAINER_HEADER_MAX + size + block_count * BLOCK_HEADER_MAX + 1 + BLOCK_INDEX_MAX(block_count);
+}
+
+// Compresses size bytes of src into a block container in dst.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int huffman_compress_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                            size_t block_size, size_t *compressed_size) {
+    if (block_size == 0 || block_size > HUFFMAN_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Invalid Huffman block size\n");
+        return -1;
+    }
+    if (size < block_size) {
+        block_size = size > 0 ? size : 1;
+    }
+    if (capacity < CONTAINER_HEADER_MAX) {
+        fprintf(stderr, "Huffman output buffer too small\n");
+        return -1;
+    }
+
+    HuffmanBuilder *builder = huffman_builder_create();
+    if (!builder) {
+        fprintf(stderr, "Memory allocation failed for Huffman builder\n");
+        return -1;
+    }
+
+    BlockTable index = {0};
+    size_t pos = write_container_header(dst, block_size);
+    int result = 0;
+    for (size_t offset = 0; offset < size; offset += block_size) {
+        size_t raw_size = size - offset < block_size ? size - offset : block_size;
+        size_t written;
+        if (emit_block(builder, &index, src + offset, raw_size, dst + pos, capacity - pos, &written) != 0) {
+            result = -1;
+            break;
         }
+        pos += written;
     }
-    rewind(input_file);
 
-    // Build Huffman tree
-    HuffmanNode* root = build_huffman_tree(frequencies);
+    if (result == 0) {
+        size_t written = emit_container_end(&index, dst + pos, capacity - pos);
+        if (written == 0) {
+            result = -1;
+        }
+        *compressed_size = pos + written;
+    }
 
-    // Build Huffman codes
-    HuffmanCode codes[MAX_CHARS] = {0};
-    build_huffman_codes(root, codes, 0, 0);
+    block_table_free(&index);
+    huffman_builder_free(builder);
+    return result;
+}
 
-    // Write file size and frequency table
-    fwrite(&file_size, sizeof(size_t), 1, output_file);
-    fwrite(frequencies, sizeof(unsigned), MAX_CHARS, output_file);
+// Initializes a streaming encoder. Returns 0 on success, -1 on error.
+int huffman_encoder_init(HuffmanEncoder *encoder, size_t block_size) {
+    memset(encoder, 0, sizeof(*encoder));
+    if (block_size == 0 || block_size > HUFFMAN_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Invalid Huffman block size\n");
+        return -1;
+    }
+    encoder->block_size = block_size;
+    encoder->builder = huffman_builder_create();
+    if (!encoder->builder) {
+        fprintf(stderr, "Memory allocation failed for Huffman builder\n");
+        return -1;
+    }
+    return 0;
+}
 
-    // Reset file_size for progress tracking in the second pass
-    file_size = 0;
+// Largest output of huffman_encoder_update with size bytes of input, or of
+// huffman_encoder_finish when size is 0.
+size_t huffman_encoder_bound(const HuffmanEncoder *encoder, size_t size) {
+    size_t pending = encoder->block_fill + size;
+    size_t block_count = pending / encoder->block_size + 1;
+    return CONTAINER_HEADER_MAX + pending + block_count * BLOCK_HEADER_MAX +
+           1 + BLOCK_INDEX_MAX(encoder->index.count + block_count);
+}
 
-    // Compress file
-    while ((c = fgetc(input_file)) != EOF) {
-        HuffmanCode code = codes[c];
+// Writes the container header before the first output and advances pos.
+// Returns 0 on success, -1 if it does not fit.
+static int emit_header_once(HuffmanEncoder *encoder, uint8_t *dst, size_t capacity, size_t *pos) {
+    if (encoder->header_written) {
+        return 0;
+    }
+    if (capacity < CONTAINER_HEADER_MAX) {
+        fprintf(stderr, "Huffman output buffer too small\n");
+        return -1;
+    }
+    *pos += write_container_header(dst, encoder->block_size);
+    encoder->header_written = 1;
+    return 0;
+}
 
-        // Write code bit by bit
-        for (int i = code.code_length - 1; i >= 0; i--) {
-            uint8_t bit = (code.code >> i) & 1;
-            if (write_bit(output_file, bit) != 0) {
-                free_huffman_tree(root);
-                return -1;
+// Encodes size more bytes of src, writing every completed block to dst.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int huffman_encoder_update(HuffmanEncoder *encoder, const uint8_t *src, size_t size,
+                           uint8_t *dst, size_t capacity, size_t *written) {
+    size_t pos = 0;
+    *written = 0;
+    if (emit_header_once(encoder, dst, capacity, &pos) != 0) {
+        return -1;
+    }
+
+    while (size > 0) {
+        const uint8_t *block = src;
+        size_t block_size = encoder->block_size;
+
+        if (encoder->block_fill == 0 && size >= block_size) {
+            // Whole blocks are encoded in place
+            src += block_size;
+            size -= block_size;
+        } else {
+            if (!encoder->block) {
+                encoder->block = malloc(encoder->block_size);
+                if (!encoder->block) {
+                    fprintf(stderr, "Memory allocation failed for Huffman blocks\n");
+                    return -1;
+                }
             }
+            size_t take = block_size - encoder->block_fill;
+            if (take > size) {
+                take = size;
+            }
+            memcpy(encoder->block + encoder->block_fill, src, take);
+            encoder->block_fill += take;
+            src += take;
+            size -= take;
+            if (encoder->block_fill < block_size) {
+                break;
+            }
+            block = encoder->block;
+            encoder->block_fill = 0;
         }
 
-        file_size++;
-        if (progress_fn) {
-            progress_fn(file_size, total_size, user_data);
+        size_t block_written;
+        if (emit_block(encoder->builder, &encoder->index, block, block_size,
+                       dst + pos, capacity - pos, &block_written) != 0) {
+            return -1;
         }
+        pos += block_written;
     }
 
-    // Flush remaining bits
-    flush_bit_buffer(output_file);
+    *written = pos;
+    return 0;
+}
+
+// Encodes the last block and writes the end marker and index to dst.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int huffman_encoder_finish(HuffmanEncoder *encoder, uint8_t *dst, size_t capacity, size_t *written) {
+    size_t pos = 0;
+    *written = 0;
+    if (emit_header_once(encoder, dst, capacity, &pos) != 0) {
+        return -1;
+    }
 
-    // Clean up
-    free_huffman_tree(root);
+    if (encoder->block_fill > 0) {
+        size_t block_written;
+        if (emit_block(encoder->builder, &encoder->index, encoder->block, encoder->block_fill,
+                       dst + pos, capacity - pos, &block_written) != 0) {
+            return -1;
+        }
+        pos += block_written;
+        encoder->block_fill = 0;
+    }
 
+    size_t end_size = emit_container_end(&encoder->index, dst + pos, capacity - pos);
+    if (end_size == 0) {
+        return -1;
+    }
+    *written = pos + end_size;
     return 0;
-}
\ No newline at end of file
+}
+
+// Releases the encoder's builder and buffers.
+void huffman_encoder_free(HuffmanEncoder *encoder) {
+    huffman_builder_free(encoder->builder);
+    free(encoder->block);
+    block_table_free(&encoder->index);
+    memset(encoder, 0, sizeof(*encoder));
+}
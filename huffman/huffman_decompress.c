@@ -1,67 +1,993 @@
+#define _POSIX_C_SOURCE 200809L // pread, pwrite, ftello
+
 #include "huffman.h"
 #include "../utils/bit_manipulation.h"
+#include "../utils/thread_pool.h"
+#include "../utils/varint.h"
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
+#define OUTPUT_BUFFER_SIZE 65536
 
-int huffman_decompress(FILE *input_file, FILE *output_file) {
+// Builds a decoding table for the given codes.
+// Returns 0 on success, -1 on error.
+int build_decode_table(const HuffmanCode *codes, HuffmanDecodeTable *table) {
+    const size_t primary_size = (size_t)1 << HUFFMAN_TABLE_BITS;
+    uint8_t sub_bits[1 << HUFFMAN_TABLE_BITS] = {0};
+    uint8_t max_length = 0;
+
+    // Find the subtable width needed below each primary prefix
+    for (int i = 0; i < MAX_CHARS; i++) {
+        uint8_t length = codes[i].code_length;
+        if (length > HUFFMAN_MAX_DECODE_BITS) {
+            fprintf(stderr, "Huffman code length %u is not supported\n", length);
+            return -1;
+        }
+        if (length > max_length) {
+            max_length = length;
+        }
+        if (length > HUFFMAN_TABLE_BITS) {
+            uint32_t prefix = codes[i].code >> (length - HUFFMAN_TABLE_BITS);
+            if (length - HUFFMAN_TABLE_BITS > sub_bits[prefix]) {
+                sub_bits[prefix] = length - HUFFMAN_TABLE_BITS;
+            }
+        }
+    }
+
+    // Lay out subtables after the primary table
+    size_t entry_count = primary_size;
+    for (size_t p = 0; p < primary_size; p++) {
+        if (sub_bits[p]) {
+            entry_count += (size_t)1 << sub_bits[p];
+        }
+    }
+    if (entry_count > 0x10000) {
+        fprintf(stderr, "Huffman decoding table too large\n");
+        return -1;
+    }
+
+    HuffmanDecodeEntry *entries = calloc(entry_count, sizeof(HuffmanDecodeEntry));
+    if (!entries) {
+        fprintf(stderr, "Memory allocation failed for decoding table\n");
+        return -1;
+    }
+
+    size_t offset = primary_size;
+    for (size_t p = 0; p < primary_size; p++) {
+        if (sub_bits[p]) {
+            entries[p].value = (uint16_t)offset;
+            entries[p].sub_bits = sub_bits[p];
+            offset += (size_t)1 << sub_bits[p];
+        }
+    }
+
+    // Replicate each code over every index that starts with it
+    for (int i = 0; i < MAX_CHARS; i++) {
+        uint8_t length = codes[i].code_length;
+        if (length == 0) {
+            continue;
+        }
+
+        HuffmanDecodeEntry entry = { (uint16_t)i, length, 0 };
+        size_t start, count;
+        if (length <= HUFFMAN_TABLE_BITS) {
+            start = (size_t)codes[i].code << (HUFFMAN_TABLE_BITS - length);
+            count = (size_t)1 << (HUFFMAN_TABLE_BITS - length);
+        } else {
+            int extra = length - HUFFMAN_TABLE_BITS;
+            HuffmanDecodeEntry link = entries[codes[i].code >> extra];
+            uint32_t suffix = codes[i].code & ((1u << extra) - 1);
+            start = link.value + ((size_t)suffix << (link.sub_bits - extra));
+            count = (size_t)1 << (link.sub_bits - extra);
+        }
+
+        for (size_t j = 0; j < count; j++) {
+            entries[start + j] = entry;
+        }
+    }
+
+    table->entries = entries;
+    table->entry_count = entry_count;
+    table->max_length = max_length;
+    return 0;
+}
+
+// Frees the entries of a decoding table
+void free_decode_table(HuffmanDecodeTable *table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->entry_count = 0;
+}
+
+// Parses a code length table written by write_code_lengths.
+// Returns the number of bytes consumed, 0 on error.
+size_t parse_code_lengths(const uint8_t *src, size_t size, uint8_t *lengths) {
+    if (size < 2 || src[0] > src[1]) {
+        return 0;
+    }
+    int first = src[0], last = src[1];
+    size_t table_size = 2 + (size_t)(last - first + 2) / 2;
+    if (table_size > size) {
+        return 0;
+    }
+
+    memset(lengths, 0, MAX_CHARS);
+    for (int i = first; i <= last; i++) {
+        uint8_t packed = src[2 + (i - first) / 2];
+        lengths[i] = ((i - first) & 1) ? (packed & 0x0F) : (packed >> 4);
+    }
+
+    return table_size;
+}
+
+// Decodes one symbol into *out. The accumulator must hold at least the
+// longest code length, or all remaining bits.
+// Returns 0 on success, -1 on an invalid code or the end of the stream.
+static inline int decode_next(BitReader *in, const HuffmanDecodeEntry *entries, uint8_t *out) {
+    HuffmanDecodeEntry entry = entries[peek_bits(in, HUFFMAN_TABLE_BITS)];
+    if (entry.length == 0 && entry.sub_bits > 0) {
+        uint32_t suffix = (uint32_t)((in->bits << HUFFMAN_TABLE_BITS) >> (64 - entry.sub_bits));
+        entry = entries[entry.value + suffix];
+    }
+    if (entry.length == 0 || entry.length > in->count) {
+        return -1;
+    }
+
+    skip_bits(in, entry.length);
+    *out = (uint8_t)entry.value;
+    return 0;
+}
+
+// Decodes symbol_count symbols from the bit stream into dst using a
+// decoding table.
+// Returns 0 on success, -1 on error.
+static int decode_symbols(BitReader *in, const HuffmanDecodeTable *table,
+                          uint8_t *dst, size_t symbol_count) {
+    // Work on a local copy: stores to dst may alias *in, which would force
+    // the reader state through memory after every symbol
+    BitReader reader = *in;
+    int result = 0;
+
+    for (size_t decoded = 0; decoded < symbol_count; decoded++) {
+        if (reader.count < table->max_length) {
+            refill_bits(&reader);
+        }
+        if (decode_next(&reader, table->entries, &dst[decoded]) != 0) {
+            fprintf(stderr, "Invalid or truncated Huffman code in compressed data\n");
+            result = -1;
+            break;
+        }
+    }
+
+    *in = reader;
+    return result;
+}
+
+// Decodes one symbol without bounds checks, for use while at least
+// SYMBOLS_PER_REFILL codes are known to be buffered.
+// Returns nonzero on an invalid code.
+static inline int decode_next_unchecked(BitReader *in, const HuffmanDecodeEntry *entries, uint8_t *out) {
+    HuffmanDecodeEntry entry = entries[peek_bits(in, HUFFMAN_TABLE_BITS)];
+    if (entry.sub_bits) {
+        uint32_t suffix = (uint32_t)((in->bits << HUFFMAN_TABLE_BITS) >> (64 - entry.sub_bits));
+        entry = entries[entry.value + suffix];
+    }
+
+    skip_bits(in, entry.length);
+    *out = (uint8_t)entry.value;
+    return entry.length == 0;
+}
+
+// Number of symbols each stream decodes per refill in decode_streams. A
+// refill leaves at least 56 bits and codes are at most 15 bits long.
+#define SYMBOLS_PER_REFILL 3
+
+// Decodes the HUFFMAN_STREAM_COUNT sub-streams of a block. The streams are
+// independent, so the loop advances all of them together and their table
+// lookups and shifts overlap instead of waiting on each other.
+// Returns 0 on success, -1 on error.
+static int decode_streams(BitReader *in, const HuffmanDecodeTable *table,
+                          uint8_t *dst, size_t raw_size) {
+    const HuffmanDecodeEntry *entries = table->entries;
+    size_t segment = (raw_size + 3) / 4;
+    uint8_t *out[HUFFMAN_STREAM_COUNT];
+    uint8_t *end[HUFFMAN_STREAM_COUNT];
+
+    for (int s = 0; s < HUFFMAN_STREAM_COUNT; s++) {
+        size_t start = s * segment < raw_size ? s * segment : raw_size;
+        out[s] = dst + start;
+        end[s] = dst + (start + segment < raw_size ? start + segment : raw_size);
+    }
+
+    // The last segment is the shortest, so it bounds the interleaved loop.
+    // As in decode_symbols the readers are local copies, one variable per
+    // stream so the compiler can keep all four in registers.
+    BitReader r0 = in[0], r1 = in[1], r2 = in[2], r3 = in[3];
+    uint8_t *out0 = out[0], *out1 = out[1], *out2 = out[2], *out3 = out[3];
+    size_t rounds = (size_t)(end[3] - out3) / SYMBOLS_PER_REFILL;
+    int error = 0;
+
+    // Near the end of a stream a refill may come up short; the checked
+    // loops below take over from there
+    while (rounds > 0 && r0.pos + 8 <= r0.length && r1.pos + 8 <= r1.length &&
+           r2.pos + 8 <= r2.length && r3.pos + 8 <= r3.length) {
+        refill_bits(&r0);
+        refill_bits(&r1);
+        refill_bits(&r2);
+        refill_bits(&r3);
+        for (int k = 0; k < SYMBOLS_PER_REFILL; k++) {
+            error |= decode_next_unchecked(&r0, entries, out0++);
+            error |= decode_next_unchecked(&r1, entries, out1++);
+            error |= decode_next_unchecked(&r2, entries, out2++);
+            error |= decode_next_unchecked(&r3, entries, out3++);
+        }
+        rounds--;
+    }
+
+    in[0] = r0;
+    in[1] = r1;
+    in[2] = r2;
+    in[3] = r3;
+    out[0] = out0;
+    out[1] = out1;
+    out[2] = out2;
+    out[3] = out3;
+    if (error) {
+        fprintf(stderr, "Invalid or truncated Huffman code in compressed data\n");
+        return -1;
+    }
+
+    // Finish each stream on its own
+    for (int s = 0; s < HUFFMAN_STREAM_COUNT; s++) {
+        if (decode_symbols(&in[s], table, out[s], (size_t)(end[s] - out[s])) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Writes count copies of a byte. Used for inputs with a single distinct
+// symbol, for which the encoder emits no bits at all.
+static int write_repeated(uint8_t byte, size_t count, FILE *output_file) {
+    uint8_t out[OUTPUT_BUFFER_SIZE];
+    memset(out, byte, sizeof(out));
+
+    while (count > 0) {
+        size_t chunk = count < sizeof(out) ? count : sizeof(out);
+        if (fwrite(out, 1, chunk, output_file) != chunk || ferror(output_file)) {
+            fprintf(stderr, "Error writing decompressed data\n");
+            return -1;
+        }
+        count -= chunk;
+    }
+
+    return 0;
+}
+
+// Decodes file_size bytes coded with the given codes. When single_symbol
+// is not -1 the stream carries no bits and that symbol is repeated instead.
+// Returns 0 on success, -1 on error.
+static int decode_stream(FILE *input_file, FILE *output_file, const HuffmanCode *codes,
+                         int single_symbol, size_t file_size) {
+    if (single_symbol >= 0) {
+        return write_repeated((uint8_t)single_symbol, file_size, output_file);
+    }
+
+    HuffmanDecodeTable table;
+    if (build_decode_table(codes, &table) != 0) {
+        return -1;
+    }
+
+    BitReader reader;
+    if (bit_reader_init(&reader, input_file) != 0) {
+        fprintf(stderr, "Memory allocation failed for input buffer\n");
+        free_decode_table(&table);
+        return -1;
+    }
+
+    // Decode in chunks of at most OUTPUT_BUFFER_SIZE bytes
+    uint8_t out[OUTPUT_BUFFER_SIZE];
+    int result = 0;
+    while (result == 0 && file_size > 0) {
+        size_t chunk = file_size < sizeof(out) ? file_size : sizeof(out);
+        result = decode_symbols(&reader, &table, out, chunk);
+        if (result == 0 && (fwrite(out, 1, chunk, output_file) != chunk || ferror(output_file))) {
+            fprintf(stderr, "Error writing decompressed data\n");
+            result = -1;
+        }
+        file_size -= chunk;
+    }
+
+    // Clean up
+    bit_reader_free(&reader);
+    free_decode_table(&table);
+
+    return result;
+}
+
+// Decodes a stream with the legacy header: the original size as a size_t
+// followed by 256 unsigned frequencies. The first HUFFMAN_MAGIC_SIZE bytes
+// of the header have already been read into prefix.
+// Returns 0 on success, -1 on error.
+static int decompress_legacy(FILE *input_file, FILE *output_file, const uint8_t *prefix) {
     // Read original file size
     size_t file_size;
-    if (fread(&file_size, sizeof(size_t), 1, input_file) != 1) {
+    uint8_t size_bytes[sizeof(size_t)];
+    memcpy(size_bytes, prefix, HUFFMAN_MAGIC_SIZE);
+    if (fread(size_bytes + HUFFMAN_MAGIC_SIZE, 1, sizeof(size_t) - HUFFMAN_MAGIC_SIZE, input_file)
+        != sizeof(size_t) - HUFFMAN_MAGIC_SIZE) {
         fprintf(stderr, "Error reading file size\n");
         return -1;
     }
-    
+    memcpy(&file_size, size_bytes, sizeof(size_t));
+
     // Read frequency table
     unsigned frequencies[MAX_CHARS] = {0};
     if (fread(frequencies, sizeof(unsigned), MAX_CHARS, input_file) != MAX_CHARS) {
         fprintf(stderr, "Error reading frequency table\n");
         return -1;
     }
-    
-    // Rebuild Huffman tree
-    HuffmanNode* root = build_huffman_tree(frequencies);
-    if (root == NULL) {
+
+    if (file_size == 0) {
+        return 0;
+    }
+
+    int symbol_count = 0;
+    for (int i = 0; i < MAX_CHARS; i++) {
+        if (frequencies[i] > 0) {
+            symbol_count++;
+        }
+    }
+    if (symbol_count == 0) {
+        fprintf(stderr, "Invalid frequency table\n");
+        return -1;
+    }
+
+    // Rebuild the legacy tree shape to recover the codes
+    HuffmanBuilder* builder = huffman_builder_create();
+    if (builder == NULL || huffman_builder_build_legacy(builder, frequencies) != 0) {
         fprintf(stderr, "Error rebuilding Huffman tree\n");
+        huffman_builder_free(builder);
+        return -1;
+    }
+
+    HuffmanCode codes[MAX_CHARS] = {0};
+    int single_symbol = -1;
+    if (builder->nodes[builder->root].left < 0) {
+        single_symbol = builder->nodes[builder->root].character;
+    } else {
+        huffman_builder_codes(builder, codes);
+    }
+    huffman_builder_free(builder);
+
+    return decode_stream(input_file, output_file, codes, single_symbol, file_size);
+}
+
+// Decodes a canonical stream whose magic has already been read. The codes
+// are rebuilt from the stored code lengths alone.
+// Returns 0 on success, -1 on error.
+static int decompress_canonical(FILE *input_file, FILE *output_file) {
+    uint64_t file_size;
+    if (read_varint(input_file, &file_size) != 0) {
+        fprintf(stderr, "Error reading file size\n");
+        return -1;
+    }
+    if (file_size == 0) {
+        return 0;
+    }
+
+    // Read the used symbol range and its nibble-packed code lengths
+    uint8_t header[2 + MAX_CHARS / 2];
+    if (fread(header, 1, 2, input_file) != 2 || header[0] > header[1]) {
+        fprintf(stderr, "Error reading code length table\n");
+        return -1;
+    }
+    size_t packed_size = (size_t)(header[1] - header[0] + 2) / 2;
+    if (fread(header + 2, 1, packed_size, input_file) != packed_size) {
+        fprintf(stderr, "Error reading code length table\n");
+        return -1;
+    }
+
+    uint8_t lengths[MAX_CHARS];
+    parse_code_lengths(header, 2 + packed_size, lengths);
+    int symbol_count = 0;
+    int single_symbol = -1;
+    for (int i = 0; i < MAX_CHARS; i++) {
+        if (lengths[i] > 0) {
+            symbol_count++;
+            single_symbol = i;
+        }
+    }
+    if (symbol_count != 1) {
+        single_symbol = -1;
+    }
+
+    HuffmanCode codes[MAX_CHARS];
+    if (symbol_count == 0 || assign_canonical_codes(lengths, codes) != 0) {
+        fprintf(stderr, "Invalid code length table\n");
         return -1;
     }
-    
-    // Decompress
-    HuffmanNode* current = root;
-    size_t decoded_bytes = 0;
-    uint8_t bit;
-    
-    while (decoded_bytes < file_size) {
-        // Read a bit
-        if (!read_bit(input_file, &bit)) {
-            // End of file or error
-            if (decoded_bytes < file_size) {
-                fprintf(stderr, "Unexpected end of file during decompression\n");
-                free_huffman_tree(root);
+
+    return decode_stream(input_file, output_file, codes, single_symbol, file_size);
+}
+
+// Locates the sub-streams of a CODED_4X block through its jump table and
+// decodes them. Returns 0 on success, -1 on error.
+static int decode_block_streams(const uint8_t *src, size_t size, const HuffmanDecodeTable *table,
+                                uint8_t *dst, size_t raw_size) {
+    if (size < HUFFMAN_JUMP_TABLE_SIZE) {
+        fprintf(stderr, "Invalid Huffman jump table\n");
+        return -1;
+    }
+
+    BitReader readers[HUFFMAN_STREAM_COUNT];
+    size_t pos = HUFFMAN_JUMP_TABLE_SIZE;
+    for (int s = 0; s < HUFFMAN_STREAM_COUNT; s++) {
+        size_t stream_size = size - pos;
+        if (s < HUFFMAN_STREAM_COUNT - 1) {
+            const uint8_t *jump = src + 4 * s;
+            stream_size = (size_t)jump[0] | ((size_t)jump[1] << 8) |
+                          ((size_t)jump[2] << 16) | ((size_t)jump[3] << 24);
+            if (stream_size > size - pos) {
+                fprintf(stderr, "Invalid Huffman jump table\n");
                 return -1;
             }
+        }
+        bit_reader_init_buffer(&readers[s], src + pos, stream_size);
+        pos += stream_size;
+    }
+
+    return decode_streams(readers, table, dst, raw_size);
+}
+
+// Decodes a block written by huffman_encode_block into raw_size bytes of dst.
+// Returns 0 on success, -1 on error.
+int huffman_decode_block(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size, int stream_count) {
+    uint8_t lengths[MAX_CHARS];
+    size_t table_size = parse_code_lengths(src, size, lengths);
+    if (table_size == 0) {
+        fprintf(stderr, "Invalid code length table\n");
+        return -1;
+    }
+
+    int symbol_count = 0;
+    int single_symbol = -1;
+    for (int i = 0; i < MAX_CHARS; i++) {
+        if (lengths[i] > 0) {
+            symbol_count++;
+            single_symbol = i;
+        }
+    }
+
+    HuffmanCode codes[MAX_CHARS];
+    if (symbol_count == 0 || assign_canonical_codes(lengths, codes) != 0) {
+        fprintf(stderr, "Invalid code length table\n");
+        return -1;
+    }
+
+    // A single distinct byte carries no bits
+    if (symbol_count == 1) {
+        memset(dst, single_symbol, raw_size);
+        return 0;
+    }
+
+    HuffmanDecodeTable table;
+    if (build_decode_table(codes, &table) != 0) {
+        return -1;
+    }
+
+    int result;
+    if (stream_count != HUFFMAN_STREAM_COUNT) {
+        BitReader reader;
+        bit_reader_init_buffer(&reader, src + table_size, size - table_size);
+        result = decode_symbols(&reader, &table, dst, raw_size);
+    } else {
+        result = decode_block_streams(src + table_size, size - table_size, &table, dst, raw_size);
+    }
+    free_decode_table(&table);
+
+    return result;
+}
+
+// Skips the block index trailer that follows the end of blocks marker.
+// Returns 0 on success, -1 on error.
+static int skip_block_index(FILE *input_file) {
+    uint64_t block_count, size;
+    if (read_varint(input_file, &block_count) != 0) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < 2 * block_count; i++) {
+        if (read_varint(input_file, &size) != 0) {
+            return -1;
+        }
+    }
+
+    uint8_t footer[HUFFMAN_INDEX_FOOTER_SIZE];
+    if (fread(footer, 1, sizeof(footer), input_file) != sizeof(footer) ||
+        memcmp(footer + 4, HUFFMAN_INDEX_MAGIC, 4) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Checks a block header against the container's block size.
+// Returns 0 if it is valid, -1 otherwise.
+static int check_block_header(uint64_t raw_size, int type, uint64_t payload_size, uint64_t block_size) {
+    if (raw_size > block_size || payload_size > block_size ||
+        (type == HUFFMAN_BLOCK_STORED && payload_size != raw_size) ||
+        (type != HUFFMAN_BLOCK_STORED && type != HUFFMAN_BLOCK_CODED && type != HUFFMAN_BLOCK_CODED_4X)) {
+        fprintf(stderr, "Invalid Huffman block header\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Decodes a block container whose magic has already been read.
+// Returns 0 on success, -1 on error.
+static int decompress_blocks(FILE *input_file, FILE *output_file) {
+    int version = fgetc(input_file);
+    int flags = fgetc(input_file);
+    uint64_t block_size;
+    if (version == EOF || flags == EOF || read_varint(input_file, &block_size) != 0) {
+        fprintf(stderr, "Error reading Huffman header\n");
+        return -1;
+    }
+    if (version != HUFFMAN_BLOCK_VERSION) {
+        fprintf(stderr, "Unsupported Huffman block format version %d\n", version);
+        return -1;
+    }
+    if (block_size == 0 || block_size > HUFFMAN_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Invalid Huffman block size\n");
+        return -1;
+    }
+
+    uint8_t *payload = malloc(block_size);
+    uint8_t *output = malloc(block_size);
+    if (!payload || !output) {
+        fprintf(stderr, "Memory allocation failed for Huffman blocks\n");
+        free(payload);
+        free(output);
+        return -1;
+    }
+
+    int result = 0;
+    for (;;) {
+        uint64_t raw_size, payload_size;
+        if (read_varint(input_file, &raw_size) != 0) {
+            fprintf(stderr, "Error reading block header\n");
+            result = -1;
+            break;
+        }
+        if (raw_size == 0) {
+            // End of blocks; consume the index trailer so the stream is read to its end
+            if ((flags & HUFFMAN_FLAG_BLOCK_INDEX) && skip_block_index(input_file) != 0) {
+                fprintf(stderr, "Error reading block index\n");
+                result = -1;
+            }
+            break;
+        }
+
+        int type = fgetc(input_file);
+        if (type == EOF || read_varint(input_file, &payload_size) != 0) {
+            fprintf(stderr, "Error reading block header\n");
+            result = -1;
+            break;
+        }
+        if (check_block_header(raw_size, type, payload_size, block_size) != 0) {
+            result = -1;
+            break;
+        }
+
+        if (fread(payload, 1, payload_size, input_file) != payload_size) {
+            fprintf(stderr, "Unexpected end of file during decompression\n");
+            result = -1;
             break;
         }
-        
-        // Traverse the tree based on the bit
-        current = (bit == 0) ? current->left : current->right;
-        
-        // If we've reached a leaf node
-        if (current->left == NULL && current->right == NULL) {
-            // Write the character
-            if (fputc(current->character, output_file) == EOF) {
-                fprintf(stderr, "Error writing decompressed data\n");
-                free_huffman_tree(root);
+
+        const uint8_t *data = payload;
+        if (type != HUFFMAN_BLOCK_STORED) {
+            int stream_count = type == HUFFMAN_BLOCK_CODED_4X ? HUFFMAN_STREAM_COUNT : 1;
+            if (huffman_decode_block(payload, payload_size, output, raw_size, stream_count) != 0) {
+                result = -1;
+                break;
+            }
+            data = output;
+        }
+        if (fwrite(data, 1, raw_size, output_file) != raw_size || ferror(output_file)) {
+            fprintf(stderr, "Error writing decompressed data\n");
+            result = -1;
+            break;
+        }
+    }
+
+    free(payload);
+    free(output);
+    return result;
+}
+
+int huffman_decompress(FILE *input_file, FILE *output_file) {
+    uint8_t magic[HUFFMAN_MAGIC_SIZE];
+    if (fread(magic, 1, HUFFMAN_MAGIC_SIZE, input_file) != HUFFMAN_MAGIC_SIZE) {
+        fprintf(stderr, "Error reading Huffman header\n");
+        return -1;
+    }
+
+    if (memcmp(magic, HUFFMAN_BLOCK_MAGIC, HUFFMAN_MAGIC_SIZE) == 0) {
+        return decompress_blocks(input_file, output_file);
+    }
+    if (memcmp(magic, HUFFMAN_MAGIC, HUFFMAN_MAGIC_SIZE) == 0) {
+        return decompress_canonical(input_file, output_file);
+    }
+    return decompress_legacy(input_file, output_file, magic);
+}
+
+// Decodes a block container of size bytes from src into dst.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int huffman_decompress_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                              size_t *decompressed_size) {
+    if (size < HUFFMAN_MAGIC_SIZE + 2 || memcmp(src, HUFFMAN_BLOCK_MAGIC, HUFFMAN_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "Not a Huffman block container\n");
+        return -1;
+    }
+    if (src[HUFFMAN_MAGIC_SIZE] != HUFFMAN_BLOCK_VERSION) {
+        fprintf(stderr, "Unsupported Huffman block format version %d\n", src[HUFFMAN_MAGIC_SIZE]);
+        return -1;
+    }
+
+    size_t pos = HUFFMAN_MAGIC_SIZE + 2;
+    uint64_t block_size;
+    size_t used = decode_varint(src + pos, size - pos, &block_size);
+    if (used == 0 || block_size == 0 || block_size > HUFFMAN_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Invalid Huffman block size\n");
+        return -1;
+    }
+    pos += used;
+
+    size_t out_pos = 0;
+    for (;;) {
+        uint64_t raw_size, payload_size;
+        used = decode_varint(src + pos, size - pos, &raw_size);
+        if (used == 0) {
+            fprintf(stderr, "Error reading block header\n");
+            return -1;
+        }
+        pos += used;
+        if (raw_size == 0) {
+            break; // End of blocks; the index is not needed here
+        }
+
+        if (pos == size || (used = decode_varint(src + pos + 1, size - pos - 1, &payload_size)) == 0) {
+            fprintf(stderr, "Error reading block header\n");
+            return -1;
+        }
+        int type = src[pos];
+        pos += 1 + used;
+        if (check_block_header(raw_size, type, payload_size, block_size) != 0) {
+            return -1;
+        }
+        if (payload_size > size - pos) {
+            fprintf(stderr, "Unexpected end of data during decompression\n");
+            return -1;
+        }
+        if (raw_size > capacity - out_pos) {
+            fprintf(stderr, "Huffman output buffer too small\n");
+            return -1;
+        }
+
+        if (type == HUFFMAN_BLOCK_STORED) {
+            memcpy(dst + out_pos, src + pos, raw_size);
+        } else {
+            int stream_count = type == HUFFMAN_BLOCK_CODED_4X ? HUFFMAN_STREAM_COUNT : 1;
+            if (huffman_decode_block(src + pos, payload_size, dst + out_pos, raw_size, stream_count) != 0) {
                 return -1;
             }
-            
-            // Reset to root for next character
-            current = root;
-            decoded_bytes++;
         }
+        pos += payload_size;
+        out_pos += raw_size;
     }
-    
-    // Clean up
-    free_huffman_tree(root);
-    
+
+    *decompressed_size = out_pos;
     return 0;
-}
\ No newline at end of file
+}
+
+// Largest stored block (header plus payload) for a block size
+#define MAX_STORED_BLOCK(block_size) ((block_size) + 2 * VARINT_MAX_BYTES + 1)
+
+// One block being decoded: read from the input at input_offset and
+// written to the output at output_offset
+typedef struct {
+    ThreadPoolTask task;
+    int busy;
+    int result;
+    int input_fd;
+    int output_fd;
+    off_t input_offset;
+    off_t output_offset;
+    size_t stored_size;
+    size_t raw_size;
+    uint8_t *payload;
+    uint8_t *output;
+} DecodeJob;
+
+// Reads exactly size bytes at offset. Returns 0 on success, -1 on error.
+static int pread_full(int fd, uint8_t *buffer, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = pread(fd, buffer, size, offset);
+        if (n <= 0) {
+            return -1;
+        }
+        buffer += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Writes exactly size bytes at offset. Returns 0 on success, -1 on error.
+static int pwrite_full(int fd, const uint8_t *buffer, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, buffer, size, offset);
+        if (n <= 0) {
+            return -1;
+        }
+        buffer += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Decodes one block of a block container, header included, as listed in
+// the container's index. Returns 0 on success, -1 on error.
+int huffman_decode_indexed_block(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size) {
+    // Block header, which must agree with the index
+    uint64_t header_raw_size, payload_size;
+    size_t pos = decode_varint(src, size, &header_raw_size);
+    if (pos == 0 || pos >= size || header_raw_size != raw_size) {
+        fprintf(stderr, "Invalid Huffman block header\n");
+        return -1;
+    }
+    int type = src[pos++];
+    size_t length = decode_varint(src + pos, size - pos, &payload_size);
+    pos += length;
+    if (length == 0 || payload_size != size - pos ||
+        (type == HUFFMAN_BLOCK_STORED && payload_size != raw_size) ||
+        (type != HUFFMAN_BLOCK_STORED && type != HUFFMAN_BLOCK_CODED && type != HUFFMAN_BLOCK_CODED_4X)) {
+        fprintf(stderr, "Invalid Huffman block header\n");
+        return -1;
+    }
+
+    if (type == HUFFMAN_BLOCK_STORED) {
+        memcpy(dst, src + pos, raw_size);
+        return 0;
+    }
+    int stream_count = type == HUFFMAN_BLOCK_CODED_4X ? HUFFMAN_STREAM_COUNT : 1;
+    return huffman_decode_block(src + pos, payload_size, dst, raw_size, stream_count);
+}
+
+// Thread pool task: reads, decodes and writes one indexed block
+static void decode_block_job(void *arg) {
+    DecodeJob *job = arg;
+    job->result = -1;
+
+    if (pread_full(job->input_fd, job->payload, job->stored_size, job->input_offset) != 0) {
+        fprintf(stderr, "Error reading compressed block\n");
+        return;
+    }
+    if (huffman_decode_indexed_block(job->payload, job->stored_size, job->output, job->raw_size) != 0) {
+        return;
+    }
+
+    if (pwrite_full(job->output_fd, job->output, job->raw_size, job->output_offset) != 0) {
+        fprintf(stderr, "Error writing decompressed data\n");
+        return;
+    }
+    job->result = 0;
+}
+
+// Loads the block index of a container whose header ends at blocks_start
+// and whose trailer ends at file_size. The index must describe exactly the
+// bytes in between, otherwise the stream is not indexed or not at the end
+// of the file. Returns the block count, or 0 when no usable index exists.
+static size_t load_block_index(int fd, off_t blocks_start, off_t file_size,
+                               uint64_t block_size, uint64_t **sizes_out) {
+    uint8_t footer[HUFFMAN_INDEX_FOOTER_SIZE];
+    if (file_size < blocks_start + 1 + HUFFMAN_INDEX_FOOTER_SIZE ||
+        pread_full(fd, footer, sizeof(footer), file_size - HUFFMAN_INDEX_FOOTER_SIZE) != 0 ||
+        memcmp(footer + 4, HUFFMAN_INDEX_MAGIC, 4) != 0) {
+        return 0;
+    }
+
+    uint32_t index_size = (uint32_t)footer[0] | ((uint32_t)footer[1] << 8) |
+                          ((uint32_t)footer[2] << 16) | ((uint32_t)footer[3] << 24);
+    off_t index_start = file_size - HUFFMAN_INDEX_FOOTER_SIZE - (off_t)index_size;
+    if (index_size == 0 || index_start < blocks_start + 1) {
+        return 0;
+    }
+
+    uint8_t *index = malloc(index_size);
+    if (!index || pread_full(fd, index, index_size, index_start) != 0) {
+        free(index);
+        return 0;
+    }
+
+    uint64_t block_count;
+    size_t pos = decode_varint(index, index_size, &block_count);
+    uint64_t *sizes = NULL;
+    if (pos > 0 && block_count > 0 && block_count <= index_size / 2) {
+        sizes = malloc(2 * block_count * sizeof(uint64_t));
+    }
+
+    // Blocks, then the one-byte end marker, then the index
+    uint64_t stored_total = 0;
+    for (uint64_t i = 0; sizes && i < 2 * block_count; i++) {
+        size_t length = decode_varint(index + pos, index_size - pos, &sizes[i]);
+        uint64_t limit = (i & 1) ? block_size : MAX_STORED_BLOCK(block_size);
+        if (length == 0 || sizes[i] == 0 || sizes[i] > limit) {
+            free(sizes);
+            sizes = NULL;
+            break;
+        }
+        pos += length;
+        if (!(i & 1)) {
+            stored_total += sizes[i];
+        }
+    }
+    free(index);
+
+    if (!sizes || pos != index_size || (off_t)stored_total != index_start - 1 - blocks_start) {
+        free(sizes);
+        return 0;
+    }
+
+    *sizes_out = sizes;
+    return (size_t)block_count;
+}
+
+// Decompresses using up to thread_count threads. Block containers with an
+// index are decoded in parallel when the input holds the stream up to its
+// end and both files are seekable regular files; everything else falls back
+// to huffman_decompress.
+// Returns 0 on success, -1 on error.
+int huffman_decompress_parallel(FILE *input_file, FILE *output_file, int thread_count) {
+    return huffman_decompress_parallel_until(input_file, output_file, thread_count, -1);
+}
+
+// Same as huffman_decompress_parallel for a stream that ends at stream_end
+// (the end of the input when negative).
+// Returns 0 on success, -1 on error.
+int huffman_decompress_parallel_until(FILE *input_file, FILE *output_file, int thread_count, off_t stream_end) {
+    int result = huffman_decompress_indexed(input_file, output_file, thread_count, stream_end, UINT64_MAX);
+    return result == 1 ? huffman_decompress(input_file, output_file) : result;
+}
+
+// Decodes an indexed block container in parallel, refusing one that
+// decodes to more than max_size bytes.
+// Returns 0 on success, -1 on error, 1 if the stream cannot be decoded in
+// parallel, with the input left where it was.
+int huffman_decompress_indexed(FILE *input_file, FILE *output_file, int thread_count, off_t stream_end,
+                               uint64_t max_size) {
+    struct stat input_stat, output_stat;
+    int input_fd = fileno(input_file);
+    int output_fd = fileno(output_file);
+    off_t stream_start = ftello(input_file);
+
+    if (thread_count <= 1 || stream_start < 0 ||
+        fstat(input_fd, &input_stat) != 0 || !S_ISREG(input_stat.st_mode) ||
+        fstat(output_fd, &output_stat) != 0 || !S_ISREG(output_stat.st_mode)) {
+        return 1;
+    }
+    if (stream_end < 0 || stream_end > input_stat.st_size) {
+        stream_end = input_stat.st_size;
+    }
+
+    // Only indexed block containers can be split between threads
+    uint8_t header[HUFFMAN_MAGIC_SIZE + 2];
+    uint64_t block_size = 0;
+    uint64_t *sizes = NULL;
+    size_t block_count = 0;
+    if (fread(header, 1, sizeof(header), input_file) == sizeof(header) &&
+        memcmp(header, HUFFMAN_BLOCK_MAGIC, HUFFMAN_MAGIC_SIZE) == 0 &&
+        header[HUFFMAN_MAGIC_SIZE] == HUFFMAN_BLOCK_VERSION &&
+        (header[HUFFMAN_MAGIC_SIZE + 1] & HUFFMAN_FLAG_BLOCK_INDEX) &&
+        read_varint(input_file, &block_size) == 0 &&
+        block_size > 0 && block_size <= HUFFMAN_MAX_BLOCK_SIZE) {
+        block_count = load_block_index(input_fd, ftello(input_file), stream_end, block_size, &sizes);
+    }
+    if (block_count == 0) {
+        if (fseeko(input_file, stream_start, SEEK_SET) != 0) {
+            perror("Error seeking in input file");
+            return -1;
+        }
+        return 1;
+    }
+    off_t blocks_start = ftello(input_file);
+
+    // Size the output up front so every block can be written in place
+    uint64_t total_size = 0;
+    for (size_t i = 0; i < block_count; i++) {
+        total_size += sizes[2 * i + 1];
+    }
+    if (total_size > max_size) {
+        fprintf(stderr, "Huffman block index exceeds the expected size\n");
+        free(sizes);
+        return -1;
+    }
+    off_t output_start;
+    if (fflush(output_file) != 0 || (output_start = ftello(output_file)) < 0 ||
+        (output_stat.st_size < output_start + (off_t)total_size &&
+         ftruncate(output_fd, output_start + (off_t)total_size) != 0)) {
+        perror("Error preparing output file");
+        free(sizes);
+        return -1;
+    }
+
+    ThreadPool *pool = thread_pool_create(thread_count);
+    int job_count = pool ? thread_count + 1 : 1;
+    DecodeJob *jobs = calloc(job_count, sizeof(DecodeJob));
+    int result = jobs ? 0 : -1;
+    for (int i = 0; result == 0 && i < job_count; i++) {
+        jobs[i].payload = malloc(MAX_STORED_BLOCK(block_size));
+        jobs[i].output = malloc(block_size);
+        if (!jobs[i].payload || !jobs[i].output) {
+            result = -1;
+        }
+    }
+    if (result != 0) {
+        fprintf(stderr, "Memory allocation failed for Huffman blocks\n");
+    }
+
+    // Blocks go round a ring of jobs; a job is reused once its block is done
+    off_t input_offset = blocks_start;
+    off_t output_offset = output_start;
+    for (size_t i = 0; result == 0 && i < block_count; i++) {
+        DecodeJob *job = &jobs[i % job_count];
+        if (job->busy) {
+            thread_pool_wait_task(pool, &job->task);
+            job->busy = 0;
+            if (job->result != 0) {
+                result = -1;
+                break;
+            }
+        }
+
+        job->input_fd = input_fd;
+        job->output_fd = output_fd;
+        job->input_offset = input_offset;
+        job->output_offset = output_offset;
+        job->stored_size = sizes[2 * i];
+        job->raw_size = sizes[2 * i + 1];
+        thread_pool_submit(pool, &job->task, decode_block_job, job);
+        job->busy = 1;
+
+        input_offset += (off_t)job->stored_size;
+        output_offset += (off_t)job->raw_size;
+    }
+
+    for (int i = 0; jobs && i < job_count; i++) {
+        if (jobs[i].busy) {
+            thread_pool_wait_task(pool, &jobs[i].task);
+            if (jobs[i].result != 0) {
+                result = -1;
+            }
+        }
+        free(jobs[i].payload);
+        free(jobs[i].output);
+    }
+    free(jobs);
+    free(sizes);
+    thread_pool_destroy(pool);
+
+    // Leave both files positioned after the stream, as the serial decoder does
+    if (result == 0 && (fseeko(input_file, stream_end, SEEK_SET) != 0 ||
+                        fseeko(output_file, output_start + (off_t)total_size, SEEK_SET) != 0)) {
+        perror("Error seeking after decompression");
+        result = -1;
+    }
+
+    return result;
+}
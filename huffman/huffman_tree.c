@@ -0,0 +1,307 @@
+#include "huffman.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Package-merge item: a leaf (symbol >= 0) or a package of two items
+// from the previous level (symbol == -1)
+struct PackageItem {
+    uint64_t weight;
+    int symbol;
+};
+
+// Allocates a builder. Returns NULL on allocation failure.
+HuffmanBuilder* huffman_builder_create(void) {
+    HuffmanBuilder* builder = malloc(sizeof(HuffmanBuilder));
+    if (!builder) return NULL;
+
+    builder->package_items = malloc((size_t)HUFFMAN_MAX_CODE_LENGTH * 2 * MAX_CHARS * sizeof(PackageItem));
+    if (!builder->package_items) {
+        free(builder);
+        return NULL;
+    }
+    builder->node_count = 0;
+    builder->root = -1;
+
+    return builder;
+}
+
+// Frees a builder and its scratch space
+void huffman_builder_free(HuffmanBuilder* builder) {
+    if (builder == NULL) return;
+
+    free(builder->package_items);
+    free(builder);
+}
+
+// Orders sort keys of the form (frequency << 8) | symbol
+static int compare_keys(const void* a, const void* b) {
+    uint64_t ka = *(const uint64_t*)a;
+    uint64_t kb = *(const uint64_t*)b;
+    return (ka > kb) - (ka < kb);
+}
+
+// Places one leaf per used symbol at the start of the arena, in order of
+// increasing frequency (ties broken by symbol value).
+// Returns the number of leaves.
+static int add_sorted_leaves(HuffmanBuilder* builder, const unsigned* frequencies) {
+    uint64_t keys[MAX_CHARS];
+    int leaf_count = 0;
+
+    for (int i = 0; i < MAX_CHARS; i++) {
+        if (frequencies[i] > 0) {
+            keys[leaf_count++] = ((uint64_t)frequencies[i] << 8) | (uint64_t)i;
+        }
+    }
+    qsort(keys, leaf_count, sizeof(uint64_t), compare_keys);
+
+    for (int i = 0; i < leaf_count; i++) {
+        HuffmanNode* node = &builder->nodes[i];
+        node->frequency = keys[i] >> 8;
+        node->character = (uint8_t)(keys[i] & 0xFF);
+        node->left = -1;
+        node->right = -1;
+    }
+    builder->node_count = leaf_count;
+    builder->root = leaf_count > 0 ? 0 : -1;
+
+    return leaf_count;
+}
+
+// Appends an internal node joining two existing nodes. Returns its index.
+static int add_parent(HuffmanBuilder* builder, int left, int right) {
+    int index = builder->node_count++;
+    HuffmanNode* node = &builder->nodes[index];
+    node->frequency = builder->nodes[left].frequency + builder->nodes[right].frequency;
+    node->character = 0;
+    node->left = (int16_t)left;
+    node->right = (int16_t)right;
+    return index;
+}
+
+// Builds a Huffman tree with the two-queue method: the sorted leaves form
+// one queue and the internal nodes, which are created in non-decreasing
+// order of frequency, form the other.
+// Returns 0 on success, -1 if no symbol is used.
+int huffman_builder_build(HuffmanBuilder* builder, const unsigned* frequencies) {
+    int leaf_count = add_sorted_leaves(builder, frequencies);
+    if (leaf_count == 0) return -1;
+
+    int next_leaf = 0;
+    int next_internal = leaf_count;
+
+    for (int merges = 0; merges < leaf_count - 1; merges++) {
+        int children[2];
+        for (int c = 0; c < 2; c++) {
+            // Prefer leaves on ties to keep the tree shallow
+            if (next_internal >= builder->node_count ||
+                (next_leaf < leaf_count &&
+                 builder->nodes[next_leaf].frequency <= builder->nodes[next_internal].frequency)) {
+                children[c] = next_leaf++;
+            } else {
+                children[c] = next_internal++;
+            }
+        }
+        builder->root = add_parent(builder, children[0], children[1]);
+    }
+
+    return 0;
+}
+
+// Builds the tree exactly as the original encoder did, which legacy
+// streams depend on: the sorted node list is consumed from the front, each
+// parent is appended at the back and the front node is then bubbled
+// forward while it is larger than its successor.
+// Returns 0 on success, -1 if no symbol is used.
+int huffman_builder_build_legacy(HuffmanBuilder* builder, const unsigned* frequencies) {
+    // Symbol order from a stable sort, as the original bubble sort produced
+    int leaf_count = add_sorted_leaves(builder, frequencies);
+    if (leaf_count == 0) return -1;
+
+    int16_t queue[HUFFMAN_MAX_NODES];
+    int head = 0, tail = 0;
+    for (int i = 0; i < leaf_count; i++) {
+        queue[tail++] = (int16_t)i;
+    }
+
+    while (tail - head > 1) {
+        int parent = add_parent(builder, queue[head], queue[head + 1]);
+        head += 2;
+        queue[tail++] = (int16_t)parent;
+
+        for (int i = head; i < tail - 1; i++) {
+            if (builder->nodes[queue[i]].frequency > builder->nodes[queue[i + 1]].frequency) {
+                int16_t temp = queue[i];
+                queue[i] = queue[i + 1];
+                queue[i + 1] = temp;
+            } else {
+                break; // The remaining nodes are already sorted
+            }
+        }
+    }
+    builder->root = queue[head];
+
+    return 0;
+}
+
+// Assigns codes following the tree shape: 0 for left, 1 for right. Parents
+// always come after their children in the arena, so walking the arena
+// backwards from the root visits every node after its parent.
+void huffman_builder_codes(const HuffmanBuilder* builder, HuffmanCode* codes) {
+    uint32_t node_codes[HUFFMAN_MAX_NODES];
+    uint8_t node_lengths[HUFFMAN_MAX_NODES];
+
+    memset(codes, 0, MAX_CHARS * sizeof(HuffmanCode));
+    if (builder->root < 0) return;
+
+    node_codes[builder->root] = 0;
+    node_lengths[builder->root] = 0;
+
+    for (int i = builder->root; i >= 0; i--) {
+        const HuffmanNode* node = &builder->nodes[i];
+        if (node->left < 0) {
+            codes[node->character].code = node_codes[i];
+            codes[node->character].code_length = node_lengths[i];
+            continue;
+        }
+
+        node_codes[node->left] = node_codes[i] << 1;
+        node_codes[node->right] = (node_codes[i] << 1) | 1;
+        node_lengths[node->left] = node_lengths[i] + 1;
+        node_lengths[node->right] = node_lengths[i] + 1;
+    }
+}
+
+// Computes optimal length-limited code lengths with the package-merge
+// algorithm, reusing the builder's sorted leaves.
+// Returns 0 on success, -1 on error.
+static int package_merge(HuffmanBuilder* builder, int leaf_count, uint8_t* lengths, int max_length) {
+    if (leaf_count > (1 << max_length)) {
+        return -1;
+    }
+
+    // One list per level, each holding at most 2n - 1 items
+    const HuffmanNode* leaves = builder->nodes;
+    PackageItem* lists = builder->package_items;
+    int sizes[HUFFMAN_MAX_CODE_LENGTH];
+
+    for (int i = 0; i < leaf_count; i++) {
+        lists[i].weight = leaves[i].frequency;
+        lists[i].symbol = leaves[i].character;
+    }
+    sizes[0] = leaf_count;
+
+    // Merge the leaves with the pairwise packages of the previous level
+    for (int level = 1; level < max_length; level++) {
+        PackageItem* prev = lists + (size_t)(level - 1) * 2 * MAX_CHARS;
+        PackageItem* list = lists + (size_t)level * 2 * MAX_CHARS;
+        int packages = sizes[level - 1] / 2;
+        int leaf = 0, package = 0, count = 0;
+
+        while (leaf < leaf_count || package < packages) {
+            uint64_t package_weight = package < packages
+                ? prev[2 * package].weight + prev[2 * package + 1].weight : 0;
+            if (package >= packages || (leaf < leaf_count && leaves[leaf].frequency <= package_weight)) {
+                list[count].weight = leaves[leaf].frequency;
+                list[count].symbol = leaves[leaf].character;
+                leaf++;
+            } else {
+                list[count].weight = package_weight;
+                list[count].symbol = -1;
+                package++;
+            }
+            count++;
+        }
+        sizes[level] = count;
+    }
+
+    // Select the 2n - 2 cheapest items of the last level; every selected
+    // package expands into the first items of the level below it
+    memset(lengths, 0, MAX_CHARS);
+    int active = 2 * leaf_count - 2;
+    for (int level = max_length - 1; level >= 0; level--) {
+        PackageItem* list = lists + (size_t)level * 2 * MAX_CHARS;
+        int packages = 0;
+        for (int i = 0; i < active; i++) {
+            if (list[i].symbol >= 0) {
+                lengths[list[i].symbol]++;
+            } else {
+                packages++;
+            }
+        }
+        active = 2 * packages;
+    }
+
+    return 0;
+}
+
+// Computes code lengths no longer than max_length for the given frequencies.
+// Returns 0 on success, -1 on error.
+int huffman_code_lengths(HuffmanBuilder* builder, const unsigned* frequencies,
+                         uint8_t* lengths, int max_length) {
+    memset(lengths, 0, MAX_CHARS);
+    if (max_length > HUFFMAN_MAX_CODE_LENGTH) {
+        return -1;
+    }
+    if (huffman_builder_build(builder, frequencies) != 0) {
+        return 0; // No symbols, no codes
+    }
+
+    int leaf_count = (builder->node_count + 1) / 2;
+    if (leaf_count == 1) {
+        lengths[builder->nodes[0].character] = 1;
+        return 0;
+    }
+
+    // Depths in the tree, computed top-down from the root
+    uint8_t depths[HUFFMAN_MAX_NODES];
+    int fits = 1;
+    depths[builder->root] = 0;
+    for (int i = builder->root; i >= 0; i--) {
+        const HuffmanNode* node = &builder->nodes[i];
+        if (node->left < 0) {
+            lengths[node->character] = depths[i];
+            if (depths[i] > max_length) {
+                fits = 0;
+            }
+        } else {
+            depths[node->left] = depths[i] + 1;
+            depths[node->right] = depths[i] + 1;
+        }
+    }
+
+    // Plain Huffman lengths are optimal whenever they fit the limit
+    if (fits) {
+        return 0;
+    }
+    return package_merge(builder, leaf_count, lengths, max_length);
+}
+
+// Assigns canonical codes from code lengths (at most HUFFMAN_MAX_CODE_LENGTH).
+// Returns 0 on success, -1 if the lengths do not form a valid prefix code.
+int assign_canonical_codes(const uint8_t* lengths, HuffmanCode* codes) {
+    unsigned length_counts[HUFFMAN_MAX_CODE_LENGTH + 1] = {0};
+    for (int i = 0; i < MAX_CHARS; i++) {
+        if (lengths[i] > HUFFMAN_MAX_CODE_LENGTH) {
+            return -1;
+        }
+        length_counts[lengths[i]]++;
+    }
+
+    // Reject over-subscribed lengths (Kraft sum above one)
+    uint32_t next_code[HUFFMAN_MAX_CODE_LENGTH + 1] = {0};
+    uint32_t code = 0;
+    for (int length = 1; length <= HUFFMAN_MAX_CODE_LENGTH; length++) {
+        code = (code + (length > 1 ? length_counts[length - 1] : 0)) << 1;
+        next_code[length] = code;
+        if (code + length_counts[length] > (1u << length)) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < MAX_CHARS; i++) {
+        codes[i].code_length = lengths[i];
+        codes[i].code = lengths[i] ? next_code[lengths[i]]++ : 0;
+    }
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef HYBRID_H
+#define HYBRID_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "../huffman/huffman.h"
+#include "../reports/compression_report.h"
+#include "../utils/block_table.h"
+
+// Hybrid block container layout:
+//   "HYBB" | version | varint block size |
+//   per block: varint raw size | block type | varint payload size | payload
+//   varint 0 (end of blocks)
+// Every block picks its own coding, so a file that mixes long runs with
+// dense text gets RLE where it pays off and Huffman elsewhere. The type
+// tags make the output self-describing.
+#define HYBRID_MAGIC "HYBB"
+#define HYBRID_MAGIC_SIZE 4
+#define HYBRID_VERSION 1
+
+// Block types
+#define HYBRID_BLOCK_STORED 0       // Payload is the raw data
+#define HYBRID_BLOCK_RLE 1          // Payload is an RLE stream
+#define HYBRID_BLOCK_HUFFMAN 2      // Payload is a Huffman block
+#define HYBRID_BLOCK_RLE_HUFFMAN 3  // Varint RLE stream size, then the RLE stream as a Huffman block
+#define HYBRID_BLOCK_TYPES 4
+
+// Huffman blocks of at least HUFFMAN_MULTI_STREAM_MIN_SIZE bytes (the RLE
+// stream size for RLE_HUFFMAN) are coded as HUFFMAN_STREAM_COUNT streams.
+
+// Block sizes selected by the compression level. Smaller blocks follow
+// changes in the data more closely.
+#define HYBRID_BLOCK_SIZE_FAST (1024 * 1024)
+#define HYBRID_BLOCK_SIZE_BALANCED (512 * 1024)
+#define HYBRID_BLOCK_SIZE_MAX (256 * 1024)
+
+// Streaming hybrid container encoder writing to caller-provided buffers.
+// Input is collected into blocks of block_size bytes; each block is coded
+// once it fills up, and the last one by hybrid_encoder_finish.
+typedef struct {
+    HuffmanBuilder *builder;
+    size_t block_size;
+    uint8_t *block;          // Pending input, allocated on first use
+    size_t block_fill;
+    uint8_t *rle;            // Candidate RLE stream of a block
+    size_t rle_capacity;
+    uint8_t *output;         // Candidate Huffman payload of a block
+    int header_written;
+} HybridEncoder;
+
+// Block size used for a compression level
+size_t hybrid_block_size(CompressionLevel level);
+
+// Compresses the input in blocks of block_size bytes, each coded the way a
+// sample-based estimate predicts to be smallest. Up to thread_count blocks
+// are encoded concurrently and written in input order. If block_counts is
+// not NULL it receives the number of blocks of each type, and if table is
+// not NULL the stored and raw size of every block.
+// Returns 0 on success, -1 on error.
+int hybrid_compress(FILE *input_file, FILE *output_file, size_t block_size, int thread_count,
+                    ProgressCallback progress_fn, void *user_data, size_t *block_counts, BlockTable *table);
+
+// Largest container hybrid_compress_buffer writes for size bytes of input
+size_t hybrid_compress_bound(size_t size, size_t block_size);
+
+// Compresses size bytes of src into a hybrid container in dst, which holds
+// capacity bytes (hybrid_compress_bound is always enough), and stores the
+// container size in compressed_size. The output is the same as
+// hybrid_compress writes. Returns 0 on success, -1 on error or if the
+// output does not fit.
+int hybrid_compress_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                           size_t block_size, size_t *compressed_size);
+
+// Decompresses a hybrid block container, dispatching each block to the
+// decoder its type names. Returns 0 on success, -1 on error.
+int hybrid_decompress(FILE *input_file, FILE *output_file);
+
+// Decodes one block of a hybrid container, header included, whose stored
+// and raw size come from a block table into raw_size bytes of dst.
+// Returns 0 on success, -1 on error.
+int hybrid_decode_indexed_block(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size);
+
+// Decodes a hybrid block container of size bytes from src into dst, which
+// holds capacity bytes, and stores the decoded size.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int hybrid_decompress_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                             size_t *decompressed_size);
+
+// Initializes a streaming encoder. Returns 0 on success, -1 on error.
+int hybrid_encoder_init(HybridEncoder *encoder, size_t block_size);
+
+// Largest output of hybrid_encoder_update with size bytes of input, or of
+// hybrid_encoder_finish when size is 0.
+size_t hybrid_encoder_bound(const HybridEncoder *encoder, size_t size);
+
+// Encodes size more bytes of src, writing every completed block to dst,
+// which holds capacity bytes. Stores the number of bytes written.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int hybrid_encoder_update(HybridEncoder *encoder, const uint8_t *src, size_t size,
+                          uint8_t *dst, size_t capacity, size_t *written);
+
+// Encodes the last block and writes the end marker to dst. Stores the
+// number of bytes written.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int hybrid_encoder_finish(HybridEncoder *encoder, uint8_t *dst, size_t capacity, size_t *written);
+
+// Releases the encoder's builder and buffers.
+void hybrid_encoder_free(HybridEncoder *encoder);
+
+#endif // HYBRID_H
@@ -0,0 +1,412 @@
+#include "hybrid.h"
+#include "../codec/codec.h"
+#include "../rle/rle.h"
+#include "../utils/block_pipeline.h"
+#include "../utils/varint.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Block size used for a compression level
+size_t hybrid_block_size(CompressionLevel level) {
+    switch (level) {
+        case COMPRESSION_FAST:
+            return HYBRID_BLOCK_SIZE_FAST;
+        case COMPRESSION_MAX:
+            return HYBRID_BLOCK_SIZE_MAX;
+        case COMPRESSION_BALANCED:
+        default:
+            return HYBRID_BLOCK_SIZE_BALANCED;
+    }
+}
+
+// Largest container header: magic, version and block size
+#define HYBRID_HEADER_MAX (HYBRID_MAGIC_SIZE + 1 + VARINT_MAX_BYTES)
+
+// Largest block header: raw size, type and payload size
+#define HYBRID_BLOCK_HEADER_MAX (2 * VARINT_MAX_BYTES + 1)
+
+// One block in flight: its input, the candidate encodings and the one chosen
+typedef struct {
+    BlockPipelineJob base;
+    HuffmanBuilder *builder;
+    uint8_t *rle;           // RLE stream of the input
+    size_t rle_capacity;
+    uint8_t *output;        // Huffman-coded payload
+    const uint8_t *payload; // Chosen payload: input, rle or output
+    size_t payload_size;
+    int type;
+} HybridJob;
+
+// Huffman codes size bytes of src as a block of the given type and keeps
+// the result if it is smaller than the current choice.
+static void try_huffman(HybridJob *job, const uint8_t *src, size_t size, int type) {
+    size_t prefix = 0;
+    if (type == HYBRID_BLOCK_RLE_HUFFMAN) {
+        prefix = encode_varint(size, job->output);
+    }
+    if (job->payload_size <= prefix) {
+        return;
+    }
+
+    int stream_count = size >= HUFFMAN_MULTI_STREAM_MIN_SIZE ? HUFFMAN_STREAM_COUNT : 1;
+    size_t encoded_size;
+    if (huffman_encode_block(job->builder, src, size, job->output + prefix, job->payload_size - prefix,
+                             stream_count, &encoded_size) == 0 &&
+        prefix + encoded_size < job->payload_size) {
+        job->type = type;
+        job->payload = job->output;
+        job->payload_size = prefix + encoded_size;
+    }
+}
+
+// Thread pool task: picks and applies the coding of a block. The estimate
+// decides between RLE and Huffman; an RLE stream is Huffman coded as well
+// when its own estimate says that pays off. Blocks that no coding makes
+// smaller are stored.
+static void encode_hybrid_block(void *arg) {
+    HybridJob *job = arg;
+    const uint8_t *src = job->base.input;
+    size_t size = job->base.input_size;
+
+    job->type = HYBRID_BLOCK_STORED;
+    job->payload = src;
+    job->payload_size = size;
+
+    CodecEstimate estimate;
+    codec_estimate_buffer(src, size, &estimate);
+    if (estimate.huffman_size <= estimate.rle_size) {
+        try_huffman(job, src, size, HYBRID_BLOCK_HUFFMAN);
+        return;
+    }
+
+    size_t rle_size;
+    if (rle_compress_buffer(src, size, job->rle, job->rle_capacity, &rle_size) != 0) {
+        return;
+    }
+    if (rle_size < job->payload_size) {
+        job->type = HYBRID_BLOCK_RLE;
+        job->payload = job->rle;
+        job->payload_size = rle_size;
+    }
+
+    codec_estimate_buffer(job->rle, rle_size, &estimate);
+    if (estimate.huffman_size < rle_size) {
+        try_huffman(job, job->rle, rle_size, HYBRID_BLOCK_RLE_HUFFMAN);
+    }
+}
+
+// Writes the container header to dst, which must hold HYBRID_HEADER_MAX
+// bytes. Returns the number of bytes written.
+static size_t write_container_header(uint8_t *dst, size_t block_size) {
+    memcpy(dst, HYBRID_MAGIC, HYBRID_MAGIC_SIZE);
+    dst[HYBRID_MAGIC_SIZE] = HYBRID_VERSION;
+    return HYBRID_MAGIC_SIZE + 1 + encode_varint(block_size, dst + HYBRID_MAGIC_SIZE + 1);
+}
+
+// Writes the header of an encoded block to dst, which must hold
+// HYBRID_BLOCK_HEADER_MAX bytes. Returns the number of bytes written.
+static size_t write_block_header(uint8_t *dst, const HybridJob *job) {
+    size_t size = encode_varint(job->base.input_size, dst);
+    dst[size++] = (uint8_t)job->type;
+    size += encode_varint(job->payload_size, dst + size);
+    return size;
+}
+
+// Pipeline callback: writes a finished block with its header, counts its
+// type and stores the number of bytes written in stored_size.
+// Returns 0 on success, -1 on error.
+static int write_hybrid_block(FILE *output_file, const BlockPipelineJob *base, size_t *stored_size, void *context) {
+    const HybridJob *job = (const HybridJob *)base;
+    size_t *block_counts = context;
+
+    uint8_t header[HYBRID_BLOCK_HEADER_MAX];
+    size_t header_size = write_block_header(header, job);
+
+    if (fwrite(header, 1, header_size, output_file) != header_size ||
+        fwrite(job->payload, 1, job->payload_size, output_file) != job->payload_size) {
+        return -1;
+    }
+    if (block_counts) {
+        block_counts[job->type]++;
+    }
+    *stored_size = header_size + job->payload_size;
+    return 0;
+}
+
+// Pipeline callback: sets up the candidate buffers and builder of a job
+static int init_hybrid_job(BlockPipelineJob *base, size_t block_size, int job_count, void *context) {
+    (void)job_count;
+    (void)context;
+    HybridJob *job = (HybridJob *)base;
+    job->rle_capacity = rle_compress_bound(block_size);
+    job->rle = malloc(job->rle_capacity);
+    job->output = malloc(block_size);
+    job->builder = huffman_builder_create();
+    return job->rle && job->output && job->builder ? 0 : -1;
+}
+
+// Pipeline callback: frees the buffers and builder of a job
+static void free_hybrid_job(BlockPipelineJob *base, void *context) {
+    (void)context;
+    HybridJob *job = (HybridJob *)base;
+    free(job->rle);
+    free(job->output);
+    huffman_builder_free(job->builder);
+}
+
+// Pipeline callback: writes the container header
+static int write_hybrid_header(FILE *output_file, size_t block_size, size_t *header_size, void *context) {
+    (void)context;
+    uint8_t header[HYBRID_HEADER_MAX];
+    *header_size = write_container_header(header, block_size);
+    if (fwrite(header, 1, *header_size, output_file) != *header_size) {
+        perror("Error writing hybrid header");
+        return -1;
+    }
+    return 0;
+}
+
+// Compresses the input in blocks, each coded the way it compresses best.
+// The blocks go through the block pipeline, which encodes them on the pool
+// and writes them in order. Returns 0 on success, -1 on error.
+int hybrid_compress(FILE *input_file, FILE *output_file, size_t block_size, int thread_count,
+                    ProgressCallback progress_fn, void *user_data, size_t *block_counts, BlockTable *table) {
+    if (block_size == 0 || block_size > HUFFMAN_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Invalid hybrid block size\n");
+        return -1;
+    }
+
+    if (block_counts) {
+        memset(block_counts, 0, HYBRID_BLOCK_TYPES * sizeof(size_t));
+    }
+
+    BlockPipeline pipeline = {
+        .job_size = sizeof(HybridJob),
+        .init_job = init_hybrid_job,
+        .free_job = free_hybrid_job,
+        .write_header = write_hybrid_header,
+        .encode = encode_hybrid_block,
+        .write_block = write_hybrid_block,
+        .context = block_counts,
+    };
+    BlockTable blocks = {0};
+    if (block_pipeline_run(&pipeline, input_file, output_file, block_size, thread_count,
+                           progress_fn, user_data, &blocks) != 0) {
+        return -1;
+    }
+
+    // End of blocks
+    int result = 0;
+    if (write_varint(output_file, 0) != 0) {
+        perror("Error writing compressed data");
+        result = -1;
+    }
+
+    if (result == 0 && table) {
+        *table = blocks;
+    } else {
+        block_table_free(&blocks);
+    }
+    return result;
+}
+
+// Encodes size bytes of src as one block with its header into dst, using
+// the buffers of job. Stores the number of bytes written.
+// Returns 0 on success, -1 if the block does not fit.
+static int emit_block(HybridJob *job, const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                      size_t *written) {
+    job->base.input = (uint8_t *)src;
+    job->base.input_size = size;
+    encode_hybrid_block(job);
+
+    uint8_t header[HYBRID_BLOCK_HEADER_MAX];
+    size_t header_size = write_block_header(header, job);
+    if (capacity < header_size + job->payload_size) {
+        fprintf(stderr, "Hybrid output buffer too small\n");
+        return -1;
+    }
+    memcpy(dst, header, header_size);
+    memcpy(dst + header_size, job->payload, job->payload_size);
+    *written = header_size + job->payload_size;
+    return 0;
+}
+
+// Largest container hybrid_compress_buffer writes for size bytes of input
+size_t hybrid_compress_bound(size_t size, size_t block_size) {
+    size_t block_count = block_size ? (size + block_size - 1) / block_size : 0;
+    return HYBRID_HEADER_MAX + size + block_count * HYBRID_BLOCK_HEADER_MAX + 1;
+}
+
+// Compresses size bytes of src into a hybrid container in dst. Runs the
+// streaming encoder with the block size cut down to small inputs, as
+// hybrid_compress does, so both write the same container.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int hybrid_compress_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                           size_t block_size, size_t *compressed_size) {
+    if (block_size == 0 || block_size > HUFFMAN_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Invalid hybrid block size\n");
+        return -1;
+    }
+    if (size < block_size) {
+        block_size = size > 0 ? size : 1;
+    }
+
+    HybridEncoder encoder;
+    if (hybrid_encoder_init(&encoder, block_size) != 0) {
+        return -1;
+    }
+    size_t written = 0;
+    size_t end_size = 0;
+    int result = hybrid_encoder_update(&encoder, src, size, dst, capacity, &written) == 0 &&
+                 hybrid_encoder_finish(&encoder, dst + written, capacity - written, &end_size) == 0 ? 0 : -1;
+    if (result == 0) {
+        *compressed_size = written + end_size;
+    }
+    hybrid_encoder_free(&encoder);
+    return result;
+}
+
+// Initializes a streaming encoder. Returns 0 on success, -1 on error.
+int hybrid_encoder_init(HybridEncoder *encoder, size_t block_size) {
+    memset(encoder, 0, sizeof(*encoder));
+    if (block_size == 0 || block_size > HUFFMAN_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Invalid hybrid block size\n");
+        return -1;
+    }
+    encoder->block_size = block_size;
+    encoder->rle_capacity = rle_compress_bound(block_size);
+    encoder->rle = malloc(encoder->rle_capacity);
+    encoder->output = malloc(block_size);
+    encoder->builder = huffman_builder_create();
+    if (!encoder->rle || !encoder->output || !encoder->builder) {
+        fprintf(stderr, "Memory allocation failed for hybrid blocks\n");
+        hybrid_encoder_free(encoder);
+        return -1;
+    }
+    return 0;
+}
+
+// Largest output of hybrid_encoder_update with size bytes of input, or of
+// hybrid_encoder_finish when size is 0.
+size_t hybrid_encoder_bound(const HybridEncoder *encoder, size_t size) {
+    size_t pending = encoder->block_fill + size;
+    size_t block_count = pending / encoder->block_size + 1;
+    return HYBRID_HEADER_MAX + pending + block_count * HYBRID_BLOCK_HEADER_MAX + 1;
+}
+
+// Encodes a block with the encoder's buffers into dst and advances pos.
+// Returns 0 on success, -1 if it does not fit.
+static int encoder_emit_block(HybridEncoder *encoder, const uint8_t *src, size_t size,
+                              uint8_t *dst, size_t capacity, size_t *pos) {
+    HybridJob job = {0};
+    job.builder = encoder->builder;
+    job.rle = encoder->rle;
+    job.rle_capacity = encoder->rle_capacity;
+    job.output = encoder->output;
+
+    size_t written;
+    if (emit_block(&job, src, size, dst + *pos, capacity - *pos, &written) != 0) {
+        return -1;
+    }
+    *pos += written;
+    return 0;
+}
+
+// Writes the container header before the first output and advances pos.
+// Returns 0 on success, -1 if it does not fit.
+static int emit_header_once(HybridEncoder *encoder, uint8_t *dst, size_t capacity, size_t *pos) {
+    if (encoder->header_written) {
+        return 0;
+    }
+    if (capacity < HYBRID_HEADER_MAX) {
+        fprintf(stderr, "Hybrid output buffer too small\n");
+        return -1;
+    }
+    *pos += write_container_header(dst, encoder->block_size);
+    encoder->header_written = 1;
+    return 0;
+}
+
+// Encodes size more bytes of src, writing every completed block to dst.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int hybrid_encoder_update(HybridEncoder *encoder, const uint8_t *src, size_t size,
+                          uint8_t *dst, size_t capacity, size_t *written) {
+    size_t pos = 0;
+    *written = 0;
+    if (emit_header_once(encoder, dst, capacity, &pos) != 0) {
+        return -1;
+    }
+
+    while (size > 0) {
+        const uint8_t *block = src;
+        size_t block_size = encoder->block_size;
+
+        if (encoder->block_fill == 0 && size >= block_size) {
+            // Whole blocks are encoded in place
+            src += block_size;
+            size -= block_size;
+        } else {
+            if (!encoder->block) {
+                encoder->block = malloc(encoder->block_size);
+                if (!encoder->block) {
+                    fprintf(stderr, "Memory allocation failed for hybrid blocks\n");
+                    return -1;
+                }
+            }
+            size_t take = block_size - encoder->block_fill;
+            if (take > size) {
+                take = size;
+            }
+            memcpy(encoder->block + encoder->block_fill, src, take);
+            encoder->block_fill += take;
+            src += take;
+            size -= take;
+            if (encoder->block_fill < block_size) {
+                break;
+            }
+            block = encoder->block;
+            encoder->block_fill = 0;
+        }
+
+        if (encoder_emit_block(encoder, block, block_size, dst, capacity, &pos) != 0) {
+            return -1;
+        }
+    }
+
+    *written = pos;
+    return 0;
+}
+
+// Encodes the last block and writes the end marker to dst.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int hybrid_encoder_finish(HybridEncoder *encoder, uint8_t *dst, size_t capacity, size_t *written) {
+    size_t pos = 0;
+    *written = 0;
+    if (emit_header_once(encoder, dst, capacity, &pos) != 0) {
+        return -1;
+    }
+
+    if (encoder->block_fill > 0) {
+        if (encoder_emit_block(encoder, encoder->block, encoder->block_fill, dst, capacity, &pos) != 0) {
+            return -1;
+        }
+        encoder->block_fill = 0;
+    }
+
+    if (pos == capacity) {
+        fprintf(stderr, "Hybrid output buffer too small\n");
+        return -1;
+    }
+    dst[pos++] = 0; // End of blocks
+    *written = pos;
+    return 0;
+}
+
+// Releases the encoder's builder and buffers.
+void hybrid_encoder_free(HybridEncoder *encoder) {
+    huffman_builder_free(encoder->builder);
+    free(encoder->block);
+    free(encoder->rle);
+    free(encoder->output);
+    memset(encoder, 0, sizeof(*encoder));
+}
@@ -0,0 +1,264 @@
+#include "hybrid.h"
+#include "../rle/rle.h"
+#include "../utils/varint.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Checks the header of a block: a known type, a raw size within the
+// container's block size and a payload no larger than the raw data, which
+// stored blocks hold exactly. Returns 0 if it is valid, -1 otherwise.
+static int check_hybrid_block_header(uint64_t raw_size, int type, uint64_t payload_size, uint64_t block_size) {
+    if (type < 0 || type >= HYBRID_BLOCK_TYPES || raw_size > block_size || payload_size > raw_size ||
+        (type == HYBRID_BLOCK_STORED && payload_size != raw_size)) {
+        fprintf(stderr, "Invalid hybrid block header\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Decodes the payload of a block of the given type into raw_size bytes of
+// dst. RLE_HUFFMAN blocks decode their RLE stream into scratch, which holds
+// scratch_capacity bytes. Returns 0 on success, -1 on error; every byte of
+// dst is written on success.
+static int decode_hybrid_block(int type, const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size,
+                               uint8_t *scratch, size_t scratch_capacity) {
+    size_t decoded_size = 0;
+    int stream_count;
+
+    switch (type) {
+        case HYBRID_BLOCK_STORED:
+            if (size != raw_size) {
+                fprintf(stderr, "Invalid hybrid stored block\n");
+                return -1;
+            }
+            memcpy(dst, src, size);
+            return 0;
+
+        case HYBRID_BLOCK_RLE:
+            if (rle_decompress_buffer(src, size, dst, raw_size, &decoded_size) != 0) {
+                return -1;
+            }
+            break;
+
+        case HYBRID_BLOCK_HUFFMAN:
+            stream_count = raw_size >= HUFFMAN_MULTI_STREAM_MIN_SIZE ? HUFFMAN_STREAM_COUNT : 1;
+            return huffman_decode_block(src, size, dst, raw_size, stream_count);
+
+        case HYBRID_BLOCK_RLE_HUFFMAN: {
+            uint64_t rle_size;
+            size_t used = decode_varint(src, size, &rle_size);
+            if (used == 0 || rle_size > scratch_capacity) {
+                fprintf(stderr, "Invalid hybrid RLE stream size\n");
+                return -1;
+            }
+            stream_count = rle_size >= HUFFMAN_MULTI_STREAM_MIN_SIZE ? HUFFMAN_STREAM_COUNT : 1;
+            if (huffman_decode_block(src + used, size - used, scratch, rle_size, stream_count) != 0 ||
+                rle_decompress_buffer(scratch, rle_size, dst, raw_size, &decoded_size) != 0) {
+                return -1;
+            }
+            break;
+        }
+
+        default:
+            fprintf(stderr, "Unknown hybrid block type %d\n", type);
+            return -1;
+    }
+
+    // RLE streams must fill the block exactly
+    if (decoded_size != raw_size) {
+        fprintf(stderr, "Invalid hybrid block\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Decodes one block of a hybrid container, header included, as listed in a
+// block table. Returns 0 on success, -1 on error.
+int hybrid_decode_indexed_block(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size) {
+    uint64_t header_raw_size, payload_size;
+    size_t pos = decode_varint(src, size, &header_raw_size);
+    if (pos == 0 || pos >= size || header_raw_size != raw_size) {
+        fprintf(stderr, "Invalid hybrid block header\n");
+        return -1;
+    }
+    int type = src[pos++];
+    size_t length = decode_varint(src + pos, size - pos, &payload_size);
+    pos += length;
+    if (length == 0 || payload_size != size - pos) {
+        fprintf(stderr, "Invalid hybrid block header\n");
+        return -1;
+    }
+    if (check_hybrid_block_header(raw_size, type, payload_size, HUFFMAN_MAX_BLOCK_SIZE) != 0) {
+        return -1;
+    }
+
+    // Only RLE_HUFFMAN blocks need room for their RLE stream
+    size_t scratch_capacity = type == HYBRID_BLOCK_RLE_HUFFMAN ? rle_compress_bound(raw_size) : 0;
+    uint8_t *scratch = NULL;
+    if (scratch_capacity > 0 && !(scratch = malloc(scratch_capacity))) {
+        fprintf(stderr, "Memory allocation failed for hybrid blocks\n");
+        return -1;
+    }
+    int result = decode_hybrid_block(type, src + pos, payload_size, dst, raw_size, scratch, scratch_capacity);
+    free(scratch);
+    return result;
+}
+
+// Decompresses a hybrid block container. Returns 0 on success, -1 on error.
+int hybrid_decompress(FILE *input_file, FILE *output_file) {
+    uint8_t header[HYBRID_MAGIC_SIZE + 1];
+    uint64_t block_size;
+    if (fread(header, 1, sizeof(header), input_file) != sizeof(header) ||
+        memcmp(header, HYBRID_MAGIC, HYBRID_MAGIC_SIZE) != 0 ||
+        read_varint(input_file, &block_size) != 0) {
+        fprintf(stderr, "Error reading hybrid header\n");
+        return -1;
+    }
+    if (header[HYBRID_MAGIC_SIZE] != HYBRID_VERSION) {
+        fprintf(stderr, "Unsupported hybrid format version %d\n", header[HYBRID_MAGIC_SIZE]);
+        return -1;
+    }
+    if (block_size == 0 || block_size > HUFFMAN_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Invalid hybrid block size\n");
+        return -1;
+    }
+
+    size_t scratch_capacity = rle_compress_bound(block_size);
+    uint8_t *payload = malloc(block_size);
+    uint8_t *output = malloc(block_size);
+    uint8_t *scratch = malloc(scratch_capacity);
+    if (!payload || !output || !scratch) {
+        fprintf(stderr, "Memory allocation failed for hybrid blocks\n");
+        free(payload);
+        free(output);
+        free(scratch);
+        return -1;
+    }
+
+    int result = 0;
+    for (;;) {
+        uint64_t raw_size, payload_size;
+        if (read_varint(input_file, &raw_size) != 0) {
+            fprintf(stderr, "Error reading block header\n");
+            result = -1;
+            break;
+        }
+        if (raw_size == 0) {
+            break; // End of blocks
+        }
+
+        // Coded payloads are always smaller than the block
+        int type = fgetc(input_file);
+        if (type == EOF || read_varint(input_file, &payload_size) != 0) {
+            fprintf(stderr, "Invalid hybrid block header\n");
+            result = -1;
+            break;
+        }
+        if (check_hybrid_block_header(raw_size, type, payload_size, block_size) != 0) {
+            result = -1;
+            break;
+        }
+
+        if (fread(payload, 1, payload_size, input_file) != payload_size) {
+            fprintf(stderr, "Unexpected end of file during decompression\n");
+            result = -1;
+            break;
+        }
+        if (decode_hybrid_block(type, payload, payload_size, output, raw_size, scratch, scratch_capacity) != 0) {
+            result = -1;
+            break;
+        }
+        if (fwrite(output, 1, raw_size, output_file) != raw_size || ferror(output_file)) {
+            fprintf(stderr, "Error writing decompressed data\n");
+            result = -1;
+            break;
+        }
+    }
+
+    free(payload);
+    free(output);
+    free(scratch);
+    return result;
+}
+
+// Decodes a hybrid block container of size bytes from src into dst, which
+// holds capacity bytes, and stores the decoded size.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int hybrid_decompress_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                             size_t *decompressed_size) {
+    if (size < HYBRID_MAGIC_SIZE + 1 || memcmp(src, HYBRID_MAGIC, HYBRID_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "Error reading hybrid header\n");
+        return -1;
+    }
+    if (src[HYBRID_MAGIC_SIZE] != HYBRID_VERSION) {
+        fprintf(stderr, "Unsupported hybrid format version %d\n", src[HYBRID_MAGIC_SIZE]);
+        return -1;
+    }
+
+    size_t pos = HYBRID_MAGIC_SIZE + 1;
+    uint64_t block_size;
+    size_t used = decode_varint(src + pos, size - pos, &block_size);
+    if (used == 0 || block_size == 0 || block_size > HUFFMAN_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Invalid hybrid block size\n");
+        return -1;
+    }
+    pos += used;
+
+    // Blocks decode straight into dst; only RLE_HUFFMAN blocks need scratch
+    size_t scratch_capacity = rle_compress_bound(block_size);
+    uint8_t *scratch = NULL;
+    size_t out_pos = 0;
+    int result = 0;
+    for (;;) {
+        uint64_t raw_size, payload_size;
+        used = decode_varint(src + pos, size - pos, &raw_size);
+        if (used == 0) {
+            fprintf(stderr, "Error reading block header\n");
+            result = -1;
+            break;
+        }
+        pos += used;
+        if (raw_size == 0) {
+            break; // End of blocks
+        }
+
+        if (pos == size || (used = decode_varint(src + pos + 1, size - pos - 1, &payload_size)) == 0) {
+            fprintf(stderr, "Invalid hybrid block header\n");
+            result = -1;
+            break;
+        }
+        int type = src[pos];
+        pos += 1 + used;
+        if (check_hybrid_block_header(raw_size, type, payload_size, block_size) != 0) {
+            result = -1;
+            break;
+        }
+        if (payload_size > size - pos) {
+            fprintf(stderr, "Unexpected end of data during decompression\n");
+            result = -1;
+            break;
+        }
+        if (raw_size > capacity - out_pos) {
+            fprintf(stderr, "Hybrid output buffer too small\n");
+            result = -1;
+            break;
+        }
+        if (type == HYBRID_BLOCK_RLE_HUFFMAN && !scratch && !(scratch = malloc(scratch_capacity))) {
+            fprintf(stderr, "Memory allocation failed for hybrid blocks\n");
+            result = -1;
+            break;
+        }
+
+        if (decode_hybrid_block(type, src + pos, payload_size, dst + out_pos, raw_size,
+                                scratch, scratch ? scratch_capacity : 0) != 0) {
+            result = -1;
+            break;
+        }
+        pos += payload_size;
+        out_pos += raw_size;
+    }
+
+    free(scratch);
+    *decompressed_size = out_pos;
+    return result;
+}
@@ -10,6 +10,9 @@
 #include "archive/archive.h"
 #include "benchmark/benchmark.h"
 #include "encryption/encryption.h"
+#include "hybrid/hybrid.h"
+#include "frame/frame.h"
+#include "utils/thread_pool.h"
 #include <unistd.h>
 #include <limits.h>
 #include <getopt.h>
@@ -17,10 +20,39 @@
 #include <ctype.h>
 
 void my_progress_callback(size_t bytes_processed, size_t total_bytes, void *user_data) {
+    // Pipes have no size, so a report passed as user_data gets the byte count
+    if (user_data) {
+        ((CompressionReport *)user_data)->original_size = bytes_processed;
+    }
+
     if (total_bytes > 0) {
         int percentage = (int)((double)bytes_processed / total_bytes * 100);
         fprintf(stderr, "Compression/Decompression Progress: %d%%   \r", percentage);
+    } else {
+        fprintf(stderr, "Compression/Decompression Progress: %zu bytes   \r", bytes_processed);
+    }
+}
+
+// Function to check if a filename stands for standard input/output
+int is_std_stream(const char *filename) {
+    return strcmp(filename, "-") == 0;
+}
+
+// Function to open a file, or standard input/output for "-"
+FILE* open_stream(const char *filename, const char *mode) {
+    if (is_std_stream(filename)) {
+        return strchr(mode, 'r') ? stdin : stdout;
+    }
+    return fopen(filename, mode);
+}
+
+// Function to close a file opened with open_stream
+void close_stream(FILE *file) {
+    if (file == stdin || file == stdout) {
+        fflush(file);
+        return;
     }
+    fclose(file);
 }
 
 // Function to check if a file exists
@@ -29,6 +61,13 @@ int file_exists(const char *filename) {
     return (stat(filename, &buffer) == 0);
 }
 
+// Function to check if two paths name the same existing file
+int same_file(const char *first, const char *second) {
+    struct stat first_stat, second_stat;
+    return stat(first, &first_stat) == 0 && stat(second, &second_stat) == 0 &&
+           first_stat.st_dev == second_stat.st_dev && first_stat.st_ino == second_stat.st_ino;
+}
+
 // Function to copy a file (used for decompression after decryption)
 int copy_file(FILE *source, FILE *destination) {
     char buffer[4096];
@@ -47,21 +86,36 @@ int copy_file(FILE *source, FILE *destination) {
  * @param program_name The name of the executable.
  */
 void usage(char *program_name) {
-    fprintf(stderr, "Usage: %s [-c|-d|-b] [-a rle|huffman|hybrid] [-l fast|balanced|max] [-q directory] [-f file1 file2 ...] [-encrypt|-decrypt] [-password password] input_file output_file\n", program_name);
+    fprintf(stderr, "Usage: %s [-c|-d|-b|-x|-t] [-a rle|huffman|hybrid] [-l fast|balanced|max] [-T threads] [-M megabytes] [-S threads] [-s] [-u archive [--compare-content]] [-q directory] [-f file1 file2 ...] [-encrypt|-decrypt] [-password password] [--range offset:length] input_file output_file\n", program_name);
     fprintf(stderr, "  -c                  : Compress. Compress an input file or directory.\n");
     fprintf(stderr, "  -d                  : Decompress. Decompress an input file.\n");
     fprintf(stderr, "  -b                  : Benchmark. Benchmark compression/decompression performance.\n");
+    fprintf(stderr, "  -x                  : Extract. Extract an archive, or only the given paths: -x archive [paths...]\n");
+    fprintf(stderr, "  -t                  : List. List the entries of an archive: -t archive\n");
     fprintf(stderr, "  -a                  : Algorithm. Specify the compression algorithm (rle, huffman, hybrid).\n");
-    fprintf(stderr, "                      Default: rle\n");
+    fprintf(stderr, "                      Default: rle. Decompression reads the algorithm from the file.\n");
     fprintf(stderr, "  -l                  : Compression level. Specify the compression level (fast, balanced, max).\n");
     fprintf(stderr, "                      Default: balanced\n");
-    fprintf(stderr, "  -q <directory>    : Compress a directory. Use with -c.\n");
-    fprintf(stderr, "  -f <files...>   : Compress multiple files. Use with -c.\n");
+    fprintf(stderr, "  -T <threads>        : Threads. Number of threads used for Huffman compression and decompression\n");
+    fprintf(stderr, "                      and for compressing archive entries. Default: number of online CPUs\n");
+    fprintf(stderr, "  -M <megabytes>      : Memory budget for compressed archive entries waiting to be written.\n");
+    fprintf(stderr, "                      Default: 256\n");
+    fprintf(stderr, "  -S <threads>        : Scanner threads. Number of threads listing directories for -q.\n");
+    fprintf(stderr, "                      More help on network file systems but vary the entry order. Default: 1\n");
+    fprintf(stderr, "  -s                  : Solid. Compress small archive entries together in shared blocks.\n");
+    fprintf(stderr, "  -u <archive>        : Update. Copy files unchanged since the given archive from it instead of\n");
+    fprintf(stderr, "                      compressing them again. The new archive must be another file.\n");
+    fprintf(stderr, "  --compare-content   : With -u, also check the content of unchanged files against the archive.\n");
+    fprintf(stderr, "  -q <directory>      : Compress a directory into output_file: -c -q directory output_file\n");
+    fprintf(stderr, "  -f <files...>       : Compress multiple files into output_file: -c -f file1 file2 ... output_file\n");
     fprintf(stderr, "  -encrypt            : Encrypt the compressed file.\n");
     fprintf(stderr, "  -decrypt            : Decrypt the compressed file.\n");
     fprintf(stderr, "  -password <password>: Password. Provide a password for encryption or decryption.\n");
+    fprintf(stderr, "  --range <off:len>   : Decompress only len bytes starting at byte off. Use with -d.\n");
     fprintf(stderr, "  input_file          : Input file or directory for compression/decompression.\n");
+    fprintf(stderr, "                      Use - for standard input.\n");
     fprintf(stderr, "  output_file         : Output file for compressed or decompressed data.\n");
+    fprintf(stderr, "                      Use - for standard output.\n");
 
     exit(1);
 }
@@ -74,85 +128,41 @@ char* strtolower(char *str) {
     return str;
 }
 
-// New function to perform hybrid compression
-int hybrid_compress(FILE *input_file, FILE *output_file, CompressionLevel level) {
-    // Sample size for comparison (adjust as needed)
-    const size_t sample_size = 1024;
-    uint8_t sample[sample_size];
-
-    // Read a sample from the input file
-    size_t bytes_read = fread(sample, 1, sample_size, input_file);
-    if (bytes_read == 0) {
-        return -1; // Error reading or empty file
+// Maps a validated algorithm name to its enum value
+CompressionAlgorithm parse_algorithm(const char *name) {
+    if (strcmp(name, "huffman") == 0) {
+        return ALG_HUFFMAN;
     }
-    rewind(input_file);
-
-    // Create temporary files for RLE and Huffman compression
-    FILE *temp_rle = tmpfile();
-    FILE *temp_huffman = tmpfile();
-    if (!temp_rle || !temp_huffman) {
-        perror("Error creating temporary files");
-        return -1;
+    if (strcmp(name, "hybrid") == 0) {
+        return ALG_HYBRID;
     }
+    return ALG_RLE;
+}
 
-    // Perform RLE compression on the sample
-    size_t rle_compressed_size = 0;
-    if (rle_compress_advanced(input_file, temp_rle, level) == 0)
-    {
-        // Get compressed size
-        fseek(temp_rle, 0, SEEK_END);
-        rle_compressed_size = ftell(temp_rle);
-        rewind(temp_rle);
-    }
-    rewind(input_file);
-
-    // Perform Huffman compression on the sample
-    size_t huffman_compressed_size = 0;
-    if (huffman_compress(input_file, temp_huffman) == 0)
-    {
-        // Get compressed size
-        fseek(temp_huffman, 0, SEEK_END);
-        huffman_compressed_size = ftell(temp_huffman);
-        rewind(temp_huffman);
+// Parses an OFFSET:LENGTH byte range. Returns 0 on success, -1 if malformed.
+int parse_range(const char *text, uint64_t *offset, uint64_t *length) {
+    char *end;
+    if (!isdigit((unsigned char)text[0])) {
+        return -1;
     }
-    rewind(input_file);
-
-    // Determine the more efficient algorithm
-    CompressionAlgorithm chosen_algorithm;
-    if (huffman_compressed_size == 0 || (rle_compressed_size > 0 && rle_compressed_size < huffman_compressed_size)) {
-        chosen_algorithm = ALG_RLE;
-        
-        // Copy temp_rle to output_file
-        uint8_t buffer[4096];
-        size_t bytes;
-        fseek(temp_rle, 0, SEEK_SET);
-        while ((bytes = fread(buffer, 1, sizeof(buffer), temp_rle)) > 0) {
-            fwrite(buffer, 1, bytes, output_file);
-        }
-        printf("RLE Algorithm is choosen by hybrid algorithm\n");
-    } else {
-        chosen_algorithm = ALG_HUFFMAN;
-
-        // Copy temp_huffman to output_file
-        uint8_t buffer[4096];
-        size_t bytes;
-        fseek(temp_huffman, 0, SEEK_SET);
-        while ((bytes = fread(buffer, 1, sizeof(buffer), temp_huffman)) > 0) {
-            fwrite(buffer, 1, bytes, output_file);
-        }
-        printf("Huffman Algorithm is choosen by hybrid algorithm\n");
+    *offset = strtoull(text, &end, 10);
+    if (*end != ':' || !isdigit((unsigned char)end[1])) {
+        return -1;
     }
+    *length = strtoull(end + 1, &end, 10);
+    return *end == '\0' ? 0 : -1;
+}
 
-    // Clean up temporary files
-    fclose(temp_rle);
-    fclose(temp_huffman);
-
-    return chosen_algorithm;
+// Prints how many blocks of each type hybrid compression wrote
+void print_hybrid_blocks(FILE *stream, const size_t *block_counts) {
+    fprintf(stream, "Hybrid blocks: %zu stored, %zu RLE, %zu Huffman, %zu RLE+Huffman\n",
+            block_counts[HYBRID_BLOCK_STORED], block_counts[HYBRID_BLOCK_RLE],
+            block_counts[HYBRID_BLOCK_HUFFMAN], block_counts[HYBRID_BLOCK_RLE_HUFFMAN]);
 }
 
 int main(int argc, char *argv[]) {
     int opt;
-    int compress_mode = -1;  // -1: unset, 0: decompress, 1: compress, 2: benchmark
+    int compress_mode = -1;  // -1: unset, 0: decompress, 1: compress, 2: benchmark, 3: extract, 4: list
     char *algorithm = "rle";
     char *input_filename = NULL;
     char *output_filename = NULL;
@@ -163,11 +173,22 @@ int main(int argc, char *argv[]) {
     int encrypt = 0;
     int decrypt = 0;
     char *password = NULL;
+    int thread_count = thread_pool_default_threads();
+    size_t memory_budget = ARCHIVE_DEFAULT_MEMORY_BUDGET;
+    int scan_threads = 1;
+    int solid = 0;
+    char *previous_archive = NULL;
+    int compare_content = 0;
+    int has_range = 0;
+    uint64_t range_offset = 0;
+    uint64_t range_length = 0;
 
     struct option long_options[] = {
         {"c", no_argument, NULL, 'c'},
         {"d", no_argument, NULL, 'd'},
         {"b", no_argument, NULL, 'b'},
+        {"extract", no_argument, NULL, 'x'},
+        {"list", no_argument, NULL, 't'},
         {"a", required_argument, NULL, 'a'},
         {"l", required_argument, NULL, 'l'},
         {"dir", required_argument, NULL, 'q'},
@@ -175,10 +196,17 @@ int main(int argc, char *argv[]) {
         {"encrypt", no_argument, &encrypt, 1},
         {"decrypt", no_argument, &decrypt, 1},
         {"password", required_argument, NULL, 'p'},
+        {"threads", required_argument, NULL, 'T'},
+        {"range", required_argument, NULL, 'R'},
+        {"memory", required_argument, NULL, 'M'},
+        {"scan-threads", required_argument, NULL, 'S'},
+        {"solid", no_argument, NULL, 's'},
+        {"update", required_argument, NULL, 'u'},
+        {"compare-content", no_argument, &compare_content, 1},
         {0, 0, 0, 0}
     };
 
-    while ((opt = getopt_long(argc, argv, "cdba:l:1:2:p:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "cdbxtsa:l:q:f:1:2:p:T:M:S:u:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'c':
                 compress_mode = 1;
@@ -189,6 +217,15 @@ int main(int argc, char *argv[]) {
             case 'b':
                 compress_mode = 2; // Benchmark mode
                 break;
+            case 'x':
+                compress_mode = 3; // Extract an archive
+                break;
+            case 't':
+                compress_mode = 4; // List an archive
+                break;
+            case 's':
+                solid = 1;
+                break;
             case 'a':
                 algorithm = strtolower(optarg);
                 break;
@@ -204,21 +241,64 @@ int main(int argc, char *argv[]) {
                     usage(argv[0]);
                 }
                 break;
+            case 'q':
             case '1':
                 dir_name = optarg;
                 break;
+            case 'f':
             case '2':
-                // Start adding file names after -files and continue until the next option
-                file_list = &argv[optind - 1]; // Start of the file list
-                file_count = 0;
+                // Take the file names after -f up to the next option. getopt
+                // permutes argv as it goes, so the names are copied out now.
+                free(file_list);
+                file_list = malloc(argc * sizeof(char *));
+                if (!file_list) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    return 1;
+                }
+                file_list[0] = optarg;
+                file_count = 1;
                 while (optind < argc && argv[optind][0] != '-') {
-                    file_count++;
-                    optind++;
+                    file_list[file_count++] = argv[optind++];
                 }
                 break;
             case 'p':
                 password = optarg;
                 break;
+            case 'u':
+                previous_archive = optarg;
+                break;
+            case 'T':
+                thread_count = atoi(optarg);
+                if (thread_count < 1) {
+                    fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'S':
+                scan_threads = atoi(optarg);
+                if (scan_threads < 1) {
+                    fprintf(stderr, "Invalid scanner thread count: %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'M': {
+                char *end;
+                unsigned long long megabytes = strtoull(optarg, &end, 10);
+                if (!isdigit((unsigned char)optarg[0]) || *end != '\0' || megabytes == 0 ||
+                    megabytes > SIZE_MAX / (1024 * 1024)) {
+                    fprintf(stderr, "Invalid memory budget: %s\n", optarg);
+                    usage(argv[0]);
+                }
+                memory_budget = (size_t)megabytes * 1024 * 1024;
+                break;
+            }
+            case 'R':
+                if (parse_range(optarg, &range_offset, &range_length) != 0) {
+                    fprintf(stderr, "Invalid range: %s\n", optarg);
+                    usage(argv[0]);
+                }
+                has_range = 1;
+                break;
             case 0:
                 // For long options without a short equivalent
                 break;
@@ -228,6 +308,27 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // Archives are read from their central directory: -x archive [paths...], -t archive
+    if (compress_mode == 3 || compress_mode == 4) {
+        if (optind >= argc || (compress_mode == 4 && argc - optind > 1) || encrypt || decrypt || has_range) {
+            fprintf(stderr, "Error: -x takes an archive and optional paths, -t an archive.\n");
+            usage(argv[0]);
+        }
+        const char *archive_name = argv[optind++];
+        if (compress_mode == 4) {
+            return list_archive(archive_name, stdout) == 0 ? 0 : 1;
+        }
+
+        ArchiveOptions archive_options = { thread_count, memory_budget, scan_threads, solid, previous_archive,
+                                           compare_content };
+        if (extract_archive(archive_name, &argv[optind], argc - optind, &archive_options) != 0) {
+            fprintf(stderr, "Error during archive extraction.\n");
+            return 1;
+        }
+        printf("Archive extraction completed successfully.\n");
+        return 0;
+    }
+
     // Check if input and output files are provided correctly
     if (optind < argc) {
         input_filename = argv[optind++];
@@ -236,6 +337,16 @@ int main(int argc, char *argv[]) {
         output_filename = argv[optind++];
     }
 
+    // A directory or a file list is compressed into the one file named.
+    // -f takes every name up to the next option, so the archive may be the
+    // last of them.
+    if ((dir_name || file_count > 0) && input_filename && !output_filename) {
+        output_filename = input_filename;
+        input_filename = NULL;
+    } else if (file_count > 1 && !input_filename) {
+        output_filename = file_list[--file_count];
+    }
+
     // If encrypt or decrypt is specified without a password, that's an error
     if ((encrypt || decrypt) && password == NULL) {
         fprintf(stderr, "Error: Encryption or decryption requested but no password provided.\n");
@@ -252,19 +363,44 @@ int main(int argc, char *argv[]) {
         usage(argv[0]);
     }
 
-    if (compress_mode != 2 && (!input_filename || !output_filename)) {
+    if (compress_mode != 2 && ((!input_filename && !dir_name && file_count == 0) || !output_filename)) {
         fprintf(stderr, "Error: Input and output filenames are required for compression/decompression.\n");
         usage(argv[0]);
     }
 
-    // Check for algorithm validity, removed hybrid from decompress
-    if (compress_mode == 0 && strcmp(algorithm, "hybrid") == 0) {
-        fprintf(stderr, "Error: Hybrid mode is not supported for decompression.\n");
+    // Ranges are cut from a seekable compressed file
+    if (has_range && (compress_mode != 0 || is_std_stream(input_filename))) {
+        fprintf(stderr, "Error: --range only works for decompression of a compressed file.\n");
+        usage(argv[0]);
+    }
+
+    // Updates write a new archive next to the one they copy from
+    if (previous_archive && (compress_mode != 1 || (file_count == 0 && !dir_name))) {
+        fprintf(stderr, "Error: -u only works for compression of a directory or multiple files.\n");
         usage(argv[0]);
-    } else if (strcmp(algorithm, "rle") != 0 && strcmp(algorithm, "huffman") != 0 && strcmp(algorithm, "hybrid") != 0) {
+    }
+    if (previous_archive && same_file(previous_archive, output_filename)) {
+        fprintf(stderr, "Error: The updated archive must be written to a new file.\n");
+        usage(argv[0]);
+    }
+
+    // Check for algorithm validity
+    if (strcmp(algorithm, "rle") != 0 && strcmp(algorithm, "huffman") != 0 && strcmp(algorithm, "hybrid") != 0) {
         fprintf(stderr, "Error: Invalid algorithm specified.\n");
         usage(argv[0]);
     }
+    CompressionAlgorithm selected_algorithm = parse_algorithm(algorithm);
+
+    // "-" only works for a single file without encryption, which never seeks back
+    int uses_std_stream = (input_filename && is_std_stream(input_filename)) ||
+                          (output_filename && is_std_stream(output_filename));
+    if (uses_std_stream && (encrypt || decrypt || file_count > 0 || dir_name || compress_mode == 2)) {
+        fprintf(stderr, "Error: - is only supported for single file compression and decompression.\n");
+        usage(argv[0]);
+    }
+
+    // Keep standard output clean when it carries the data
+    FILE *status_out = (output_filename && is_std_stream(output_filename)) ? stderr : stdout;
 
     CompressionReport report;
     int result = 0;
@@ -307,27 +443,16 @@ int main(int argc, char *argv[]) {
         
         if (encrypt)
         {
-            if (algorithm == NULL || strcmp(algorithm, "rle") == 0)
+            size_t block_counts[HYBRID_BLOCK_TYPES];
+            if (frame_compress(input_file, temp_compressed_file, selected_algorithm, level, thread_count,
+                               NULL, NULL, block_counts) != 0)
             {
-                if (rle_compress_advanced(input_file, temp_compressed_file, level) != 0)
-                {
-                    fprintf(stderr, "RLE compression failed.\n");
-                    result = 1;
-                }
+                fprintf(stderr, "Compression failed.\n");
+                result = 1;
             }
-            else if (strcmp(algorithm, "huffman") == 0)
-            {
-                if (huffman_compress(input_file, temp_compressed_file) != 0)
-                {
-                    fprintf(stderr, "Huffman compression failed.\n");
-                    result = 1;
-                }
-            } else if (strcmp(algorithm, "hybrid") == 0)
+            else if (selected_algorithm == ALG_HYBRID)
             {
-                if (hybrid_compress(input_file, temp_compressed_file, level) < 0) {
-                    fprintf(stderr, "Hybrid compression failed.\n");
-                    result = 1;
-                }
+                print_hybrid_blocks(stdout, block_counts);
             }
 
             if (!result) {
@@ -354,23 +479,14 @@ int main(int argc, char *argv[]) {
             } else {
                 rewind(temp_decrypted_file);
                 
-                if (algorithm == NULL || strcmp(algorithm, "rle") == 0)
-                {
-                    // Decompress from temp_decrypted_file to output_file
-                    if (rle_decompress(temp_decrypted_file, output_file) != 0)
-                    {
-                        fprintf(stderr, "RLE decompression failed.\n");
-                        result = 1;
-                    }
-                }
-                else if (strcmp(algorithm, "huffman") == 0)
+                // Decompress from temp_decrypted_file to output_file
+                int decompress_result = has_range
+                    ? frame_decompress_range(temp_decrypted_file, output_file, range_offset, range_length)
+                    : frame_decompress(temp_decrypted_file, output_file, selected_algorithm, thread_count);
+                if (decompress_result != 0)
                 {
-                    // Decompress from temp_decrypted_file to output_file
-                    if (huffman_decompress(temp_decrypted_file, output_file) != 0)
-                    {
-                        fprintf(stderr, "Huffman decompression failed.\n");
-                        result = 1;
-                    }
+                    fprintf(stderr, "Decompression failed.\n");
+                    result = 1;
                 }
             }
             if (temp_decrypted_file) fclose(temp_decrypted_file);
@@ -391,19 +507,18 @@ int main(int argc, char *argv[]) {
         return result;
     } else if (compress_mode == 1) { // Compression for files and directories
         // Compression
-        FILE *output_file = fopen(output_filename, "wb");
+        FILE *output_file = open_stream(output_filename, "wb");
         if (!output_file) {
             perror("Error opening output file");
             return 1;
         }
 
+        ArchiveOptions archive_options = { thread_count, memory_budget, scan_threads, solid, previous_archive,
+                                           compare_content };
         if (file_count > 0) {
             // Compress multiple files
-            if (strcmp(algorithm, "hybrid") == 0) {
-                result = compress_multiple_files(file_list, file_count, output_filename, report.algorithm, level);
-            } else {
-                result = compress_multiple_files(file_list, file_count, output_filename, algorithm == NULL ? ALG_RLE : (strcmp(algorithm, "rle") == 0 ? ALG_RLE : ALG_HUFFMAN), level);
-            }
+            result = compress_multiple_files(file_list, file_count, output_filename, selected_algorithm, level,
+                                             &archive_options);
             
             if (result != 0) {
                 fprintf(stderr, "Error during multiple files compression.\n");
@@ -412,11 +527,7 @@ int main(int argc, char *argv[]) {
             }
         } else if (dir_name) {
             // Compress directory
-            if (strcmp(algorithm, "hybrid") == 0) {
-                result = compress_directory(dir_name, output_filename, report.algorithm, level);
-            } else {
-                result = compress_directory(dir_name, output_filename, algorithm == NULL ? ALG_RLE : (strcmp(algorithm, "rle") == 0 ? ALG_RLE : ALG_HUFFMAN), level);
-            }
+            result = compress_directory(dir_name, output_filename, selected_algorithm, level, &archive_options);
 
             if (result != 0) {
                 fprintf(stderr, "Error during directory compression.\n");
@@ -425,38 +536,26 @@ int main(int argc, char *argv[]) {
             }
         } else {
             // Regular file compression
-            FILE *input_file = fopen(input_filename, "rb");
+            FILE *input_file = open_stream(input_filename, "rb");
             if (!input_file) {
                 perror("Error opening input file");
-                fclose(output_file);
+                close_stream(output_file);
                 return 1;
             }
 
             // Initialize report
             memset(&report, 0, sizeof(CompressionReport));
-            if (strcmp(algorithm, "rle") == 0) {
-                report.algorithm = ALG_RLE;
-            } else if (strcmp(algorithm, "huffman") == 0) {
-                report.algorithm = ALG_HUFFMAN;
-            } else if (strcmp(algorithm, "hybrid") == 0) {
-                report.algorithm = ALG_HYBRID;
-            }
+            report.algorithm = selected_algorithm;
 
             report.level = level;
             start_compression_timing(&report);
 
-            // Perform compression based on the selected algorithm
-            if (strcmp(algorithm, "rle") == 0) {
-                result = rle_compress_with_progress(input_file, output_file, level, my_progress_callback, NULL);
-            } else if (strcmp(algorithm, "huffman") == 0) {
-                result = huffman_compress_with_progress(input_file, output_file, my_progress_callback, NULL);
-            } else if (strcmp(algorithm, "hybrid") == 0) {
-                result = hybrid_compress(input_file, output_file, level);
-                if (result == ALG_RLE || result == ALG_HUFFMAN)
-                {
-                    report.algorithm = result;
-                    result = 0; // Reset result to indicate success
-                }
+            // Compress into a frame that records the algorithm for decompression
+            size_t block_counts[HYBRID_BLOCK_TYPES];
+            result = frame_compress(input_file, output_file, selected_algorithm, level, thread_count,
+                                    my_progress_callback, &report, block_counts);
+            if (result == 0 && selected_algorithm == ALG_HYBRID) {
+                print_hybrid_blocks(status_out, block_counts);
             }
 
             // Finalize report
@@ -465,52 +564,50 @@ int main(int argc, char *argv[]) {
             if (result != 0) {
                 fprintf(stderr, "Error during compression.\n");
             } else {
-                printf("Compression completed successfully.\n");
+                fprintf(status_out, "Compression completed successfully.\n");
 
                 // Generate compression report
                 FILE *report_file = fopen("compression_report.txt", "w");
                 if (report_file) {
                     generate_compression_report(report_file, &report);
                     fclose(report_file);
-                    printf("Compression report generated: compression_report.txt\n");
+                    fprintf(status_out, "Compression report generated: compression_report.txt\n");
                 } else {
                     perror("Error opening report file");
                 }
             }
 
-            fclose(input_file);
+            close_stream(input_file);
         }
 
-        fclose(output_file);
+        close_stream(output_file);
     } else if (compress_mode == 0) {
         // Decompression (similar to your original logic)
-        FILE *input_file = fopen(input_filename, "rb");
-        FILE *output_file = fopen(output_filename, "wb");
+        FILE *input_file = open_stream(input_filename, "rb");
+        FILE *output_file = open_stream(output_filename, "wb");
 
         if (!input_file || !output_file) {
             perror("Error opening files");
-            if (input_file) fclose(input_file);
-            if (output_file) fclose(output_file);
+            if (input_file) close_stream(input_file);
+            if (output_file) close_stream(output_file);
             return 1;
         }
 
-        if (strcmp(algorithm, "rle") == 0) {
-            result = rle_decompress(input_file, output_file);
-        } else if (strcmp(algorithm, "huffman") == 0) {
-            result = huffman_decompress(input_file, output_file);
+        // Frames name their own algorithm; -a only applies to bare streams
+        if (has_range) {
+            result = frame_decompress_range(input_file, output_file, range_offset, range_length);
         } else {
-            fprintf(stderr, "Error: Invalid algorithm specified for decompression.\n");
-            result = 1;
+            result = frame_decompress(input_file, output_file, selected_algorithm, thread_count);
         }
 
         if (result != 0) {
             fprintf(stderr, "Error during decompression.\n");
         } else {
-            printf("Decompression completed successfully.\n");
+            fprintf(status_out, "Decompression completed successfully.\n");
         }
 
-        fclose(input_file);
-        fclose(output_file);
+        close_stream(input_file);
+        close_stream(output_file);
     } else if (compress_mode == 2) { // Benchmark mode
         // Validate algorithm and level if necessary
         if (strcmp(algorithm, "rle") != 0 && strcmp(algorithm, "huffman") != 0 && strcmp(algorithm, "hybrid") != 0) {
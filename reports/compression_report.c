@@ -65,21 +65,34 @@ void start_compression_timing(CompressionReport *report) {
     report->start_time = clock();
 }
 
+// Returns the size of a seekable file, or -1 for pipes and other streams.
+// The file position is left unchanged.
+static long stream_size(FILE *file) {
+    long position = ftell(file);
+    if (position < 0 || fseek(file, 0, SEEK_END) != 0) {
+        return -1;
+    }
+    long size = ftell(file);
+    fseek(file, position, SEEK_SET);
+    return size;
+}
+
 // Ends the compression timer and calculates statistics.
 void end_compression_timing(CompressionReport *report, FILE *input_file, FILE *output_file) {
     if (report == NULL || input_file == NULL || output_file == NULL) return;
 
     report->end_time = clock();
 
-    // Get original file size
-    fseek(input_file, 0, SEEK_END);
-    report->original_size = ftell(input_file);
-    rewind(input_file);
-
-    // Get compressed file size
-    fseek(output_file, 0, SEEK_END);
-    report->compressed_size = ftell(output_file);
-    rewind(output_file);
+    // Get the file sizes. Pipes have none, so for them the sizes already
+    // recorded in the report by the caller are kept.
+    long size = stream_size(input_file);
+    if (size >= 0) {
+        report->original_size = size;
+    }
+    size = stream_size(output_file);
+    if (size >= 0) {
+        report->compressed_size = size;
+    }
 
     // Calculate compression ratio
     if (report->original_size > 0) {
@@ -3,7 +3,79 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include "../reports/compression_report.h"
+#include "../utils/block_table.h"
+
+// RLE v2 stream layout:
+//   "\0RL2" | tokens | varint 0 (end)
+// Each token starts with a varint control word (length << 1 | kind):
+//   kind 0: literal span, followed by length raw bytes
+//   kind 1: run, followed by the byte repeated length times
+// Legacy (v1) streams are plain (count, byte) pairs with count >= 1, so the
+// leading zero byte tells the two formats apart.
+#define RLE_MAGIC "\0RL2"
+#define RLE_MAGIC_SIZE 4
+
+// Longest literal span the encoder emits, and the decoder accepts
+#define RLE_MAX_LITERAL 4096
+
+// Shortest run worth a run token; shorter runs stay in literal spans
+#define RLE_MIN_RUN 4
+
+// Streaming RLE v2 encoder. Runs and literal spans stay open across calls
+// to rle_encoder_update, so the input can arrive in chunks of any size.
+// Output goes to a file through an internal buffer, or to a caller-provided
+// buffer (file == NULL), in which case the encoder fails once it is full.
+typedef struct {
+    FILE *file;
+    uint8_t *out;
+    size_t capacity;
+    size_t pos;
+    uint8_t literal[RLE_MAX_LITERAL];  // Pending literal span
+    size_t literal_count;
+    uint8_t run_byte;                  // Open run
+    size_t run_count;
+    uint64_t written;                  // Output bytes handed out before out[0]
+    uint64_t encoded;                  // Input bytes covered by finished tokens
+    BlockTable *table;                 // Token boundaries, or NULL
+    size_t block_size;
+    uint64_t block_output;             // Output and input offsets of the open block
+    uint64_t block_input;
+} RleEncoder;
+
+// Initializes an encoder writing to a file and writes the stream header.
+// Returns 0 on success, -1 on error.
+int rle_encoder_init(RleEncoder *encoder, FILE *file);
+
+// Initializes an encoder filling buffer and writes the stream header.
+// Returns 0 on success, -1 if the buffer is too small.
+int rle_encoder_init_buffer(RleEncoder *encoder, uint8_t *buffer, size_t capacity);
+
+// Points a memory encoder at a new output buffer, for streaming output in
+// pieces. The encoder's pending run and literal span are kept.
+void rle_encoder_set_buffer(RleEncoder *encoder, uint8_t *buffer, size_t capacity);
+
+// Makes the encoder record a block in table at the first token boundary
+// after every block_size bytes of input. Tokens never refer back, so each
+// block decodes on its own. Call right after initialization.
+void rle_encoder_set_table(RleEncoder *encoder, BlockTable *table, size_t block_size);
+
+// Largest stream the encoder writes for size bytes of input. A streaming
+// update may additionally flush a pending literal span of RLE_MAX_LITERAL
+// bytes and an open run.
+size_t rle_compress_bound(size_t size);
+
+// Encodes size more bytes of input. Returns 0 on success, -1 on error.
+int rle_encoder_update(RleEncoder *encoder, const uint8_t *data, size_t size);
+
+// Closes the open run and literal span, writes the end marker and flushes
+// a file encoder. A memory encoder's output size is then encoder->pos.
+// Returns 0 on success, -1 on error.
+int rle_encoder_finish(RleEncoder *encoder);
+
+// Releases the encoder's buffer. Does not flush.
+void rle_encoder_free(RleEncoder *encoder);
 
 // Function to compress data from an input file and write the RLE compressed data to an output file.
 int rle_compress(FILE *input_file, FILE *output_file);
@@ -11,6 +83,24 @@ int rle_compress(FILE *input_file, FILE *output_file);
 // Function to decompress data from an input file and write the RLE decompressed data to an output file.
 int rle_decompress(FILE *input_file, FILE *output_file);
 
+// Decodes RLE v2 tokens from the input's position, which must be a token
+// boundary such as the start of a block recorded by rle_encoder_set_table.
+// The first skip bytes of output are dropped and the next length bytes
+// written. Returns 0 on success, -1 on error or if the stream ends first.
+int rle_decompress_range(FILE *input_file, FILE *output_file, uint64_t skip, uint64_t length);
+
+// Compresses size bytes of src into dst, which holds capacity bytes
+// (rle_compress_bound is always enough), and stores the compressed size.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int rle_compress_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                        size_t *compressed_size);
+
+// Decodes a complete RLE stream (either format) of size bytes from src into
+// dst, which holds capacity bytes, and stores the decoded size.
+// Returns 0 on success, -1 on error or if the output does not fit.
+int rle_decompress_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                          size_t *decoded_size);
+
 // Advanced RLE compression function with compression levels
 int rle_compress_advanced(FILE *input_file, FILE *output_file, CompressionLevel level);
 
@@ -20,4 +110,9 @@ typedef void (*ProgressCallback)(size_t bytes_processed, size_t total_bytes, voi
 // RLE compression function with progress tracking
 int rle_compress_with_progress(FILE *input_file, FILE *output_file, CompressionLevel level, ProgressCallback progress_fn, void *user_data);
 
+// Same as rle_compress_with_progress, recording blocks of about block_size
+// input bytes in table (see rle_encoder_set_table).
+int rle_compress_with_table(FILE *input_file, FILE *output_file, size_t block_size, BlockTable *table,
+                            ProgressCallback progress_fn, void *user_data);
+
 #endif // RLE_H
\ No newline at end of file
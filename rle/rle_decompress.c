@@ -1,45 +1,359 @@
 #include "rle.h"
+#include "../utils/varint.h"
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
-#define BUFFER_SIZE 4096
+// Sizes of a file decoder's input and output buffers
+#define INPUT_BUFFER_SIZE 65536
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
 
+// Short runs are written with one 16-byte store, which may run past the end
+// of the run. The file decoder's output buffer has this much slack.
+#define RUN_STORE_SIZE 16
 
-int rle_decompress(FILE *input_file, FILE *output_file) {
-    if (input_file == NULL || output_file == NULL) {
-        fprintf(stderr, "Invalid file pointers.\n");
+// Largest v2 token: a control varint followed by a full literal span
+#define MAX_TOKEN_SIZE (VARINT_MAX_BYTES + RLE_MAX_LITERAL)
+
+
+// Decoder state. Reads from a file through in_buffer, or from a memory
+// buffer (in_file == NULL). Writes to a file through out, or to a memory
+// buffer (out_file == NULL), in which case decoding fails once it is full.
+typedef struct {
+    FILE *in_file;
+    const uint8_t *in;
+    size_t in_pos;
+    size_t in_len;
+    FILE *out_file;
+    uint8_t *out;
+    size_t out_pos;
+    size_t out_capacity;
+    size_t out_limit;  // End of writable memory, including slack
+} RleDecoder;
+
+
+/**
+ * @brief Makes at least need bytes of input available, if the input holds
+ * that many.
+ *
+ * @return size_t Number of bytes available.
+ */
+static size_t refill_input(RleDecoder *decoder, size_t need) {
+    size_t available = decoder->in_len - decoder->in_pos;
+    if (available >= need || decoder->in_file == NULL) {
+        return available;
+    }
+
+    uint8_t *buffer = (uint8_t *)decoder->in;
+    memmove(buffer, buffer + decoder->in_pos, available);
+    decoder->in_pos = 0;
+    decoder->in_len = available;
+
+    size_t bytes_read;
+    while (decoder->in_len < INPUT_BUFFER_SIZE &&
+           (bytes_read = fread(buffer + decoder->in_len, 1, INPUT_BUFFER_SIZE - decoder->in_len,
+                               decoder->in_file)) > 0) {
+        decoder->in_len += bytes_read;
+    }
+    return decoder->in_len;
+}
+
+
+/**
+ * @brief Writes out a file decoder's output buffer.
+ *
+ * @return int 0 on success, -1 on error or when a memory buffer is full.
+ */
+static int flush_output(RleDecoder *decoder) {
+    if (decoder->out_file == NULL) {
+        fprintf(stderr, "RLE output buffer too small.\n");
+        return -1;
+    }
+    if (fwrite(decoder->out, 1, decoder->out_pos, decoder->out_file) != decoder->out_pos ||
+        ferror(decoder->out_file)) {
+        perror("Error writing decompressed data");
         return -1;
     }
+    decoder->out_pos = 0;
+    return 0;
+}
+
+
+/**
+ * @brief Appends count copies of byte to the output.
+ *
+ * Short runs take a single 16-byte store when there is room for it; longer
+ * runs are filled with memset, one output buffer at a time.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int emit_run(RleDecoder *decoder, uint8_t byte, uint64_t count) {
+#ifdef __SSE2__
+    if (count <= RUN_STORE_SIZE && decoder->out_pos + count <= decoder->out_capacity &&
+        decoder->out_limit - decoder->out_pos >= RUN_STORE_SIZE) {
+        _mm_storeu_si128((__m128i *)(decoder->out + decoder->out_pos), _mm_set1_epi8((char)byte));
+        decoder->out_pos += (size_t)count;
+        return 0;
+    }
+#endif
+
+    while (count > 0) {
+        if (decoder->out_pos == decoder->out_capacity && flush_output(decoder) != 0) {
+            return -1;
+        }
+        size_t room = decoder->out_capacity - decoder->out_pos;
+        size_t chunk = count < room ? (size_t)count : room;
+        memset(decoder->out + decoder->out_pos, byte, chunk);
+        decoder->out_pos += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
+
 
+/**
+ * @brief Appends size bytes of data to the output.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int emit_literal(RleDecoder *decoder, const uint8_t *data, size_t size) {
+    if (decoder->out_pos + size > decoder->out_capacity && flush_output(decoder) != 0) {
+        return -1;
+    }
+    if (size > decoder->out_capacity - decoder->out_pos) {
+        fprintf(stderr, "RLE output buffer too small.\n");
+        return -1;
+    }
+    memcpy(decoder->out + decoder->out_pos, data, size);
+    decoder->out_pos += size;
+    return 0;
+}
 
-    uint8_t count, byte;
-    uint8_t buffer[BUFFER_SIZE];
-    (void)buffer;
 
+/**
+ * @brief Decodes the tokens of an RLE v2 stream, after the magic.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int decode_v2(RleDecoder *decoder) {
+    while (1) {
+        size_t available = refill_input(decoder, MAX_TOKEN_SIZE);
+        const uint8_t *p = decoder->in + decoder->in_pos;
 
-    while (fread(&count, 1, 1, input_file) == 1) {
-        if (fread(&byte, 1, 1, input_file) != 1) {
+        uint64_t control;
+        size_t used = decode_varint(p, available, &control);
+        if (used == 0) {
             fprintf(stderr, "Unexpected end of input file.\n");
             return -1;
         }
+        if (control == 0) {
+            decoder->in_pos += used;
+            return 0; // End of tokens
+        }
+
+        uint64_t length = control >> 1;
+        if (control & 1) {
+            if (available < used + 1) {
+                fprintf(stderr, "Unexpected end of input file.\n");
+                return -1;
+            }
+            decoder->in_pos += used + 1;
+            if (emit_run(decoder, p[used], length) != 0) {
+                return -1;
+            }
+        } else {
+            if (length > RLE_MAX_LITERAL) {
+                fprintf(stderr, "Invalid RLE literal length.\n");
+                return -1;
+            }
+            if (available - used < length) {
+                fprintf(stderr, "Unexpected end of input file.\n");
+                return -1;
+            }
+            decoder->in_pos += used + (size_t)length;
+            if (emit_literal(decoder, p + used, (size_t)length) != 0) {
+                return -1;
+            }
+        }
+    }
+}
 
 
-        // Repeat the byte 'count' times
-        for (uint8_t i = 0; i < count; i++) {
-            if (fwrite(&byte, 1, 1, output_file) != 1) {
-                perror("Error writing decompressed data");
+/**
+ * @brief Decodes the (count, byte) pairs of a legacy stream up to the end
+ * of the input.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int decode_v1(RleDecoder *decoder) {
+    size_t available;
+    while ((available = refill_input(decoder, 2)) >= 2) {
+        // Expand every whole pair in the input buffer
+        const uint8_t *p = decoder->in + decoder->in_pos;
+        const uint8_t *end = p + (available & ~(size_t)1);
+        for (; p < end; p += 2) {
+            if (emit_run(decoder, p[1], p[0]) != 0) {
                 return -1;
             }
         }
+        decoder->in_pos = p - decoder->in;
+    }
+
+    if (available != 0) {
+        fprintf(stderr, "Unexpected end of input file.\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Detects the stream format and decodes it.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int decode_stream(RleDecoder *decoder) {
+    // v1 counts are never zero, so a leading zero byte starts the v2 magic
+    size_t available = refill_input(decoder, RLE_MAGIC_SIZE);
+    if (available == 0 || decoder->in[decoder->in_pos] != 0) {
+        return decode_v1(decoder);
+    }
+
+    if (available < RLE_MAGIC_SIZE ||
+        memcmp(decoder->in + decoder->in_pos, RLE_MAGIC, RLE_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "Invalid RLE stream header.\n");
+        return -1;
+    }
+    decoder->in_pos += RLE_MAGIC_SIZE;
+    return decode_v2(decoder);
+}
+
+
+/**
+ * @brief Decodes v2 tokens, dropping the first skip bytes of output and
+ * stopping once length more bytes are written. Tokens straddling either
+ * end are clipped, so a long run costs no more than the part that is kept.
+ *
+ * @return int 0 on success, -1 on error or if the tokens end first.
+ */
+static int decode_window(RleDecoder *decoder, uint64_t skip, uint64_t length) {
+    while (length > 0) {
+        size_t available = refill_input(decoder, MAX_TOKEN_SIZE);
+        const uint8_t *p = decoder->in + decoder->in_pos;
+
+        uint64_t control;
+        size_t used = decode_varint(p, available, &control);
+        if (used == 0 || control == 0) {
+            fprintf(stderr, "Unexpected end of input file.\n");
+            return -1;
+        }
+
+        uint64_t token_length = control >> 1;
+        size_t token_size = used + ((control & 1) ? 1 : (size_t)token_length);
+        if ((!(control & 1) && token_length > RLE_MAX_LITERAL) || available < token_size) {
+            fprintf(stderr, "Invalid RLE token.\n");
+            return -1;
+        }
+        decoder->in_pos += token_size;
+
+        if (skip >= token_length) {
+            skip -= token_length;
+            continue;
+        }
+        uint64_t take = token_length - skip;
+        if (take > length) {
+            take = length;
+        }
+        int result = (control & 1) ? emit_run(decoder, p[used], take)
+                                   : emit_literal(decoder, p + used + skip, (size_t)take);
+        if (result != 0) {
+            return -1;
+        }
+        skip = 0;
+        length -= take;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Runs a file decoder over the input: the whole stream, or with
+ * window set, a slice of the tokens starting at the input's position.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int decode_file(FILE *input_file, FILE *output_file, int window, uint64_t skip, uint64_t length) {
+    if (input_file == NULL || output_file == NULL) {
+        fprintf(stderr, "Invalid file pointers.\n");
+        return -1;
+    }
+
+    uint8_t *in_buffer = malloc(INPUT_BUFFER_SIZE);
+    uint8_t *out_buffer = malloc(OUTPUT_BUFFER_SIZE + RUN_STORE_SIZE);
+    if (!in_buffer || !out_buffer) {
+        fprintf(stderr, "Memory allocation failed for RLE buffers\n");
+        free(in_buffer);
+        free(out_buffer);
+        return -1;
     }
 
+    RleDecoder decoder = {
+        .in_file = input_file,
+        .in = in_buffer,
+        .out_file = output_file,
+        .out = out_buffer,
+        .out_capacity = OUTPUT_BUFFER_SIZE,
+        .out_limit = OUTPUT_BUFFER_SIZE + RUN_STORE_SIZE,
+    };
 
+    int result = window ? decode_window(&decoder, skip, length) : decode_stream(&decoder);
+    if (result == 0) {
+        result = flush_output(&decoder);
+    }
     if (ferror(input_file)) {
         perror("Error reading input file");
-        return -1;
+        result = -1;
     }
 
+    // Hand bytes read past the end marker back to a seekable input
+    if (result == 0 && decoder.in_pos < decoder.in_len) {
+        fseek(input_file, -(long)(decoder.in_len - decoder.in_pos), SEEK_CUR);
+    }
+
+    free(in_buffer);
+    free(out_buffer);
+    return result;
+}
+
+
+int rle_decompress(FILE *input_file, FILE *output_file) {
+    return decode_file(input_file, output_file, 0, 0, 0);
+}
+
 
+int rle_decompress_range(FILE *input_file, FILE *output_file, uint64_t skip, uint64_t length) {
+    return decode_file(input_file, output_file, 1, skip, length);
+}
+
+
+int rle_decompress_buffer(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity,
+                          size_t *decoded_size) {
+    RleDecoder decoder = {
+        .in = src,
+        .in_len = size,
+        .out = dst,
+        .out_capacity = capacity,
+        .out_limit = capacity,
+    };
+
+    if (decode_stream(&decoder) != 0) {
+        return -1;
+    }
+    *decoded_size = decoder.out_pos;
     return 0;
-}
\ No newline at end of file
+}
@@ -1,16 +1,12 @@
 #include "bit_manipulation.h"
 #include <stdio.h>
-
-
-// Static variables for bit buffering
-static uint8_t bit_buffer = 0;  // Buffer to store bits for writing
-static int bit_count = 0;      // Number of bits currently in the buffer
+#include <stdlib.h>
 
 
 // Sets a specific bit in a byte.
 void set_bit(uint8_t *byte, int pos)
 {
-    *byte |= (1 << pos); 
+    *byte |= (1 << pos);
 }
 
 
@@ -29,74 +25,194 @@ bool get_bit(uint8_t byte, int pos)
 }
 
 
-// Reads a single bit from a file.
-// Returns true on success, false on EOF or error.
-bool read_bit(FILE *file, uint8_t *bit)
+// Initializes a writer that appends to a file.
+// Returns 0 on success, -1 on error.
+int bit_writer_init(BitWriter *writer, FILE *file)
 {
-    if (bit_count == 0)
+    writer->buffer = malloc(BIT_IO_BUFFER_SIZE);
+    if (!writer->buffer)
     {
-        // Fill the buffer
-        if (fread(&bit_buffer, 1, 1, file) != 1)
-        {
-            return false; // Error or EOF
-        }
-        bit_count = 8;
+        return -1;
     }
+    writer->file = file;
+    writer->capacity = BIT_IO_BUFFER_SIZE;
+    writer->pos = 0;
+    writer->bits = 0;
+    writer->count = 0;
 
 
-    *bit = get_bit(bit_buffer, 7); // Read the most significant bit
-    bit_buffer <<= 1; // Left-shift the buffer
-    bit_count--;
+    return 0;
+}
 
 
-    return true;
+// Initializes a writer that fills buffer, which holds capacity bytes.
+void bit_writer_init_buffer(BitWriter *writer, uint8_t *buffer, size_t capacity)
+{
+    writer->file = NULL;
+    writer->buffer = buffer;
+    writer->capacity = capacity;
+    writer->pos = 0;
+    writer->bits = 0;
+    writer->count = 0;
 }
 
 
-// Writes a single bit to a file.
+// Releases the writer's buffer. Does not flush.
+void bit_writer_free(BitWriter *writer)
+{
+    if (writer->file)
+    {
+        free(writer->buffer); // Memory writers do not own their buffer
+    }
+    writer->buffer = NULL;
+}
+
+
+// Writes the byte buffer to the file.
 // Returns 0 on success, -1 on error.
-int write_bit(FILE *file, uint8_t bit)
+int bit_writer_drain(BitWriter *writer)
 {
-    bit_buffer <<= 1;     // Make space for the new bit
-    if (bit)
+    if (writer->file == NULL)
     {
-        bit_buffer |= 1;  // Set the least significant bit if needed
+        return -1; // Memory buffer is full
     }
-    bit_count++;
 
 
-    if (bit_count == 8)
+    if (writer->pos > 0)
     {
-        // Buffer is full, write it to the file
-        if (fwrite(&bit_buffer, 1, 1, file) != 1)
+        if (fwrite(writer->buffer, 1, writer->pos, writer->file) != writer->pos)
         {
             return -1; // Error writing
         }
-        bit_buffer = 0;
-        bit_count = 0;
+        writer->pos = 0;
     }
 
 
-    return 0; // Success
+    return 0;
 }
 
 
-// Flush any remaining bits in the buffer to the file.
+// Writes a single bit.
 // Returns 0 on success, -1 on error.
-int flush_bit_buffer(FILE *file)
+int write_bit(BitWriter *writer, uint8_t bit)
 {
-    if (bit_count > 0)
+    return put_bits(writer, bit ? 1 : 0, 1);
+}
+
+
+// Pads the pending bits with zeros to a whole byte and writes everything out.
+// Returns 0 on success, -1 on error.
+int flush_bits(BitWriter *writer)
+{
+    // Room for the pending bytes
+    if (writer->pos + (writer->count + 7) / 8 > writer->capacity && bit_writer_drain(writer) != 0)
+    {
+        return -1;
+    }
+
+
+    while (writer->count >= 8)
+    {
+        writer->count -= 8;
+        writer->buffer[writer->pos++] = (uint8_t)(writer->bits >> writer->count);
+    }
+    if (writer->count > 0)
     {
-        // Pad the buffer with zeros to make a full byte
-        bit_buffer <<= (8 - bit_count);
-        if (fwrite(&bit_buffer, 1, 1, file) != 1)
+        // Pad the last byte with zeros
+        writer->buffer[writer->pos++] = (uint8_t)(writer->bits << (8 - writer->count));
+        writer->count = 0;
+    }
+    writer->bits = 0;
+
+
+    return writer->file ? bit_writer_drain(writer) : 0;
+}
+
+
+// Initializes a reader that consumes a file from its current position.
+// Returns 0 on success, -1 on error.
+int bit_reader_init(BitReader *reader, FILE *file)
+{
+    reader->buffer = malloc(BIT_IO_BUFFER_SIZE);
+    if (!reader->buffer)
+    {
+        return -1;
+    }
+    reader->file = file;
+    reader->pos = 0;
+    reader->length = 0;
+    reader->bits = 0;
+    reader->count = 0;
+
+
+    return 0;
+}
+
+
+// Initializes a reader over size bytes of data.
+void bit_reader_init_buffer(BitReader *reader, const uint8_t *data, size_t size)
+{
+    reader->file = NULL;
+    reader->buffer = (uint8_t *)data; // Only read from
+    reader->pos = 0;
+    reader->length = size;
+    reader->bits = 0;
+    reader->count = 0;
+}
+
+
+// Releases the reader's buffer.
+void bit_reader_free(BitReader *reader)
+{
+    if (reader->file)
+    {
+        free(reader->buffer); // Memory readers do not own their buffer
+    }
+    reader->buffer = NULL;
+}
+
+
+// Refills the accumulator byte by byte, reading more of the file as needed.
+void bit_reader_refill_slow(BitReader *reader)
+{
+    while (reader->count <= 56)
+    {
+        if (reader->pos == reader->length)
         {
-            return -1; // Error writing
+            if (reader->file == NULL)
+            {
+                return; // End of the memory buffer
+            }
+            reader->length = fread(reader->buffer, 1, BIT_IO_BUFFER_SIZE, reader->file);
+            reader->pos = 0;
+            if (reader->length == 0)
+            {
+                return; // Error or EOF
+            }
         }
-        bit_buffer = 0;
-        bit_count = 0;
+        reader->bits |= (uint64_t)reader->buffer[reader->pos++] << (56 - reader->count);
+        reader->count += 8;
     }
+}
 
 
-    return 0; // Success
-}
\ No newline at end of file
+// Reads a single bit.
+// Returns true on success, false on EOF or error.
+bool read_bit(BitReader *reader, uint8_t *bit)
+{
+    if (reader->count == 0)
+    {
+        refill_bits(reader);
+        if (reader->count == 0)
+        {
+            return false; // Error or EOF
+        }
+    }
+
+
+    *bit = (uint8_t)peek_bits(reader, 1);
+    skip_bits(reader, 1);
+
+
+    return true;
+}
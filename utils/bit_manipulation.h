@@ -4,6 +4,36 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stddef.h>
+
+// Size of the byte buffer behind a BitWriter or BitReader.
+#define BIT_IO_BUFFER_SIZE 65536
+
+// Buffered MSB-first bit writer. Pending bits are kept right-aligned in a
+// 64-bit accumulator and whole words are moved to the byte buffer, which is
+// written to the file once it fills up. Without a file the writer fills a
+// caller-provided buffer and fails once it is full. Each writer owns its
+// state, so any number of streams can be written concurrently.
+typedef struct {
+    FILE *file;
+    uint8_t *buffer;
+    size_t capacity;
+    size_t pos;
+    uint64_t bits;  // Pending bits, right-aligned
+    int count;      // Number of pending bits
+} BitWriter;
+
+// Buffered MSB-first bit reader. Bits are kept left-aligned in a 64-bit
+// accumulator so up to 32 bits can be peeked with a single shift. Without a
+// file the reader consumes a caller-provided buffer.
+typedef struct {
+    FILE *file;
+    uint8_t *buffer;
+    size_t pos;
+    size_t length;
+    uint64_t bits;  // Buffered bits, left-aligned
+    int count;      // Number of valid bits in the accumulator
+} BitReader;
 
 // Sets a specific bit in a byte.
 void set_bit(uint8_t *byte, int pos);
@@ -15,16 +45,110 @@ void clear_bit(uint8_t *byte, int pos);
 // Returns true if the bit is set (1), false if the bit is clear (0).
 bool get_bit(uint8_t byte, int pos);
 
-// Reads a single bit from a file.
-// Returns true on success, false on EOF or error.
-bool read_bit(FILE *file, uint8_t *bit);
+// Initializes a writer that appends to a file.
+// Returns 0 on success, -1 on error.
+int bit_writer_init(BitWriter *writer, FILE *file);
+
+// Initializes a writer that fills buffer, which holds capacity bytes.
+void bit_writer_init_buffer(BitWriter *writer, uint8_t *buffer, size_t capacity);
+
+// Releases the writer's buffer. Does not flush.
+void bit_writer_free(BitWriter *writer);
+
+// Writes the byte buffer to the file. Used by put_bits when the buffer fills up.
+// Returns 0 on success, -1 on error or when a memory buffer is full.
+int bit_writer_drain(BitWriter *writer);
+
+// Writes the low nbits (at most 32) of value, most significant bit first.
+// Returns 0 on success, -1 on error.
+static inline int put_bits(BitWriter *writer, uint32_t value, int nbits)
+{
+    writer->bits = (writer->bits << nbits) | value;
+    writer->count += nbits;
+
+    if (writer->count >= 32)
+    {
+        if (writer->pos + 4 > writer->capacity && bit_writer_drain(writer) != 0)
+        {
+            return -1;
+        }
+
+        writer->count -= 32;
+        uint32_t word = (uint32_t)(writer->bits >> writer->count);
+        writer->buffer[writer->pos++] = (uint8_t)(word >> 24);
+        writer->buffer[writer->pos++] = (uint8_t)(word >> 16);
+        writer->buffer[writer->pos++] = (uint8_t)(word >> 8);
+        writer->buffer[writer->pos++] = (uint8_t)word;
+    }
+
+    return 0;
+}
 
-// Writes a single bit to a file.
+// Writes a single bit.
 // Returns 0 on success, -1 on error.
-int write_bit(FILE *file, uint8_t bit);
+int write_bit(BitWriter *writer, uint8_t bit);
 
-// Flush any remaining bits in the buffer to the file.
+// Pads the pending bits with zeros to a whole byte and writes everything out.
+// A memory writer's output size is then writer->pos.
 // Returns 0 on success, -1 on error.
-int flush_bit_buffer(FILE *file);
+int flush_bits(BitWriter *writer);
+
+// Initializes a reader that consumes a file from its current position.
+// Returns 0 on success, -1 on error.
+int bit_reader_init(BitReader *reader, FILE *file);
+
+// Initializes a reader over size bytes of data.
+void bit_reader_init_buffer(BitReader *reader, const uint8_t *data, size_t size);
+
+// Releases the reader's buffer.
+void bit_reader_free(BitReader *reader);
+
+// Refills the accumulator byte by byte, reading more of the file as
+// needed. Used by refill_bits near the end of the buffer.
+void bit_reader_refill_slow(BitReader *reader);
+
+// Tops the accumulator up to at least 56 bits, or as many as remain.
+static inline void refill_bits(BitReader *reader)
+{
+    if (reader->count > 56)
+    {
+        return;
+    }
+
+    // Fast path: load 8 bytes at once and keep the whole bytes that fit
+    if (reader->pos + 8 <= reader->length)
+    {
+        const uint8_t *p = reader->buffer + reader->pos;
+        uint64_t word = ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+                        ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+                        ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+                        ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+        int bytes = (63 - reader->count) >> 3;
+        reader->bits |= word >> reader->count;
+        reader->pos += bytes;
+        reader->count += bytes * 8;
+        return;
+    }
+
+    bit_reader_refill_slow(reader);
+}
+
+// Returns the next nbits (1 to 32) without consuming them. Bits past the end
+// of the stream read as zero; compare nbits with reader->count to detect that.
+static inline uint32_t peek_bits(const BitReader *reader, int nbits)
+{
+    return (uint32_t)(reader->bits >> (64 - nbits));
+}
+
+// Consumes nbits that have already been peeked.
+static inline void skip_bits(BitReader *reader, int nbits)
+{
+    reader->bits <<= nbits;
+    reader->count -= nbits;
+}
+
+// Reads a single bit.
+// Returns true on success, false on EOF or error.
+bool read_bit(BitReader *reader, uint8_t *bit);
 
-#endif // BIT_MANIPULATION_H
\ No newline at end of file
+#endif // BIT_MANIPULATION_H
@@ -0,0 +1,127 @@
+#include "block_pipeline.h"
+#include <stdlib.h>
+
+// Returns the job at index i of a ring of encoder jobs
+static BlockPipelineJob* pipeline_job(const BlockPipeline *pipeline, uint8_t *jobs, int i) {
+    return (BlockPipelineJob *)(jobs + (size_t)i * pipeline->job_size);
+}
+
+// Frees the input buffers and encoder state of a ring of jobs
+static void free_pipeline_jobs(const BlockPipeline *pipeline, uint8_t *jobs, int job_count) {
+    for (int i = 0; i < job_count; i++) {
+        BlockPipelineJob *job = pipeline_job(pipeline, jobs, i);
+        free(job->input);
+        pipeline->free_job(job, pipeline->context);
+    }
+    free(jobs);
+}
+
+// Reads blocks into the job ring, encodes them on the pool and writes them
+// out in order, recording each in the block table.
+// Returns 0 on success, -1 on error.
+int block_pipeline_run(const BlockPipeline *pipeline, FILE *input_file, FILE *output_file,
+                       size_t block_size, int thread_count,
+                       void (*progress_fn)(size_t bytes_processed, size_t total_bytes, void *user_data),
+                       void *user_data, BlockTable *table) {
+    // Get the remaining size of the input for progress tracking. Pipes have
+    // no size; they are read to the end all the same and report 0 as total.
+    size_t total_size = 0;
+    long start = ftell(input_file);
+    if (start >= 0 && fseek(input_file, 0, SEEK_END) == 0) {
+        long end = ftell(input_file);
+        if (end >= start) {
+            total_size = (size_t)(end - start);
+        }
+        if (fseek(input_file, start, SEEK_SET) != 0) {
+            perror("Error seeking in input file");
+            return -1;
+        }
+
+        // Small inputs do not need full-size block buffers
+        if (total_size < block_size) {
+            block_size = total_size > 0 ? total_size : 1;
+        }
+    }
+
+    ThreadPool *pool = thread_count > 1 ? thread_pool_create(thread_count) : NULL;
+    int job_count = pool ? thread_count + 1 : 1;
+
+    uint8_t *jobs = calloc(job_count, pipeline->job_size);
+    if (!jobs) {
+        fprintf(stderr, "Memory allocation failed for compression blocks\n");
+        thread_pool_destroy(pool);
+        return -1;
+    }
+    for (int i = 0; i < job_count; i++) {
+        BlockPipelineJob *job = pipeline_job(pipeline, jobs, i);
+        job->input = malloc(block_size);
+        if (!job->input || pipeline->init_job(job, block_size, job_count, pipeline->context) != 0) {
+            fprintf(stderr, "Memory allocation failed for compression blocks\n");
+            free_pipeline_jobs(pipeline, jobs, job_count);
+            thread_pool_destroy(pool);
+            return -1;
+        }
+    }
+
+    size_t header_size = 0;
+    int result = pipeline->write_header(output_file, block_size, &header_size, pipeline->context);
+
+    BlockTable blocks = {0};
+    blocks.start = header_size;
+    size_t processed = 0;
+    int busy = 0;
+    int eof = 0;
+    for (int next = 0; ; next = (next + 1) % job_count) {
+        BlockPipelineJob *job = pipeline_job(pipeline, jobs, next);
+
+        // Write out the oldest block before reusing its job
+        if (job->busy) {
+            thread_pool_wait_task(pool, &job->task);
+            job->busy = 0;
+            busy--;
+            size_t stored_size;
+            if (result == 0 && pipeline->write_block(output_file, job, &stored_size, pipeline->context) != 0) {
+                perror("Error writing compressed data");
+                result = -1;
+            }
+            if (result == 0 && block_table_add(&blocks, stored_size, job->input_size) != 0) {
+                fprintf(stderr, "Memory allocation failed for block table\n");
+                result = -1;
+            }
+            processed += job->input_size;
+            if (progress_fn) {
+                progress_fn(processed, total_size, user_data);
+            }
+        }
+
+        if (!eof && result == 0) {
+            job->input_size = fread(job->input, 1, block_size, input_file);
+            if (job->input_size > 0) {
+                thread_pool_submit(pool, &job->task, pipeline->encode, job);
+                job->busy = 1;
+                busy++;
+            } else {
+                eof = 1;
+            }
+        }
+
+        if (busy == 0 && (eof || result != 0)) {
+            break;
+        }
+    }
+
+    if (ferror(input_file)) {
+        perror("Error reading input file");
+        result = -1;
+    }
+
+    if (result == 0) {
+        *table = blocks;
+    } else {
+        block_table_free(&blocks);
+    }
+    free_pipeline_jobs(pipeline, jobs, job_count);
+    thread_pool_destroy(pool);
+
+    return result;
+}
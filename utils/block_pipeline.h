@@ -0,0 +1,57 @@
+#ifndef BLOCK_PIPELINE_H
+#define BLOCK_PIPELINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "block_table.h"
+#include "thread_pool.h"
+
+// One block in flight. Encoders embed it as the first member of their own
+// job, which holds the encoded form of the block.
+typedef struct {
+    ThreadPoolTask task;
+    int busy;
+    uint8_t *input;
+    size_t input_size;
+} BlockPipelineJob;
+
+// How a block container encodes its blocks. context is passed through to
+// every callback.
+typedef struct {
+    // Size of the encoder's job, which starts with a BlockPipelineJob
+    size_t job_size;
+
+    // Sets up the encoder buffers of one of job_count jobs for blocks of up
+    // to block_size bytes. Returns 0 on success, -1 on allocation failure.
+    int (*init_job)(BlockPipelineJob *job, size_t block_size, int job_count, void *context);
+
+    // Frees what init_job set up; also called for jobs it was not run on
+    void (*free_job)(BlockPipelineJob *job, void *context);
+
+    // Writes the container header for the final block size and stores its
+    // length in header_size. Returns 0 on success, -1 on error.
+    int (*write_header)(FILE *output_file, size_t block_size, size_t *header_size, void *context);
+
+    // Thread pool task: encodes the block of the job passed as argument
+    ThreadTaskFunction encode;
+
+    // Writes an encoded block and stores the number of bytes written in
+    // stored_size. Returns 0 on success, -1 on error.
+    int (*write_block)(FILE *output_file, const BlockPipelineJob *job, size_t *stored_size, void *context);
+
+    void *context;
+} BlockPipeline;
+
+// Reads the input in blocks of block_size bytes into a ring of jobs, hands
+// each job to a pool of thread_count workers as soon as it is filled and
+// writes the blocks out in input order after the header. Inputs smaller than
+// a block get a smaller block size. table receives the stored and raw size
+// of every block; the caller writes what follows the blocks and frees it.
+// Returns 0 on success, -1 on error.
+int block_pipeline_run(const BlockPipeline *pipeline, FILE *input_file, FILE *output_file,
+                       size_t block_size, int thread_count,
+                       void (*progress_fn)(size_t bytes_processed, size_t total_bytes, void *user_data),
+                       void *user_data, BlockTable *table);
+
+#endif // BLOCK_PIPELINE_H
@@ -0,0 +1,50 @@
+#include "block_table.h"
+#include <stdlib.h>
+
+
+// Appends a block to the table.
+// Returns 0 on success, -1 on allocation failure.
+int block_table_add(BlockTable *table, uint64_t stored_size, uint64_t raw_size)
+{
+    if (table->count == table->capacity)
+    {
+        size_t capacity = table->capacity ? table->capacity * 2 : 64;
+        uint64_t *sizes = realloc(table->sizes, capacity * 2 * sizeof(uint64_t));
+        if (!sizes)
+        {
+            return -1;
+        }
+        table->sizes = sizes;
+        table->capacity = capacity;
+    }
+    table->sizes[2 * table->count] = stored_size;
+    table->sizes[2 * table->count + 1] = raw_size;
+    table->count++;
+
+
+    return 0;
+}
+
+
+// Returns the sum of the raw sizes of all blocks.
+uint64_t block_table_raw_size(const BlockTable *table)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < table->count; i++)
+    {
+        total += table->sizes[2 * i + 1];
+    }
+
+
+    return total;
+}
+
+
+// Releases the table's entries and empties it.
+void block_table_free(BlockTable *table)
+{
+    free(table->sizes);
+    table->sizes = NULL;
+    table->count = 0;
+    table->capacity = 0;
+}
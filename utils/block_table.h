@@ -0,0 +1,26 @@
+#ifndef BLOCK_TABLE_H
+#define BLOCK_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Stored and raw size of each block of a compressed stream. The blocks
+// follow each other without gaps, the first one start bytes into the stream.
+typedef struct {
+    uint64_t start;
+    uint64_t *sizes;   // Pairs of stored size and raw size
+    size_t count;
+    size_t capacity;
+} BlockTable;
+
+// Appends a block to the table.
+// Returns 0 on success, -1 on allocation failure.
+int block_table_add(BlockTable *table, uint64_t stored_size, uint64_t raw_size);
+
+// Returns the sum of the raw sizes of all blocks.
+uint64_t block_table_raw_size(const BlockTable *table);
+
+// Releases the table's entries and empties it.
+void block_table_free(BlockTable *table);
+
+#endif // BLOCK_TABLE_H
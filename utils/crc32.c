@@ -0,0 +1,62 @@
+#include "crc32.h"
+#include <pthread.h>
+
+
+// Slicing-by-8 tables: table[0] is the classic byte table, table[k] advances
+// a byte that is followed by k more bytes
+static uint32_t crc32_table[8][256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+
+// Fills the lookup tables (run once).
+static void crc32_init_table(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+        }
+        crc32_table[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            uint32_t previous = crc32_table[k - 1][i];
+            crc32_table[k][i] = (previous >> 8) ^ crc32_table[0][previous & 0xFF];
+        }
+    }
+}
+
+
+// Returns the checksum of the data so far extended by size bytes of data.
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size)
+{
+    pthread_once(&crc32_table_once, crc32_init_table);
+
+
+    const uint8_t *bytes = data;
+    crc = ~crc;
+
+    // Eight bytes per step
+    while (size >= 8)
+    {
+        uint32_t low = crc ^ ((uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+                              (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24);
+        crc = crc32_table[7][low & 0xFF] ^ crc32_table[6][(low >> 8) & 0xFF] ^
+              crc32_table[5][(low >> 16) & 0xFF] ^ crc32_table[4][low >> 24] ^
+              crc32_table[3][bytes[4]] ^ crc32_table[2][bytes[5]] ^
+              crc32_table[1][bytes[6]] ^ crc32_table[0][bytes[7]];
+        bytes += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+    {
+        crc = (crc >> 8) ^ crc32_table[0][(crc ^ *bytes++) & 0xFF];
+    }
+
+
+    return ~crc;
+}
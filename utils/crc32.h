@@ -0,0 +1,14 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-32 with the IEEE polynomial (reflected 0xEDB88320), the checksum
+// used by zip and gzip. Start with 0 and feed the data in any number of
+// pieces: crc = crc32_update(crc, data, size).
+
+// Returns the checksum of the data so far extended by size bytes of data.
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size);
+
+#endif // CRC32_H
@@ -0,0 +1,102 @@
+#include "histogram.h"
+#include <math.h>
+#include <string.h>
+
+// Number of interleaved count tables. Consecutive bytes go to different
+// tables, so a run of equal bytes increments independent counters instead
+// of waiting for the previous increment to reach memory.
+#define HISTOGRAM_TABLES 8
+
+// Bytes counted per pass, small enough that no 32-bit counter overflows.
+#define HISTOGRAM_CHUNK ((size_t)1 << 30)
+
+// Inputs shorter than this are counted directly; clearing and merging the
+// tables would cost more than it saves.
+#define HISTOGRAM_MIN_INTERLEAVED 1024
+
+
+// Adds the number of occurrences of each byte value in data to counts.
+void histogram_count(const uint8_t *data, size_t size, unsigned *counts)
+{
+    if (size < HISTOGRAM_MIN_INTERLEAVED)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            counts[data[i]]++;
+        }
+        return;
+    }
+
+
+    uint32_t tables[HISTOGRAM_TABLES][HISTOGRAM_SIZE];
+
+    while (size > 0)
+    {
+        size_t chunk = size < HISTOGRAM_CHUNK ? size : HISTOGRAM_CHUNK;
+        size_t i = 0;
+        memset(tables, 0, sizeof(tables));
+
+
+        // Eight bytes per load, one per table
+        for (; i + 8 <= chunk; i += 8)
+        {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+            tables[0][(uint8_t)word]++;
+            tables[1][(uint8_t)(word >> 8)]++;
+            tables[2][(uint8_t)(word >> 16)]++;
+            tables[3][(uint8_t)(word >> 24)]++;
+            tables[4][(uint8_t)(word >> 32)]++;
+            tables[5][(uint8_t)(word >> 40)]++;
+            tables[6][(uint8_t)(word >> 48)]++;
+            tables[7][(uint8_t)(word >> 56)]++;
+        }
+        for (; i < chunk; i++)
+        {
+            tables[0][data[i]]++;
+        }
+
+
+        for (int b = 0; b < HISTOGRAM_SIZE; b++)
+        {
+            uint32_t sum = 0;
+            for (int t = 0; t < HISTOGRAM_TABLES; t++)
+            {
+                sum += tables[t][b];
+            }
+            counts[b] += sum;
+        }
+
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+
+// Returns the Shannon entropy of a histogram in bits per byte.
+double histogram_entropy(const unsigned *counts)
+{
+    double total = 0;
+    for (int b = 0; b < HISTOGRAM_SIZE; b++)
+    {
+        total += counts[b];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+
+
+    double entropy = 0;
+    for (int b = 0; b < HISTOGRAM_SIZE; b++)
+    {
+        if (counts[b] > 0)
+        {
+            double p = counts[b] / total;
+            entropy -= p * log2(p);
+        }
+    }
+
+
+    return entropy;
+}
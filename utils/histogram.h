@@ -0,0 +1,19 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Number of distinct byte values.
+#define HISTOGRAM_SIZE 256
+
+// Adds the number of occurrences of each byte value in data to counts.
+// Counting is spread over several tables so repeated bytes do not stall on
+// the same counter; the tables are merged at the end.
+void histogram_count(const uint8_t *data, size_t size, unsigned *counts);
+
+// Returns the Shannon entropy of a histogram in bits per byte (0 to 8),
+// the lower bound for an order-0 coder such as Huffman.
+double histogram_entropy(const unsigned *counts);
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,44 @@
+#define _GNU_SOURCE // fopencookie
+
+#include "output_sink.h"
+#include "crc32.h"
+#include <errno.h>
+#include <sys/types.h>
+
+static ssize_t output_sink_write(void *cookie, const char *buffer, size_t size) {
+    OutputSink *sink = cookie;
+    // Once a write is refused every later one is too: stdio retries the
+    // rest of a failed write byte by byte
+    if (sink->exceeded || size > sink->limit - sink->written) {
+        sink->exceeded = 1;
+        errno = EFBIG;
+        return -1;
+    }
+    size_t written = fwrite(buffer, 1, size, sink->file);
+    if (sink->checksum) {
+        sink->crc = crc32_update(sink->crc, buffer, written);
+    }
+    sink->written += written;
+    return written == size ? (ssize_t)written : -1;
+}
+
+// Opens a stream that writes at most limit bytes to file.
+// Returns NULL on error.
+FILE* output_sink_open(FILE *file, uint64_t limit, int checksum, OutputSink *sink) {
+    sink->file = file;
+    sink->limit = limit;
+    sink->written = 0;
+    sink->checksum = checksum;
+    sink->crc = 0;
+    sink->exceeded = 0;
+
+    cookie_io_functions_t functions = { NULL, output_sink_write, NULL, NULL };
+    FILE *stream = fopencookie(sink, "wb", functions);
+    if (!stream) {
+        perror("Error opening output stream");
+        return NULL;
+    }
+    // Writers hand over whole buffers; a second buffer here would only copy them
+    setvbuf(stream, NULL, _IONBF, 0);
+    return stream;
+}
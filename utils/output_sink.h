@@ -0,0 +1,25 @@
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Output stream state: writes are passed on to file until limit bytes have
+// been written, then fail, so a decoder stops as soon as a corrupt stream
+// runs past the size recorded for it. With checksum set the bytes written
+// are also run through CRC-32.
+typedef struct {
+    FILE *file;
+    uint64_t limit;
+    uint64_t written;
+    int checksum;
+    uint32_t crc;
+    int exceeded;   // Set once a write went past limit
+} OutputSink;
+
+// Opens an unbuffered stream that writes at most limit bytes to file
+// through sink, which must stay valid until the stream is closed.
+// Returns NULL on error.
+FILE* output_sink_open(FILE *file, uint64_t limit, int checksum, OutputSink *sink);
+
+#endif // OUTPUT_SINK_H
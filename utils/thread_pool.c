@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include "thread_pool.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+
+struct ThreadPool {
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t task_available;  // Signalled when a task is queued or on shutdown
+    pthread_cond_t task_finished;   // Broadcast whenever a task completes
+    ThreadPoolTask *head;
+    ThreadPoolTask *tail;
+    int pending;                    // Queued or running tasks
+    int shutdown;
+};
+
+
+// Returns the number of online processors, at least 1.
+int thread_pool_default_threads(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+
+// Worker loop: run queued tasks until the pool shuts down.
+static void* worker_main(void *arg)
+{
+    ThreadPool *pool = arg;
+
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (pool->head == NULL && !pool->shutdown)
+        {
+            pthread_cond_wait(&pool->task_available, &pool->lock);
+        }
+        if (pool->head == NULL)
+        {
+            break; // Shutdown with an empty queue
+        }
+
+
+        ThreadPoolTask *task = pool->head;
+        pool->head = task->next;
+        if (pool->head == NULL)
+        {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+
+        task->function(task->arg);
+
+
+        pthread_mutex_lock(&pool->lock);
+        task->done = 1;
+        pool->pending--;
+        pthread_cond_broadcast(&pool->task_finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+
+    return NULL;
+}
+
+
+// Starts a pool with thread_count workers. Returns NULL on error.
+ThreadPool* thread_pool_create(int thread_count)
+{
+    if (thread_count < 1)
+    {
+        return NULL;
+    }
+
+
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (!pool)
+    {
+        return NULL;
+    }
+    pool->threads = calloc(thread_count, sizeof(pthread_t));
+    if (!pool->threads)
+    {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->task_available, NULL);
+    pthread_cond_init(&pool->task_finished, NULL);
+
+
+    for (int i = 0; i < thread_count; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0)
+        {
+            break;
+        }
+        pool->thread_count++;
+    }
+    if (pool->thread_count == 0)
+    {
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+
+
+    return pool;
+}
+
+
+// Queues a task, or runs it right away when there is no pool.
+// Returns 0 on success, -1 on error.
+int thread_pool_submit(ThreadPool *pool, ThreadPoolTask *task, ThreadTaskFunction function, void *arg)
+{
+    task->function = function;
+    task->arg = arg;
+    task->done = 0;
+    task->next = NULL;
+
+
+    if (pool == NULL)
+    {
+        function(arg);
+        task->done = 1;
+        return 0;
+    }
+
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail)
+    {
+        pool->tail->next = task;
+    }
+    else
+    {
+        pool->head = task;
+    }
+    pool->tail = task;
+    pool->pending++;
+    pthread_cond_signal(&pool->task_available);
+    pthread_mutex_unlock(&pool->lock);
+
+
+    return 0;
+}
+
+
+// Blocks until the given task has finished.
+void thread_pool_wait_task(ThreadPool *pool, ThreadPoolTask *task)
+{
+    if (pool == NULL)
+    {
+        return; // Ran synchronously in thread_pool_submit
+    }
+
+
+    pthread_mutex_lock(&pool->lock);
+    while (!task->done)
+    {
+        pthread_cond_wait(&pool->task_finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+// Blocks until every submitted task has finished.
+void thread_pool_wait(ThreadPool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+    {
+        pthread_cond_wait(&pool->task_finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+// Waits for queued tasks, stops the workers and frees the pool.
+void thread_pool_destroy(ThreadPool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->task_available);
+    pthread_mutex_unlock(&pool->lock);
+
+
+    for (int i = 0; i < pool->thread_count; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->task_available);
+    pthread_cond_destroy(&pool->task_finished);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,40 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+
+// Function run by a worker thread
+typedef void (*ThreadTaskFunction)(void *arg);
+
+// A unit of work. Tasks are owned by the caller and must stay valid until
+// they have been waited for.
+typedef struct ThreadPoolTask {
+    ThreadTaskFunction function;
+    void *arg;
+    int done;
+    struct ThreadPoolTask *next;
+} ThreadPoolTask;
+
+typedef struct ThreadPool ThreadPool;
+
+// Returns the number of online processors, at least 1.
+int thread_pool_default_threads(void);
+
+// Starts a pool with thread_count workers. Returns NULL on error.
+ThreadPool* thread_pool_create(int thread_count);
+
+// Queues a task. With a NULL pool the task runs immediately on the calling
+// thread, so single-threaded callers can share the same code path.
+// Returns 0 on success, -1 on error.
+int thread_pool_submit(ThreadPool *pool, ThreadPoolTask *task, ThreadTaskFunction function, void *arg);
+
+// Blocks until the given task has finished.
+void thread_pool_wait_task(ThreadPool *pool, ThreadPoolTask *task);
+
+// Blocks until every submitted task has finished.
+void thread_pool_wait(ThreadPool *pool);
+
+// Waits for queued tasks, stops the workers and frees the pool.
+void thread_pool_destroy(ThreadPool *pool);
+
+#endif // THREAD_POOL_H
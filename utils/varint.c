@@ -0,0 +1,94 @@
+#include "varint.h"
+
+
+// Encodes value into dst, which must have room for VARINT_MAX_BYTES.
+// Returns the number of bytes written.
+size_t encode_varint(uint64_t value, uint8_t *dst)
+{
+    size_t length = 0;
+    while (value >= 0x80)
+    {
+        dst[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    dst[length++] = (uint8_t)value;
+
+
+    return length;
+}
+
+
+// Decodes a value from at most size bytes of src.
+// Returns the number of bytes consumed, 0 if the input is truncated or invalid.
+size_t decode_varint(const uint8_t *src, size_t size, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (size_t i = 0; i < size && i < VARINT_MAX_BYTES; i++)
+    {
+        result |= (uint64_t)(src[i] & 0x7F) << (7 * i);
+        if ((src[i] & 0x80) == 0)
+        {
+            *value = result;
+            return i + 1;
+        }
+    }
+
+
+    return 0; // Truncated or longer than 64 bits
+}
+
+
+// Writes a value to a file.
+// Returns 0 on success, -1 on error.
+int write_varint(FILE *file, uint64_t value)
+{
+    uint8_t bytes[VARINT_MAX_BYTES];
+    size_t length = encode_varint(value, bytes);
+    if (fwrite(bytes, 1, length, file) != length)
+    {
+        return -1; // Error writing
+    }
+
+
+    return 0;
+}
+
+
+// Reads a value from a file.
+// Returns 0 on success, -1 on EOF or error.
+int read_varint(FILE *file, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (int i = 0; i < VARINT_MAX_BYTES; i++)
+    {
+        int c = fgetc(file);
+        if (c == EOF)
+        {
+            return -1; // Error or EOF
+        }
+        result |= (uint64_t)(c & 0x7F) << (7 * i);
+        if ((c & 0x80) == 0)
+        {
+            *value = result;
+            return 0;
+        }
+    }
+
+
+    return -1; // Longer than 64 bits
+}
+
+
+// Maps a signed value to an unsigned one that stays small when the value
+// is close to zero.
+uint64_t zigzag_encode(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+
+// Inverse of zigzag_encode.
+int64_t zigzag_decode(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
@@ -0,0 +1,38 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Maximum encoded size of a 64-bit value.
+#define VARINT_MAX_BYTES 10
+
+// Variable-length integers use the LEB128 layout: 7 bits per byte, least
+// significant group first, high bit set on every byte but the last.
+
+// Encodes value into dst, which must have room for VARINT_MAX_BYTES.
+// Returns the number of bytes written.
+size_t encode_varint(uint64_t value, uint8_t *dst);
+
+// Decodes a value from at most size bytes of src.
+// Returns the number of bytes consumed, 0 if the input is truncated or invalid.
+size_t decode_varint(const uint8_t *src, size_t size, uint64_t *value);
+
+// Writes a value to a file.
+// Returns 0 on success, -1 on error.
+int write_varint(FILE *file, uint64_t value);
+
+// Reads a value from a file.
+// Returns 0 on success, -1 on EOF or error.
+int read_varint(FILE *file, uint64_t *value);
+
+// Maps a signed value to an unsigned one that stays small when the value
+// is close to zero (zigzag: 0, -1, 1, -2, ... become 0, 1, 2, 3, ...), so
+// signed values encode compactly as varints.
+uint64_t zigzag_encode(int64_t value);
+
+// Inverse of zigzag_encode.
+int64_t zigzag_decode(uint64_t value);
+
+#endif // VARINT_H